@@ -0,0 +1,45 @@
+-- Decoding throughput for the legacy STRING_EXT and FLOAT_EXT terms.
+-- Run from the repository root with lerl on package.cpath:
+--   lua bench/legacy_terms.lua [iterations]
+
+local lerl = require"lerl"
+
+local iterations = tonumber(arg and arg[1]) or 200
+
+local function repeated(term, count)
+    return "\131" .. string.rep(term, count)
+end
+
+local function string_ext(len)
+    local bytes = {}
+    for i = 1, len do bytes[i] = string.char(32 + i % 90) end
+    return "k" .. string.pack(">I2", len) .. table.concat(bytes)
+end
+
+local function float_ext(value)
+    local text = string.format("%.20e", value)
+    return "c" .. text .. string.rep("\0", 31 - #text)
+end
+
+local floats = {}
+for i = 1, 100 do floats[i] = float_ext((i - 50) * 1234.5678e-3 ^ i) end
+
+local cases = {
+    {"STRING_EXT (64 bytes) as table", repeated(string_ext(64), 1000)},
+    {"STRING_EXT (64 bytes) as string", repeated(string_ext(64), 1000), {strings = true}},
+    {"STRING_EXT (1024 bytes) as table", repeated(string_ext(1024), 100)},
+    {"STRING_EXT (1024 bytes) as string", repeated(string_ext(1024), 100), {strings = true}},
+    {"FLOAT_EXT", "\131" .. string.rep(table.concat(floats), 10)},
+}
+
+for _, case in ipairs(cases) do
+    local name, bytes, options = case[1], case[2], case[3]
+    local decoder = lerl.new_decoder(bytes, nil, options)
+    local start = os.clock()
+    for _ = 1, iterations do
+        decoder:reset(bytes)
+        decoder:unpack_all()
+    end
+    local elapsed = os.clock() - start
+    print(string.format("%-36s %8.2f MB/s", name, #bytes * iterations / elapsed / 1e6))
+end
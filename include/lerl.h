@@ -0,0 +1,67 @@
+/* C interface to lerl for native modules that share a lua_State with it.
+
+   Terms go straight between a byte buffer and the Lua stack, without going through
+   the lerl module table or intermediate Lua strings. Both functions raise Lua errors
+   the same way the Lua API does, so call them from a protected context.
+
+   require loads lerl with RTLD_LOCAL, so its symbols are not visible to other C
+   modules. Either link against the lerl library itself, or require"lerl" and get
+   the functions from the table it publishes in the registry with lerl_get_c_api. */
+
+#ifndef LERL_H
+#define LERL_H
+
+#include <stddef.h>
+#include <lua.h>
+
+#ifndef LERL_API
+#define LERL_API LUALIB_API
+#endif
+
+/* A growable byte buffer. Start it zeroed (or with a malloc'd buf and its size);
+   lerl grows it with realloc and the caller frees buf. The layout matches
+   erlpack_buffer so the encoder writes into it directly. */
+typedef struct lerl_buffer {
+    char* buf;
+    size_t length;
+    size_t allocated_size;
+} lerl_buffer;
+
+/* Decodes every term in data[0, len), which must start with the version byte,
+   and pushes them in order. Returns the number of values pushed.
+
+   options is the stack index of an options table as taken by lerl.new_decoder
+   (limits), or 0 for the defaults. The bytes are only borrowed for the call:
+   decoded strings are copied into Lua. */
+LERL_API int lerl_decode(lua_State* L, const char* data, size_t len, int options);
+
+/* Appends the version byte followed by the values in stack slots first..last
+   (inclusive) to out, exactly as encoder:pack_all would. The stack is left as it
+   was. If packing fails part way, out holds what was written so far and still
+   belongs to the caller. */
+LERL_API void lerl_encode(lua_State* L, int first, int last, lerl_buffer* out);
+
+#define LERL_C_API_KEY "lerl_c_api"
+#define LERL_C_API_VERSION 1
+
+/* The functions above, published as a light userdata in the registry under
+   LERL_C_API_KEY when lerl is required. Fields are only ever added at the end,
+   and version is raised when they are. */
+typedef struct lerl_c_api {
+    int version;
+    int (*decode)(lua_State* L, const char* data, size_t len, int options);
+    void (*encode)(lua_State* L, int first, int last, lerl_buffer* out);
+} lerl_c_api;
+
+/* Returns the table published by the lerl loaded into L, or NULL if lerl has not
+   been required yet or is older than this header. */
+static inline const lerl_c_api* lerl_get_c_api(lua_State* L) {
+    lua_getfield(L, LUA_REGISTRYINDEX, LERL_C_API_KEY);
+    const lerl_c_api* api = (const lerl_c_api*)lua_touserdata(L, -1);
+    lua_pop(L, 1);
+    if (api == NULL || api->version < LERL_C_API_VERSION)
+        return NULL;
+    return api;
+}
+
+#endif
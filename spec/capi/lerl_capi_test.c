@@ -0,0 +1,46 @@
+/* Test module for spec/capi_spec.lua. It reaches lerl only through the registry
+   table from lerl.h, so it does not link against lerl:
+
+       cc -shared -fPIC -Iinclude -o lerl_capi_test.so spec/capi/lerl_capi_test.c */
+
+#include <stdlib.h>
+#include <lua.h>
+#include <lauxlib.h>
+#include "lerl.h"
+
+static const lerl_c_api* lerl_capi_get(lua_State* L) {
+    const lerl_c_api* api = lerl_get_c_api(L);
+    if (api == NULL)
+        luaL_error(L, "lerl_capi_test: lerl has not been required.");
+    return api;
+}
+
+/* Packs every argument into a lerl_buffer and decodes them back. */
+static int lerl_capi_round_trip(lua_State* L) {
+    const lerl_c_api* api = lerl_capi_get(L);
+    int top = lua_gettop(L);
+    lerl_buffer out = {0};
+    api->encode(L, 1, top, &out);
+    lua_pushlstring(L, out.buf, out.length);
+    int count = api->decode(L, out.buf, out.length, 0);
+    free(out.buf);
+    return count + 1;
+}
+
+static int lerl_capi_decode(lua_State* L) {
+    const lerl_c_api* api = lerl_capi_get(L);
+    size_t len;
+    const char* data = luaL_checklstring(L, 1, &len);
+    return api->decode(L, data, len, lua_istable(L, 2) ? 2 : 0);
+}
+
+static const luaL_Reg lerl_capi_functions[] = {
+    {"round_trip", lerl_capi_round_trip},
+    {"decode", lerl_capi_decode},
+    {NULL, NULL}
+};
+
+LUALIB_API int luaopen_lerl_capi_test(lua_State* L) {
+    luaL_newlib(L, lerl_capi_functions);
+    return 1;
+}
@@ -0,0 +1,28 @@
+local lerl = require"lerl"
+
+describe("C API", function()
+    it('is published in the registry', function()
+        assert.are_equal(type(debug.getregistry().lerl_c_api), "userdata")
+    end)
+
+    local ok, capi = pcall(require, "lerl_capi_test")
+    if not ok then
+        pending("build spec/capi/lerl_capi_test.c as lerl_capi_test to run the C API specs")
+        return
+    end
+
+    it('round trips values through a buffer', function()
+        local bytes, n, s, t = capi.round_trip(1, "two", lerl.lerl_array{3})
+        assert.are_equal(bytes, lerl.pack(1) .. lerl.pack("two"):sub(2) .. lerl.pack(lerl.lerl_array{3}):sub(2))
+        assert.are_equal(n, 1)
+        assert.are_equal(s, "two")
+        assert.are_same(t, {3})
+    end)
+
+    it('decodes with options', function()
+        assert.are_same(capi.decode('\x83k\x00\x03abc'), {97, 98, 99})
+        assert.are_equal(capi.decode('\x83k\x00\x03abc', {strings = true}), "abc")
+        assert.has_error(function() capi.decode(lerl.pack("x"), {max_size = 2}) end)
+        assert.has_error(function() capi.decode("x") end)
+    end)
+end)
@@ -81,4 +81,368 @@ describe("unpacks", function()
             assert.are_equal(D:unpack(), i)
         end
     end)
-end)
\ No newline at end of file
+end)
+describe("frames", function()
+    it('iterates complete frames fed in pieces', function()
+        local stream = lerl.pack_framed(2, 1) .. lerl.pack_framed(2, "two") .. lerl.pack_framed(2, 3)
+        local D = lerl.empty_decoder()
+        local seen = {}
+
+        D:feed(stream:sub(1, 6))
+        for _, term in D:frames(2) do seen[#seen + 1] = term end
+        assert.are_same(seen, {1})
+
+        D:feed(stream:sub(7))
+        for _, term in D:frames(2) do seen[#seen + 1] = term end
+        assert.are_same(seen, {1, "two", 3})
+        assert.are_equal(D.offset, D.size)
+    end)
+
+    it('reads compressed frames up to the end of their zlib stream', function()
+        local compressed = 'P\x00\x00\x00\x69\x78\x9c\xcb\x65\x60\x60\x48\x49\xa4\x03\x00\x00\xce\x75\x26\xb6'
+        local frame = '\x00\x16\x83' .. compressed
+        local D, seen = lerl.empty_decoder(), {}
+        D:feed(frame .. frame)
+        for _, term in D:frames(2) do seen[#seen + 1] = term end
+        assert.are_same(seen, {string.rep("a", 100), string.rep("a", 100)})
+
+        local list = '\x83l\x00\x00\x00\x02' .. compressed .. 'a\x07j'
+        assert.are_same(lerl.new_decoder(list):unpack(), {string.rep("a", 100), 7})
+    end)
+end)
+
+describe("snapshots", function()
+    it('round trips through a snapshot file', function()
+        local path = os.tmpname()
+        local W = lerl.new_snapshot_writer(path, 32)
+        for i = 1, 100 do
+            W:pack(lerl.lerl_map{id = i, name = "member" .. i})
+        end
+        W:close()
+
+        local D = lerl.open_snapshot(path)
+        local count = 0
+        while D.offset < D.size do
+            count = count + 1
+            assert.are_same(D:unpack(), {id = count, name = "member" .. count})
+        end
+        assert.are_equal(count, 100)
+        os.remove(path)
+    end)
+
+    it('reads framed snapshots', function()
+        local path = os.tmpname()
+        local f = io.open(path, "wb")
+        f:write(lerl.pack_framed(4, "a"), lerl.pack_framed(4, "b"))
+        f:close()
+
+        local seen = {}
+        for _, term in lerl.open_snapshot(path, nil, {framed = 4}):frames() do seen[#seen + 1] = term end
+        assert.are_same(seen, {"a", "b"})
+        os.remove(path)
+    end)
+
+    it('reads framed snapshots whose first byte looks like a version', function()
+        local path = os.tmpname()
+        local f = io.open(path, "wb")
+        local long = string.rep("x", 0x8300 - 6)
+        f:write(lerl.pack_framed(2, long), lerl.pack_framed(2, "b"))
+        f:close()
+
+        local seen = {}
+        for _, term in lerl.open_snapshot(path, nil, {framed = 2}):frames() do seen[#seen + 1] = term end
+        assert.are_same(seen, {long, "b"})
+        os.remove(path)
+    end)
+
+    it('reads concatenated packs', function()
+        local path = os.tmpname()
+        local f = io.open(path, "wb")
+        f:write(lerl.pack("a"), lerl.pack(lerl.lerl_array{1, 2}), lerl.pack("c"))
+        f:close()
+
+        assert.are_same({lerl.open_snapshot(path):unpack_all()}, {"a", {1, 2}, "c"})
+        local D = lerl.open_snapshot(path, nil, {max_depth = 4})
+        assert.are_equal(D:unpack(), "a")
+        assert.are_same(D:unpack(), {1, 2})
+        assert.are_equal(D:unpack(), "c")
+        os.remove(path)
+    end)
+end)
+
+describe("limits", function()
+    it('validates without decoding', function()
+        local nested = '\x83l\x00\x00\x00\x01l\x00\x00\x00\x01a\x01jj'
+        assert.are_equal(lerl.validate(nested), true)
+
+        local ok, err = lerl.validate(nested, {max_depth = 1})
+        assert.is_nil(ok)
+        assert.are_equal(err, "Term is nested too deeply.")
+    end)
+
+    it('rejects lengths the buffer cannot hold', function()
+        assert.is_nil(lerl.validate('\x83l\xff\xff\xff\xffa\x01j'))
+        assert.has_error(function()
+            lerl.new_decoder('\x83l\xff\xff\xff\xffa\x01j'):unpack()
+        end)
+    end)
+
+    it('rejects implausible compressed sizes', function()
+        assert.is_nil(lerl.validate('\x83P\xff\xff\xff\xff\x78\x9c'))
+        assert.has_error(function()
+            lerl.new_decoder('\x83P\xff\xff\xff\xff\x78\x9c'):unpack()
+        end)
+    end)
+
+    it('skips compressed terms up to the end of their zlib stream', function()
+        local compressed = 'P\x00\x00\x00\x69\x78\x9c\xcb\x65\x60\x60\x48\x49\xa4\x03\x00\x00\xce\x75\x26\xb6'
+        local list = '\x83l\x00\x00\x00\x02' .. compressed .. 'a\x07j'
+        assert.are_equal(lerl.validate(list), true)
+        assert.is_nil(lerl.validate(list:sub(1, -3)))
+        assert.is_nil(lerl.validate((list:gsub('\xcb', '\xcc'))))
+        assert.are_same(lerl.new_decoder(list, nil, {max_depth = 4}):unpack(), {string.rep("a", 100), 7})
+    end)
+
+    it('checks buffers when decoder options are given', function()
+        local bytes = '\x83l\x00\x00\x00\x03a\x01a\x02a\x03j'
+        assert.has_error(function() lerl.new_decoder(bytes, nil, {max_elements = 4}) end)
+        assert.are_same(lerl.new_decoder(bytes, nil, {max_elements = 5}):unpack(), {1, 2, 3})
+    end)
+end)
+
+describe("cache", function()
+    local member = lerl.lerl_map{id = "80351110224678912", name = "someone"}
+    local bytes = lerl.pack(lerl.lerl_array{member, member, member})
+
+    it('shares repeated sub-terms', function()
+        local cache = lerl.new_cache{min_size = 8}
+        local members = lerl.new_decoder(bytes, nil, {cache = cache}):unpack()
+        assert.are_equal(members[1], members[3])
+        assert.are_equal(members[2].name, "someone")
+        assert.has_error(function() members[1].nick = "x" end)
+        assert.are_same(lerl.new_decoder(lerl.pack(members)):unpack(), members)
+
+        local hits, misses, entries = cache:stats()
+        assert.are_same({hits, misses, entries}, {2, 1, 1})
+
+        local again = lerl.new_decoder(bytes, nil, {cache = cache}):unpack()
+        assert.are_equal(again[1], members[1])
+    end)
+
+    it('hands out read-only values', function()
+        local cache = lerl.new_cache{min_size = 8}
+        local list = lerl.pack(lerl.lerl_array{lerl.lerl_array{member, member}})
+        local outer = lerl.new_decoder(list, nil, {cache = cache}):unpack()
+        local members = outer[1]
+        assert.has_error(function() members[1].name = "mallory" end)
+        assert.has_error(function() members[3] = member end)
+        assert.are_equal(#members, 2)
+        local keys = 0
+        for k, v in pairs(members[1]) do keys = keys + 1 end
+        assert.are_equal(keys, 2)
+
+        local again = lerl.new_decoder(list, nil, {cache = cache}):unpack()
+        assert.are_equal(again[1][1].name, "someone")
+        assert.are_same(lerl.new_decoder(lerl.pack(again)):unpack(), {{{id = "80351110224678912", name = "someone"}, {id = "80351110224678912", name = "someone"}}})
+    end)
+
+    it('stays within its budget', function()
+        local cache = lerl.new_cache{min_size = 8, budget = 0}
+        local members = lerl.new_decoder(bytes, nil, {cache = cache}):unpack()
+        assert.are_not_equal(members[1], members[2])
+        assert.are_same(members[1], members[2])
+        assert.are_equal(select(3, cache:stats()), 0)
+    end)
+
+    it('caches terms inside compressed terms', function()
+        local bytes = '\x83P\x00\x00\x00\x20\x78\xda\xcb\x61\x60\x60\x60\x2a\x01\x12\x8c\xb9\x20\x22\x29\x91\x11\x85\x93\x05\x00\x3d\x8f\x04\x27'
+        local D = lerl.new_decoder(bytes, nil, {cache = lerl.new_cache{min_depth = 0, min_size = 1}})
+        local first = D:unpack()
+        D:reset(bytes)
+        local second = D:unpack()
+        assert.are_equal(second[1], first[1])
+        assert.are_same(second, {{b = 1}, {b = 1}})
+    end)
+
+    it('only serves decoders with the same options', function()
+        local cache = lerl.new_cache{min_size = 8}
+        lerl.new_decoder(bytes, nil, {cache = cache}):unpack()
+        assert.has_error(function() lerl.new_decoder(bytes, nil, {cache = cache, utf8 = "reject"}) end)
+        assert.has_error(function() lerl.new_decoder(bytes, nil, {cache = cache, vectors = true}) end)
+        assert.has_error(function() lerl.new_decoder(bytes, false, {cache = cache}) end)
+        local plain = lerl.empty_decoder(nil, {cache = cache})
+        assert.has_error(function() plain:configure{strings = true} end)
+
+        local people = {person = {"name", "age"}}
+        local shared = lerl.new_cache{min_size = 8}
+        lerl.new_decoder(bytes, nil, {cache = shared, records = people}):unpack()
+        lerl.new_decoder(bytes, nil, {cache = shared, records = {person = {"name", "age"}}}):unpack()
+        assert.has_error(function() lerl.new_decoder(bytes, nil, {cache = shared}) end)
+        people.person = {"name"}
+        assert.has_error(function() lerl.new_decoder(bytes, nil, {cache = shared, records = people}) end)
+
+        cache:reset()
+        local members = lerl.new_decoder(bytes, nil, {cache = cache, vectors = true}):unpack()
+        assert.are_equal(members[1].name, "someone")
+    end)
+end)
+
+describe("vectors", function()
+    it('packs integer lists', function()
+        local roles = lerl.lerl_array{1, 300, 80351110224678912, -5}
+        local bytes = lerl.pack(roles)
+        local v = lerl.new_decoder(bytes, nil, {vectors = true}):unpack()
+        assert.are_equal(type(v), "userdata")
+        assert.are_equal(#v, 4)
+        assert.are_equal(v[3], 80351110224678912)
+        assert.is_nil(v[5])
+
+        local seen = {}
+        for i, id in ipairs(v) do seen[i] = id end
+        assert.are_same(seen, {1, 300, 80351110224678912, -5})
+        assert.are_same(v:totable(), seen)
+        assert.are_equal(lerl.pack(v), bytes)
+    end)
+
+    it('keeps STRING_EXT and mixed lists', function()
+        local bytes = '\x83k\x00\x03\x01\x02\x03'
+        local v = lerl.new_decoder(bytes, nil, {vectors = true}):unpack()
+        assert.are_same(v:totable(), {1, 2, 3})
+        assert.are_equal(lerl.pack(v), bytes)
+
+        local mixed = lerl.new_decoder(lerl.pack(lerl.lerl_array{1, "x"}), nil, {vectors = true}):unpack()
+        assert.are_equal(type(mixed), "table")
+    end)
+end)
+
+describe("legacy terms", function()
+    it('decodes STRING_EXT as a string when asked', function()
+        local bytes = '\x83k\x00\x03abc'
+        assert.are_same(lerl.new_decoder(bytes):unpack(), {97, 98, 99})
+        assert.are_equal(lerl.new_decoder(bytes, nil, {strings = true}):unpack(), "abc")
+    end)
+
+    it('parses FLOAT_EXT', function()
+        for _, value in ipairs{0.1, -2.5, 1e300, 5e-324, 0.0} do
+            local text = string.format("%.20e", value)
+            local bytes = '\x83c' .. text .. string.rep('\0', 31 - #text)
+            assert.are_equal(lerl.new_decoder(bytes):unpack(), value)
+        end
+        assert.are_equal(lerl.new_decoder('\x83c1.5' .. string.rep('\0', 28)):unpack(), 1.5)
+    end)
+end)
+
+describe("tuples, proplists and records", function()
+    it('round-trips tuples', function()
+        local bytes = lerl.pack(lerl.lerl_tuple{1, "a", true})
+        assert.are_equal(bytes:sub(2, 3), 'h\x03')
+        local t = lerl.new_decoder(bytes):unpack()
+        assert.are_equal(getmetatable(t).__lerl_type, "tuple")
+        assert.are_equal(lerl.pack(t), bytes)
+    end)
+
+    it('decodes proplists as maps when asked', function()
+        local bytes = '\x83l\x00\x00\x00\x03h\x02s\x01aa\x01h\x02s\x01ba\x02h\x02s\x01aa\x03j'
+        assert.are_equal(#lerl.new_decoder(bytes):unpack(), 3)
+        local m = lerl.new_decoder(bytes, nil, {proplists = true}):unpack()
+        assert.are_equal(getmetatable(m).__lerl_type, "map")
+        assert.are_same(m, {a = 1, b = 2})
+    end)
+
+    it('decodes registered records as keyed tables', function()
+        local bytes = '\x83h\x03s\x06personm\x00\x00\x00\x03boba\x41'
+        local r = lerl.new_decoder(bytes, nil, {records = {person = {"name", "age"}}}):unpack()
+        assert.are_same(r, {name = "bob", age = 65})
+        assert.are_equal(lerl.pack(r), bytes)
+
+        local other = lerl.new_decoder(bytes, nil, {records = {person = {"name"}}}):unpack()
+        assert.are_equal(getmetatable(other).__lerl_type, "tuple")
+
+        local records = {person = {"name", "age"}}
+        lerl.new_decoder(bytes, nil, {records = records}):unpack()
+        records.person = {"nick", "years"}
+        assert.are_same(lerl.new_decoder(bytes, nil, {records = records}):unpack(), {nick = "bob", years = 65})
+    end)
+
+    it('freezes cached records', function()
+        local bytes = '\x83l\x00\x00\x00\x01h\x03s\x06personm\x00\x00\x00\x03boba\x41j'
+        local cache = lerl.new_cache{min_size = 8}
+        local list = lerl.new_decoder(bytes, nil, {cache = cache, records = {person = {"name", "age"}}}):unpack()
+        assert.are_equal(list[1].name, "bob")
+        assert.are_equal(getmetatable(list[1]).__lerl_record, "person")
+        assert.has_error(function() list[1].name = "mallory" end)
+        assert.are_equal(lerl.pack(list), bytes)
+    end)
+end)
+
+describe("identifiers", function()
+    local node = 's\x0dnonode@nohost'
+
+    it('interns PIDs and packs them back as NEW_PID_EXT', function()
+        local pid = '\x83X' .. node .. '\x00\x00\x00\x55\x00\x00\x00\x00\x00\x00\x00\x01'
+        local old = '\x83g' .. node .. '\x00\x00\x00\x55\x00\x00\x00\x00\x01'
+        local a, b = lerl.new_decoder(pid):unpack(), lerl.new_decoder(old):unpack()
+        assert(rawequal(a, b))
+        assert.are_equal(({[a] = true})[b], true)
+        assert.are_equal(a.node, "nonode@nohost")
+        assert.are_equal(a.id, 0x55)
+        assert.are_equal(tostring(a), "<nonode@nohost.85.0>")
+        assert.are_equal(lerl.pack(b), pid)
+    end)
+
+    it('packs references as NEWER_REFERENCE_EXT', function()
+        local ids = '\x00\x00\x00\x01\x00\x00\x00\x02\x00\x00\x00\x03'
+        local ref = '\x83Z\x00\x03' .. node .. '\x00\x00\x00\x02' .. ids
+        local r = lerl.new_decoder('\x83r\x00\x03' .. node .. '\x02' .. ids):unpack()
+        assert.are_same(r.ids, {1, 2, 3})
+        assert.are_equal(lerl.pack(r), ref)
+    end)
+end)
+
+describe("fingerprint", function()
+    it('ignores map order and equivalent encodings', function()
+        local a = '\x83t\x00\x00\x00\x02d\x00\x01ya\x01s\x01xk\x00\x02\x01\x02'
+        local b = '\x83t\x00\x00\x00\x02s\x01xl\x00\x00\x00\x02a\x01b\x00\x00\x00\x02js\x01yn\x01\x00\x01'
+        local a1, a2 = lerl.fingerprint(a)
+        local b1, b2 = lerl.fingerprint(b)
+        assert.are_equal(a1, b1)
+        assert.are_equal(a2, b2)
+        assert.are_not_equal(a1, lerl.fingerprint('\x83t\x00\x00\x00\x02d\x00\x01ya\x02s\x01xk\x00\x02\x01\x02'))
+    end)
+
+    it('hashes the term at a path', function()
+        local bytes = '\x83t\x00\x00\x00\x01s\x01dh\x02a\x07m\x00\x00\x00\x02hi'
+        assert.are_equal(lerl.fingerprint(bytes, {"d", 2}), lerl.fingerprint('\x83m\x00\x00\x00\x02hi'))
+        assert.is_nil(lerl.fingerprint(bytes, {"d", 3}))
+        assert.is_nil(lerl.fingerprint(bytes, {"e"}))
+    end)
+
+    it('reads past compressed terms and bounds them', function()
+        local compressed = 'P\x00\x00\x00\x69\x78\x9c\xcb\x65\x60\x60\x48\x49\xa4\x03\x00\x00\xce\x75\x26\xb6'
+        local plain = 'm\x00\x00\x00\x64' .. string.rep('a', 100)
+        local bytes = '\x83h\x02' .. compressed .. 'a\x07'
+        assert.are_equal(lerl.fingerprint(bytes), lerl.fingerprint('\x83h\x02' .. plain .. 'a\x07'))
+        assert.are_equal(lerl.fingerprint(bytes, {2}), lerl.fingerprint('\x83a\x07'))
+        assert.has_error(function() lerl.fingerprint(bytes, nil, {max_inflated = 64}) end)
+    end)
+end)
+
+describe("utf8", function()
+    local valid = '\x83m\x00\x00\x00\x06h\xc3\xa9llo'
+    local invalid = '\x83m\x00\x00\x00\x03\xed\xa0\x80'
+
+    it('flags or rejects binaries that are not UTF-8', function()
+        assert.are_equal(lerl.new_decoder(valid, nil, {utf8 = "reject"}):unpack(), "h\xc3\xa9llo")
+        assert.has_error(function() lerl.new_decoder(invalid, nil, {utf8 = "reject"}):unpack() end)
+
+        local flagged = lerl.new_decoder(invalid, nil, {utf8 = "flag"}):unpack()
+        assert.are_equal(getmetatable(flagged).__lerl_type, "binary")
+        assert.are_equal(lerl.pack(flagged), invalid)
+    end)
+
+    it('classifies strings', function()
+        assert.are_equal(lerl.classify(string.rep("a", 40)), "ascii")
+        assert.are_equal(lerl.classify(string.rep("a", 40) .. "\xf0\x9f\x98\x80"), "utf8")
+        assert.are_equal(lerl.classify(string.rep("a", 40) .. "\xc0\xaf"), "binary")
+    end)
+end)
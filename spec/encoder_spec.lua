@@ -0,0 +1,154 @@
+local lerl = require"lerl"
+
+describe("packs", function()
+    it('array and map round trip', function()
+        local value = lerl.lerl_map{
+            a = 1,
+            b = lerl.lerl_array{1, 2, 3},
+        }
+        local D = lerl.new_decoder(lerl.pack(value))
+        assert.are_same(D:unpack(), {a = 1, b = {1, 2, 3}})
+    end)
+
+    it('streams chunks to a sink', function()
+        local chunks = {}
+        local E = lerl.new_stream_encoder(function(chunk) chunks[#chunks + 1] = chunk end, 16)
+        local big = ("x"):rep(64)
+        local list = lerl.lerl_array{}
+        for i = 1, 20 do list[i] = i end
+
+        E:pack(list):pack(big):flush()
+
+        assert(#chunks > 1)
+        local D = lerl.new_decoder(table.concat(chunks))
+        local l, s = D:unpack_all()
+        assert.are_same(l, list)
+        assert.are_equal(s, big)
+    end)
+
+    it('packs deeply nested tables', function()
+        local outer = lerl.lerl_array{}
+        local inner = outer
+        for i = 1, 254 do
+            inner[1] = lerl.lerl_array{}
+            inner = inner[1]
+        end
+        local bytes = lerl.pack(outer)
+        assert.are_equal(lerl.pack(lerl.new_decoder(bytes):unpack()), bytes)
+    end)
+end)
+
+describe("untagged tables", function()
+    it('are packed by their keys in auto mode', function()
+        assert.has_error(function() lerl.pack({1, 2}) end)
+
+        local E = lerl.new_encoder{auto = true}
+        local value = {list = {1, 2, {}}, holes = {[1] = "a", [3] = "c"}, [1] = true}
+        local D = lerl.new_decoder(E:pack(value):release())
+        local decoded = D:unpack()
+        assert.are_same(decoded, value)
+        assert.are_equal(getmetatable(decoded.list), getmetatable(lerl.lerl_array{}))
+        assert.are_equal(getmetatable(decoded.holes), getmetatable(lerl.lerl_map{}))
+        assert.are_equal(getmetatable(decoded.list[3]), getmetatable(lerl.lerl_map{}))
+
+        E:configure{empty = "array"}
+        assert.are_equal(E:pack({}):release(), '\x83j')
+    end)
+
+    it('can remember shapes', function()
+        local E = lerl.new_encoder{auto = true, shapes = true}
+        local list = {1, 2, 3}
+        local first = E:pack(list):release()
+        assert.are_equal(E:pack(list):release(), first)
+        assert.are_same(lerl.unpack(first), list)
+
+        list.name = "x"
+        assert.are_same(lerl.unpack(E:pack(list):release()), {1, 2, 3, name = "x"})
+        list.name = nil
+        list[4] = 4
+        assert.are_same(lerl.unpack(E:pack(list):release()), {1, 2, 3, 4})
+        list[5] = 5
+        assert.are_same(lerl.unpack(E:pack(list):release()), {1, 2, 3, 4, 5})
+
+        local plain = lerl.new_encoder{auto = true}
+        local t = {1, 2, 3}
+        E:pack(t):release()
+        t[2] = nil
+        local packed = E:pack(t):release()
+        assert.are_equal(packed, plain:pack(t):release())
+        assert.are_equal(packed, '\x83t\x00\x00\x00\x02a\x01a\x01a\x03a\x03')
+    end)
+end)
+
+describe("deflater", function()
+    local function be32(n)
+        return string.char(n >> 24 & 255, n >> 16 & 255, n >> 8 & 255, n & 255)
+    end
+
+    -- Ends a sync flushed zlib stream with an empty final block and its Adler-32,
+    -- so the decoder can inflate the chunks as a COMPRESSED term.
+    local function compressed_term(chunks, inflated)
+        local a, b = 1, 0
+        for i = 1, #inflated do
+            a = (a + inflated:byte(i)) % 65521
+            b = (b + a) % 65521
+        end
+        return '\x83P' .. be32(#inflated) .. table.concat(chunks) .. '\x03\x00' .. be32(b << 16 | a)
+    end
+
+    it('compresses encoders with a sync flush and keeps its window', function()
+        local z = lerl.new_deflater{level = 9, window = 12}
+        local E = lerl.new_encoder()
+        local term = lerl.lerl_map{t = "MESSAGE_CREATE", d = string.rep("payload ", 20)}
+        local first = z:compress(E:pack(term))
+        assert.are_equal(first:sub(-4), '\x00\x00\xff\xff')
+        assert.are_equal(E:release(), '\x83')
+
+        local second = z:compress(E:pack(term))
+        assert(#second < #first)
+        z:close()
+    end)
+
+    it('writes chunks that inflate to what was packed', function()
+        local z = lerl.new_deflater()
+        local terms, inflated = {}, {'l' .. be32(50)}
+        local chunks = {z:compress(inflated[1])}
+        for i = 1, 50 do
+            terms[i] = lerl.lerl_map{id = i, name = "member" .. i}
+            inflated[i + 1] = lerl.pack(terms[i]):sub(2)
+            chunks[i + 1] = z:compress(inflated[i + 1])
+        end
+        inflated[52], chunks[52] = 'j', z:compress('j')
+        z:close()
+
+        local list = lerl.new_decoder(compressed_term(chunks, table.concat(inflated))):unpack()
+        assert.are_same(list, terms)
+    end)
+
+    it('compresses on a worker thread as it does inline', function()
+        local inline = lerl.new_deflater()
+        local threaded = lerl.new_deflater{threaded = true}
+        assert.are_equal(math.type(threaded:fd()), "integer")
+
+        local E = lerl.new_encoder()
+        local expected = {}
+        for i = 1, 50 do
+            local term = lerl.lerl_map{id = i, name = "member" .. i}
+            expected[i] = inline:compress(E:pack(term))
+            threaded:submit(E:pack(term))
+            if i == 25 then
+                inline:reset()
+                threaded:reset()
+            end
+        end
+
+        local got = {}
+        local deadline = os.time() + 10
+        while #got < 50 and os.time() < deadline do
+            for _, chunk in ipairs(threaded:collect()) do got[#got + 1] = chunk end
+        end
+        assert.are_same(got, expected)
+        inline:close()
+        threaded:close()
+    end)
+end)
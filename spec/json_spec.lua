@@ -0,0 +1,88 @@
+local lerl = require"lerl"
+
+describe("to_json", function()
+    it('transcodes maps, lists and atoms', function()
+        local bytes = '\x83t\x00\x00\x00\x01m\x00\x00\x00\x01al\x00\x00\x00\x03a\x01s\x04trues\x03nilj'
+        assert.are_equal(lerl.to_json(bytes), '{"a":[1,true,null]}')
+    end)
+
+    it('escapes binaries', function()
+        assert.are_equal(lerl.to_json('\x83m\x00\x00\x00\x04"\\\n\x01'), '"\\"\\\\\\n\\u0001"')
+    end)
+
+    it('rejects invalid UTF-8 when asked', function()
+        local text = '\x83m\x00\x00\x00\x25' .. string.rep('a', 32) .. 'h\xc3\xa9"\xc3'
+        assert.are_equal(lerl.to_json(text:sub(1, -2) .. 'x', {utf8 = "reject"}), '"' .. string.rep('a', 32) .. 'h\xc3\xa9\\"x"')
+        assert.has_error(function() lerl.to_json(text, {utf8 = "reject"}) end)
+    end)
+
+    it('replaces invalid UTF-8 unless asked for raw bytes', function()
+        local bytes = '\x83m\x00\x00\x00\x05\xff\xfe\xc3\xa9a'
+        assert.are_equal(lerl.to_json(bytes), '"\\ufffd\\ufffd\xc3\xa9a"')
+        assert.are_equal(lerl.to_json(bytes, {utf8 = "raw"}), '"\xff\xfe\xc3\xa9a"')
+        assert.has_error(function() lerl.to_json(bytes, {utf8 = "flag"}) end)
+    end)
+
+    it('writes unsafe big integers as strings', function()
+        assert.are_equal(lerl.to_json('\x83n\x08\x00\x00\x00\x00\x00\x00\x00\x00\x01'), '"72057594037927936"')
+        assert.are_equal(lerl.to_json('\x83n\x02\x01\x00\x01'), '-256')
+    end)
+
+    it('writes proplists as objects when asked', function()
+        local bytes = '\x83l\x00\x00\x00\x02h\x02s\x01aa\x01h\x02m\x00\x00\x00\x01ba\x02j'
+        assert.are_equal(lerl.to_json(bytes), '[["a",1],["b",2]]')
+        assert.are_equal(lerl.to_json(bytes, {proplists = true}), '{"a":1,"b":2}')
+    end)
+
+    it('bounds compressed terms', function()
+        local bytes = '\x83P\x00\x00\x00\x69\x78\x9c\xcb\x65\x60\x60\x48\x49\xa4\x03\x00\x00\xce\x75\x26\xb6'
+        assert.are_equal(lerl.to_json(bytes), '"' .. string.rep('a', 100) .. '"')
+        assert.has_error(function() lerl.to_json(bytes, {max_inflated = 64}) end)
+        assert.has_error(function() lerl.to_json('\x83P\x7f\xff\xff\xff\x78\x9c\x03\x00\x00\x00\x00\x01') end)
+
+        local list = '\x83l\x00\x00\x00\x02' .. bytes:sub(2) .. 'a\x07j'
+        assert.are_equal(lerl.to_json(list), '["' .. string.rep('a', 100) .. '",7]')
+    end)
+end)
+
+describe("from_json", function()
+    it('packs JSON values as terms', function()
+        local json = '{"a":[1,true,null,-70000,0.25,"x\\u00e9"],"b":{},"c":[]}'
+        assert.are_equal(lerl.to_json(lerl.from_json(json)), '{"a":[1,true,null,-70000,0.25,"xé"],"b":{},"c":[]}')
+        assert.are_equal(lerl.from_json('[300]'), '\x83l\x00\x00\x00\x01b\x00\x00\x01\x2cj')
+    end)
+
+    it('maps literals, numbers and snowflakes as asked', function()
+        local t = lerl.unpack(lerl.from_json('{"id":"80351110224678912","ok":true,"n":2}',
+            {snowflakes = true, ["true"] = "yes", integers = false}))
+        assert.are_equal(t.id, 80351110224678912)
+        assert.are_equal(t.ok, "yes")
+        assert.are_equal(math.type(t.n), "float")
+    end)
+
+    it('keeps the last value of a repeated key', function()
+        assert.are_equal(lerl.to_json(lerl.from_json('{"a":1,"b":{"x":1,"x":2},"a":3}')), '{"b":{"x":2},"a":3}')
+
+        local pairs = {}
+        for i = 1, 40 do pairs[i] = ('"k%d":%d'):format(i % 25, i) end
+        local t = lerl.unpack(lerl.from_json("{" .. table.concat(pairs, ",") .. "}"))
+        local count = 0
+        for _ in next, t do count = count + 1 end
+        assert.are_equal(count, 25)
+        assert.are_equal(t.k1, 26)
+        assert.are_equal(t.k24, 24)
+    end)
+
+    it('appends to an encoder', function()
+        local e = lerl.new_encoder()
+        assert.are_equal(lerl.from_json('[1]', {encoder = e}), e)
+        e:pack(2)
+        assert.are_same({lerl.unpack(e:release())}, {{1}, 2})
+    end)
+
+    it('rejects malformed documents', function()
+        for _, json in ipairs{'', '[1,]', '{"a" 1}', '"\\x"', '[01]', '1 2', '"\1"'} do
+            assert.has_error(function() lerl.from_json(json) end)
+        end
+    end)
+end)
@@ -0,0 +1,45 @@
+local lerl = require"lerl"
+
+describe("rings", function()
+    it('passes terms between handles in order', function()
+        local producer = lerl.new_ring(256)
+        local consumer = lerl.open_ring(producer:handle())
+
+        assert.are_equal(consumer:wait(0), false)
+        assert(producer:push(1, "two"))
+        assert(producer:push(lerl.lerl_array{3}))
+
+        local one, two = consumer:pop()
+        assert.are_equal(one, 1)
+        assert.are_equal(two, "two")
+        assert.are_same(consumer:pop(), {3})
+        assert.is_nil(consumer:pop())
+    end)
+
+    it('refuses records when full', function()
+        local ring = lerl.new_ring(64)
+        assert(ring:push("0123456789"))
+        assert(ring:push("0123456789"))
+        assert.are_equal(ring:push("0123456789"), false)
+        assert.are_equal(ring:pop(), "0123456789")
+        assert(ring:push("0123456789"))
+    end)
+
+    it('only opens live rings', function()
+        assert.has_error(function() lerl.open_ring(4096) end)
+
+        local ring = lerl.new_ring(64)
+        local handle = ring:handle()
+        ring:close()
+        assert.has_error(function() lerl.open_ring(handle) end)
+    end)
+
+    it('drops a push that failed partway', function()
+        local ring = lerl.new_ring(256)
+        assert.has_error(function() ring:push("first", print) end)
+        assert(ring:push("second"))
+        local one, two = ring:pop()
+        assert.are_equal(one, "second")
+        assert.is_nil(two)
+    end)
+end)
@@ -7,15 +7,69 @@
 #include <stdbool.h>
 #include <zlib.h>
 #include <inttypes.h>
+#include <float.h>
+#include "lerl.h"
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define LERL_HAS_SSE2 1
+#endif
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#include <immintrin.h>
+#define LERL_HAS_AVX2 1
+#endif
+
+#ifndef _WIN32
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#ifdef __linux__
+#include <sys/eventfd.h>
+#endif
+#include <pthread.h>
+#define LERL_HAS_RING 1
+#define LERL_HAS_THREADS 1
+#endif
 
 #define lerl_encoder_type "lerl_encoder"
 #define lerl_decoder_type "lerl_decoder"
+#define lerl_ring_type "lerl_ring"
+#define lerl_vector_type "lerl_vector"
+#define lerl_ident_type "lerl_ident"
 
 #define lerl_array_mt "lerl_decoded_array"
 #define lerl_map_mt "lerl_decoded_map"
+#define lerl_tuple_mt "lerl_decoded_tuple"
+#define lerl_binary_mt "lerl_binary"
+#define lerl_frozen_array_mt "lerl_cached_array"
+#define lerl_frozen_map_mt "lerl_cached_map"
+#define lerl_frozen_tuple_mt "lerl_cached_tuple"
+
+#ifndef ATOM_UTF8_EXT
+#define ATOM_UTF8_EXT 'v'
+#endif
+#ifndef SMALL_ATOM_UTF8_EXT
+#define SMALL_ATOM_UTF8_EXT 'w'
+#endif
+#ifndef NEW_PID_EXT
+#define NEW_PID_EXT 'X'
+#endif
+#ifndef NEW_PORT_EXT
+#define NEW_PORT_EXT 'Y'
+#endif
+#ifndef NEWER_REFERENCE_EXT
+#define NEWER_REFERENCE_EXT 'Z'
+#endif
+#ifndef V4_PORT_EXT
+#define V4_PORT_EXT 'x'
+#endif
 
 #define DEFAULT_RECURSE_LIMIT 256
 #define INITIAL_BUFFER_SIZE (1024 * 1024)
+#define DEFAULT_CHUNK_SIZE (64 * 1024)
 
 #define check_ret(n) if ((ret) != 0) { \
     e->ret = (ret); \
@@ -30,21 +84,63 @@
 
 typedef struct {
     erlpack_buffer pk;
+    erlpack_buffer* out; // Where terms are packed, &pk unless packing for the C API.
     int ret;
+    int sink_ref; // LUA_NOREF unless this is a streaming encoder.
+    FILE* file; // Owned sink of a snapshot writer.
+    size_t chunk_size;
+    bool auto_tables; // Pack tables without a __lerl_type as lists or maps by their keys.
+    bool empty_array; // Pack untagged empty tables as lists rather than maps.
+    int shapes_ref; // Weak table of untagged tables to their length if lists or false, or LUA_NOREF.
 } lerl_encoder;
 
+static bool lerl_streaming(lerl_encoder* e) {
+    return e->sink_ref != LUA_NOREF || e->file != NULL;
+}
+
 static lerl_encoder* lerl_get_encoder(lua_State* L, int at) {
     return luaL_checkudata(L, at, lerl_encoder_type);
 }
 
-static int lerl_new_encoder2(lua_State* L, bool skip_version) {
+static bool lerl_opt_boolean(lua_State* L, int opts_at, const char* key, bool def) {
+    if (!lua_istable(L, opts_at))
+        return def;
+    int t = lua_getfield(L, opts_at, key);
+    bool value = t == LUA_TNIL ? def : lua_toboolean(L, -1);
+    lua_pop(L, 1);
+    return value;
+}
+
+static lua_Integer lerl_opt_integer(lua_State* L, int opts_at, const char* key, lua_Integer def) {
+    if (!lua_istable(L, opts_at))
+        return def;
+    int t = lua_getfield(L, opts_at, key);
+    if (t != LUA_TNIL && !lua_isinteger(L, -1))
+        luaL_error(L, "lerl: Option '%s' must be an integer.", key);
+    lua_Integer value = t == LUA_TNIL ? def : lua_tointeger(L, -1);
+    lua_pop(L, 1);
+    return value;
+}
+
+static int lerl_new_encoder2(lua_State* L, bool skip_version, size_t initial_size) {
 
     lerl_encoder* the_encoder = lua_newuserdata(L, sizeof(lerl_encoder));
 
-    the_encoder->pk.buf = (char*)malloc(INITIAL_BUFFER_SIZE);
-    the_encoder->pk.allocated_size = INITIAL_BUFFER_SIZE;
+    the_encoder->pk.buf = (char*)malloc(initial_size);
+    the_encoder->pk.allocated_size = initial_size;
     the_encoder->pk.length = 0;
+    the_encoder->out = &the_encoder->pk;
     the_encoder->ret = 0;
+    the_encoder->sink_ref = LUA_NOREF;
+    the_encoder->file = NULL;
+    the_encoder->chunk_size = 0;
+    the_encoder->auto_tables = false;
+    the_encoder->empty_array = false;
+    the_encoder->shapes_ref = LUA_NOREF;
+
+    if (the_encoder->pk.buf == NULL)
+        return luaL_error(L, "lerl_encoder.new: Failed to allocate buffer!");
+
     if (!skip_version)
         the_encoder->ret = erlpack_append_version(&the_encoder->pk);
 
@@ -56,915 +152,5636 @@ static int lerl_new_encoder2(lua_State* L, bool skip_version) {
     return 1;
 }
 
+static void lerl_configure_encoder(lua_State* L, lerl_encoder* e, int at);
+
 static int lerl_new_encoder(lua_State* L) {
-    return lerl_new_encoder2(L, false);
+    lua_settop(L, 1);
+    lerl_new_encoder2(L, false, INITIAL_BUFFER_SIZE);
+    lerl_configure_encoder(L, lerl_get_encoder(L, -1), 1);
+    return 1;
+}
+
+/* A streaming encoder hands its buffer to a sink (a function or an io file handle)
+   whenever at least chunk_size bytes are pending, so memory use stays bounded by
+   the chunk size rather than the size of the term. */
+static int lerl_new_stream_encoder(lua_State* L) {
+    int sink_type = lua_type(L, 1);
+    luaL_argexpected(L,
+        sink_type == LUA_TFUNCTION || luaL_testudata(L, 1, LUA_FILEHANDLE) != NULL,
+        1, "function or file");
+
+    lua_Integer chunk_size = luaL_optinteger(L, 2, DEFAULT_CHUNK_SIZE);
+    luaL_argcheck(L, chunk_size > 0, 2, "chunk size must be positive");
+
+    lua_settop(L, 1);
+    int sink_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+
+    lerl_new_encoder2(L, false, (size_t)chunk_size * 2);
+    lerl_encoder* e = lerl_get_encoder(L, -1);
+    e->sink_ref = sink_ref;
+    e->chunk_size = (size_t)chunk_size;
+    return 1;
+}
+
+/* Snapshot writers are streaming encoders that own the file they write to. The
+   result is a version header followed by every packed term, which open_snapshot
+   reads back. */
+static int lerl_new_snapshot_writer(lua_State* L) {
+    const char* path = luaL_checkstring(L, 1);
+    lua_Integer chunk_size = luaL_optinteger(L, 2, DEFAULT_CHUNK_SIZE);
+    luaL_argcheck(L, chunk_size > 0, 2, "chunk size must be positive");
+
+    lerl_new_encoder2(L, false, (size_t)chunk_size * 2);
+    lerl_encoder* e = lerl_get_encoder(L, -1);
+
+    e->file = fopen(path, "wb");
+    if (e->file == NULL)
+        return luaL_fileresult(L, 0, path);
+
+    e->chunk_size = (size_t)chunk_size;
+    return 1;
 }
 
 static int lerl_encoder_gc(lua_State* L) {
     lerl_encoder* e = lerl_get_encoder(L, 1);
 
+    if (e->file != NULL) {
+        // Nothing may call into Lua from here, so write the tail out directly.
+        fwrite(e->pk.buf, 1, e->pk.length, e->file);
+        fclose(e->file);
+        e->file = NULL;
+    }
+
     if (e->pk.buf != NULL) {
         free(e->pk.buf);
     }
 
+    if (e->sink_ref != LUA_NOREF)
+        luaL_unref(L, LUA_REGISTRYINDEX, e->sink_ref);
+    if (e->shapes_ref != LUA_NOREF)
+        luaL_unref(L, LUA_REGISTRYINDEX, e->shapes_ref);
+    e->shapes_ref = LUA_NOREF;
+
     e->pk.buf = NULL;
     e->pk.allocated_size = 0;
     e->pk.length = 0;
+    e->sink_ref = LUA_NOREF;
     return 0;
 }
 
-static int lerl_pack_at(lua_State* L, int encoder_at, int object_at, int limit) {
-    if (limit <= 0)
-        return luaL_error(L, "lerl_encoder:pack Maximum pack depth reached!");
-
-    lerl_encoder* e = lerl_get_encoder(L, encoder_at);
-
-    if (e->ret != 0)
-        return luaL_error(L, "lerl_encoder:pack Encoder buffer is in a bad state.");
-
-    int the_type = lua_type(L, object_at);
-    int ret;
-    switch (the_type) {
-        case LUA_TNIL:;
-            ret = erlpack_append_nil(&e->pk);
-            check_ret("pack nil")
-            break;
-        case LUA_TBOOLEAN:;
-            ret = lua_toboolean(L, object_at) ? erlpack_append_true(&e->pk) : erlpack_append_false(&e->pk);
-            check_ret("pack boolean")
-            break;
-        case LUA_TNUMBER:
-            if (lua_isinteger(L, object_at)) {
-                lua_Integer I = lua_tointeger(L, object_at);
-
-                if (0 <= I && I <= 255) {
-                    ret = erlpack_append_small_integer(&e->pk, (unsigned char)I);
-                    check_ret("pack small integer")
-                } else {
-#if LUA_INT_TYPE == LUA_INT_LONGLONG
-                    ret = erlpack_append_long_long(&e->pk, I);
-                    check_ret("pack long long integer")
-#elif LUA_INT_TYPE == LUA_INT_LONG
-                    ret = erlpack_append_integer(&e->pk, I);
-                    check_ret("pack long integer")
-#elif LUA_INT_TYPE == LUA_INT_INT
-                    ret = erlpack_append_integer(&e->pk, I);
-                    check_ret("pack integer")
-#endif
-                }
-            } else {
-                lua_Number N = lua_tonumber(L, object_at);
-                ret = erlpack_append_double(&e->pk, (double)N);
-                check_ret("pack double")
-            }
-        break;
-
-        case LUA_TSTRING:;
-            size_t len;
-            const char *str = lua_tolstring(L, object_at, &len);
-            ret = erlpack_append_binary(&e->pk, str, len);
-            check_ret("pack string")
-            break;
-        case LUA_TTABLE:
-            if (luaL_getmetafield(L, object_at, "__lerl_type") == LUA_TSTRING) {
-                size_t flen;
-                const char* ttype = lua_tolstring(L, -1, &flen);
-
-                if (flen == 5 && strncmp(ttype, "array", 5) == 0) {
-                    lua_pop(L, 1);
-                    size_t count = 0;
-
-                    ret = erlpack_append_list_header(&e->pk, 0);
-                    size_t destination = e->pk.length - 4;
+/* Passes bytes to the encoder's sink. If string_at is non-zero the bytes are the
+   contents of the Lua string at that slot and it is handed over without a copy. */
+static void lerl_write_sink(lua_State* L, lerl_encoder* e, const char* data, size_t len, int string_at) {
+    if (len == 0)
+        return;
 
-                    check_ret("pack list header")
+    if (e->file != NULL) {
+        if (fwrite(data, 1, len, e->file) != len)
+            luaL_error(L, "lerl_encoder.flush: Failed to write to the snapshot file.");
+        return;
+    }
 
-                    for (;;) {
-                        count = count + 1;
+    lua_rawgeti(L, LUA_REGISTRYINDEX, e->sink_ref);
+    if (lua_type(L, -1) == LUA_TFUNCTION) {
+        if (string_at != 0)
+            lua_pushvalue(L, string_at);
+        else
+            lua_pushlstring(L, data, len);
+        lua_call(L, 1, 0);
+    } else {
+        luaL_Stream* stream = luaL_checkudata(L, -1, LUA_FILEHANDLE);
+        if (stream->closef == NULL)
+            luaL_error(L, "lerl_encoder.flush: The sink file is closed.");
+        if (fwrite(data, 1, len, stream->f) != len)
+            luaL_error(L, "lerl_encoder.flush: Failed to write to the sink file.");
+        lua_pop(L, 1);
+    }
+}
 
-                        if (lua_geti(L, object_at, count) == LUA_TNIL) {
-                            lua_pop(L, 1);
-                            break;
-                        }
+static void lerl_flush_buffer(lua_State* L, lerl_encoder* e) {
+    size_t len = e->pk.length;
+    // Reset first so an erroring sink doesn't get the same bytes twice.
+    e->pk.length = 0;
+    lerl_write_sink(L, e, e->pk.buf, len, 0);
+}
 
-                        ret = lerl_pack_at(L, 1, lua_gettop(L), limit - 1);
+static void lerl_maybe_flush(lua_State* L, lerl_encoder* e) {
+    if (lerl_streaming(e) && e->pk.length >= e->chunk_size)
+        lerl_flush_buffer(L, e);
+}
 
-                        lua_pop(L, 1);
-                        take_ret()
-                    }
+static size_t lerl_count_array(lua_State* L, int object_at) {
+    size_t count = 0;
+    while (lua_geti(L, object_at, count + 1) != LUA_TNIL) {
+        lua_pop(L, 1);
+        count = count + 1;
+    }
+    lua_pop(L, 1);
+    return count;
+}
 
-                    count = count - 1;
+static size_t lerl_count_map(lua_State* L, int object_at) {
+    size_t count = 0;
+    lua_pushnil(L);
+    while (lua_next(L, object_at) != 0) {
+        lua_pop(L, 1);
+        count = count + 1;
+    }
+    return count;
+}
 
-                    size_t end = e->pk.length;
-                    e->pk.length = destination;
-                    char count_buf[4] = {0};
-                    _erlpack_store32(count_buf, count);
-                    ret = erlpack_buffer_write(&e->pk, (const char *)count_buf, 4);
-                    e->pk.length = end;
+/* Text scanning, shared by UTF-8 validation and JSON escaping. lerl_text_scan finds
+   the first byte of the given classes 16 or 32 bytes at a time with SSE2 or AVX2,
+   the latter picked when the module loads, or 8 at a time in portable code.
+   Multi-byte UTF-8 sequences are then checked one at a time. */
 
-                    check_ret("upsert list length")
+enum {
+    LERL_TEXT_HIGH = 1, // Bytes >= 0x80.
+    LERL_TEXT_JSON = 2  // Bytes JSON strings must escape.
+};
 
-                    ret = erlpack_append_nil_ext(&e->pk);
+#define LERL_ONES 0x0101010101010101ULL
+#define LERL_HIGHS 0x8080808080808080ULL
 
-                    check_ret("pack nil tail")
+static bool lerl_text_byte(uint8_t ch, int classes) {
+    return ((classes & LERL_TEXT_HIGH) && ch >= 0x80)
+        || ((classes & LERL_TEXT_JSON) && (ch < 0x20 || ch == '"' || ch == '\\'));
+}
 
-                } else if (flen == 3 && strcmp(ttype, "map") == 0) {
-                    lua_pop(L, 1);
-                    size_t count = 0;
+static unsigned lerl_ctz32(uint32_t x) {
+#if defined(__GNUC__) || defined(__clang__)
+    return (unsigned)__builtin_ctz(x);
+#else
+    unsigned n = 0;
+    for (; (x & 1) == 0; x >>= 1)
+        n++;
+    return n;
+#endif
+}
 
+static size_t lerl_text_scan_scalar(const uint8_t* p, size_t len, int classes) {
+    size_t i = 0;
+    for (; i + 8 <= len; i += 8) {
+        uint64_t w;
+        memcpy(&w, p + i, 8);
+        uint64_t hit = (classes & LERL_TEXT_HIGH) ? w : 0;
+        if (classes & LERL_TEXT_JSON) {
+            // Sets the high bit of bytes below 0x20 or equal to '"' or '\\'. Borrows
+            // only mark bytes above a real match, which the byte loop never reaches.
+            uint64_t quote = w ^ (LERL_ONES * '"'), backslash = w ^ (LERL_ONES * '\\');
+            hit |= ((w - LERL_ONES * 0x20) | (quote - LERL_ONES) | (backslash - LERL_ONES)) & ~w;
+        }
+        if (hit & LERL_HIGHS)
+            break;
+    }
+    for (; i < len; i++) {
+        if (lerl_text_byte(p[i], classes))
+            break;
+    }
+    return i;
+}
 
-                    ret = erlpack_append_map_header(&e->pk, count);
+#ifdef LERL_HAS_SSE2
+static size_t lerl_text_scan_sse2(const uint8_t* p, size_t len, int classes) {
+    const __m128i ctrl = _mm_set1_epi8(0x1f), quote = _mm_set1_epi8('"'), backslash = _mm_set1_epi8('\\');
+    size_t i = 0;
+    for (; i + 16 <= len; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i*)(p + i));
+        int mask = (classes & LERL_TEXT_HIGH) ? _mm_movemask_epi8(v) : 0;
+        if (classes & LERL_TEXT_JSON) {
+            __m128i hit = _mm_or_si128(_mm_cmpeq_epi8(_mm_min_epu8(v, ctrl), v),
+                _mm_or_si128(_mm_cmpeq_epi8(v, quote), _mm_cmpeq_epi8(v, backslash)));
+            mask |= _mm_movemask_epi8(hit);
+        }
+        if (mask != 0)
+            return i + lerl_ctz32((uint32_t)mask);
+    }
+    return i + lerl_text_scan_scalar(p + i, len - i, classes);
+}
+#endif
 
-                    check_ret("pack map header")
+#ifdef LERL_HAS_AVX2
+static bool lerl_use_avx2 = false;
+
+__attribute__((target("avx2")))
+static size_t lerl_text_scan_avx2(const uint8_t* p, size_t len, int classes) {
+    const __m256i ctrl = _mm256_set1_epi8(0x1f), quote = _mm256_set1_epi8('"'), backslash = _mm256_set1_epi8('\\');
+    size_t i = 0;
+    for (; i + 32 <= len; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i*)(p + i));
+        int mask = (classes & LERL_TEXT_HIGH) ? _mm256_movemask_epi8(v) : 0;
+        if (classes & LERL_TEXT_JSON) {
+            __m256i hit = _mm256_or_si256(_mm256_cmpeq_epi8(_mm256_min_epu8(v, ctrl), v),
+                _mm256_or_si256(_mm256_cmpeq_epi8(v, quote), _mm256_cmpeq_epi8(v, backslash)));
+            mask |= _mm256_movemask_epi8(hit);
+        }
+        if (mask != 0) {
+            _mm256_zeroupper();
+            return i + lerl_ctz32((uint32_t)mask);
+        }
+    }
+    // The rest runs as legacy SSE code, which stalls while upper halves are dirty.
+    _mm256_zeroupper();
+    return i + lerl_text_scan_sse2(p + i, len - i, classes);
+}
+#endif
 
-                    size_t destination = e->pk.length - 4;
-                    lua_pushnil(L);
+/* Returns the offset of the first byte in p[0, len) of one of the classes, or len. */
+static size_t lerl_text_scan(const uint8_t* p, size_t len, int classes) {
+#ifdef LERL_HAS_AVX2
+    if (lerl_use_avx2 && len >= 32)
+        return lerl_text_scan_avx2(p, len, classes);
+#endif
+#ifdef LERL_HAS_SSE2
+    return lerl_text_scan_sse2(p, len, classes);
+#else
+    return lerl_text_scan_scalar(p, len, classes);
+#endif
+}
 
-                    while (lua_next(L, object_at) != 0) {
-                        count = count + 1;
-                        if (count > INT32_MAX)
-                            return luaL_error(L, "lerl_encoder.pack: lerl.map has too many key-value properties!");
+static void lerl_text_init(void) {
+#ifdef LERL_HAS_AVX2
+    __builtin_cpu_init();
+    lerl_use_avx2 = __builtin_cpu_supports("avx2");
+#endif
+}
 
-                        int top = lua_gettop(L);
+/* Length of the well formed UTF-8 sequence at p, which starts with a byte >= 0x80,
+   or 0 if it is truncated, overlong, a surrogate or past U+10FFFF. */
+static size_t lerl_utf8_sequence(const uint8_t* p, size_t len) {
+    uint8_t c = p[0];
+    if (c >= 0xC2 && c <= 0xDF)
+        return len >= 2 && (p[1] & 0xC0) == 0x80 ? 2 : 0;
+    if (c >= 0xE0 && c <= 0xEF) {
+        if (len < 3 || (p[2] & 0xC0) != 0x80)
+            return 0;
+        uint8_t lo = c == 0xE0 ? 0xA0 : 0x80, hi = c == 0xED ? 0x9F : 0xBF;
+        return p[1] >= lo && p[1] <= hi ? 3 : 0;
+    }
+    if (c >= 0xF0 && c <= 0xF4) {
+        if (len < 4 || (p[2] & 0xC0) != 0x80 || (p[3] & 0xC0) != 0x80)
+            return 0;
+        uint8_t lo = c == 0xF0 ? 0x90 : 0x80, hi = c == 0xF4 ? 0x8F : 0xBF;
+        return p[1] >= lo && p[1] <= hi ? 4 : 0;
+    }
+    return 0;
+}
 
-                        ret = lerl_pack_at(L, 1, top - 1, limit - 1);
-                        take_ret()
+/* Whether p[0, len) is valid UTF-8. *ascii is set if it is all ASCII. */
+static bool lerl_utf8_valid(const uint8_t* p, size_t len, bool* ascii) {
+    size_t i = lerl_text_scan(p, len, LERL_TEXT_HIGH);
+    *ascii = i == len;
+    while (i < len) {
+        do {
+            size_t n = lerl_utf8_sequence(p + i, len - i);
+            if (n == 0)
+                return false;
+            i += n;
+        } while (i < len && p[i] >= 0x80);
+        i += lerl_text_scan(p + i, len - i, LERL_TEXT_HIGH);
+    }
+    return true;
+}
 
-                        ret = lerl_pack_at(L, 1, top, limit - 1);
-                        take_ret()
+typedef enum {
+    LERL_UTF8_OFF,
+    LERL_UTF8_FLAG,   // Invalid binaries decode to lerl_binary tables.
+    LERL_UTF8_REJECT, // Invalid binaries are an error.
+    LERL_UTF8_REPLACE // to_json writes invalid sequences as U+FFFD.
+} lerl_utf8_mode;
+
+/* Decoders take utf8 = "flag" or "reject", to_json takes "reject" or "raw", which
+   writes invalid bytes as they are. */
+static lerl_utf8_mode lerl_opt_utf8(lua_State* L, int at, bool json, lerl_utf8_mode def) {
+    if (!lua_istable(L, at))
+        return def;
+    lerl_utf8_mode mode = def;
+    if (lua_getfield(L, at, "utf8") != LUA_TNIL) {
+        const char* name = luaL_checkstring(L, -1);
+        if (strcmp(name, "reject") == 0)
+            mode = LERL_UTF8_REJECT;
+        else if (!json && strcmp(name, "flag") == 0)
+            mode = LERL_UTF8_FLAG;
+        else if (json && strcmp(name, "raw") == 0)
+            mode = LERL_UTF8_OFF;
+        else
+            luaL_error(L, json ? "lerl: Option 'utf8' must be \"reject\" or \"raw\"."
+                               : "lerl: Option 'utf8' must be \"flag\" or \"reject\".");
+    }
+    lua_pop(L, 1);
+    return mode;
+}
 
-                        lua_pop(L, 1);
-                    }
+/* lerl.classify(s) returns "ascii", "utf8" or "binary". */
+static int lerl_classify(lua_State* L) {
+    size_t len;
+    const uint8_t* s = (const uint8_t*)luaL_checklstring(L, 1, &len);
+    bool ascii;
+    if (!lerl_utf8_valid(s, len, &ascii))
+        lua_pushliteral(L, "binary");
+    else if (ascii)
+        lua_pushliteral(L, "ascii");
+    else
+        lua_pushliteral(L, "utf8");
+    return 1;
+}
 
-                    size_t end = e->pk.length;
-                    e->pk.length = destination;
-                    char count_buf[4] = {0};
-                    _erlpack_store32(count_buf, count);
-                    ret = erlpack_buffer_write(&e->pk, (const char *)count_buf, 4);
-                    e->pk.length = end;
+/* Packed integer lists, produced by decoders with the vectors option. They are
+   read-only and index, measure and iterate like the arrays they replace. */
 
-                    check_ret("upsert map length")
+typedef struct {
+    uint32_t count;
+    uint8_t width; // Bytes per element: 1, 4 or 8.
+    bool string; // Decoded from STRING_EXT and packed back as one.
+    char items[];
+} lerl_vector;
+
+static lerl_vector* lerl_push_vector(lua_State* L, uint32_t count, uint8_t width, bool string) {
+    lerl_vector* v = lua_newuserdatauv(L, sizeof(lerl_vector) + (size_t)count * width, 0);
+    v->count = count;
+    v->width = width;
+    v->string = string;
+    luaL_getmetatable(L, lerl_vector_type);
+    lua_setmetatable(L, -2);
+    return v;
+}
 
-                } else if (flen == 4 && strncmp(ttype, "user", 4) == 0) {
-                    lua_pop(L, 1);
-                    if (luaL_getmetafield(L, object_at, "__lerl_user") != LUA_TNIL) {
-                        lua_pushvalue(L, object_at);
-                        lua_call(L, 1, 1);
-                        return lerl_pack_at(L, encoder_at, lua_gettop(L), limit - 1);
-                    }
-                } else {
-                    return luaL_error(L, "lerl_encoder.pack: Unsure what to do with a table with a strange lerl_type set.");
-                }
-            } else {
-                return luaL_error(L, "lerl_encoder.pack: Unsure what to do with a table with no lerl_type set.");
-            }
-            break;
+static lua_Integer lerl_vector_get(const lerl_vector* v, uint32_t i) {
+    switch (v->width) {
+        case 1:
+            return (uint8_t)v->items[i];
+        case 4: {
+            int32_t x;
+            memcpy(&x, v->items + (size_t)i * 4, 4);
+            return x;
+        }
+        default: {
+            int64_t x;
+            memcpy(&x, v->items + (size_t)i * 8, 8);
+            return (lua_Integer)x;
+        }
+    }
+}
 
-        default:
-            return luaL_error(L, "lerl_encoder.pack: You cannot pack a %s.", lua_typename(L, the_type));
+static void lerl_vector_set(lerl_vector* v, uint32_t i, int64_t value) {
+    if (v->width == 1) {
+        v->items[i] = (char)(uint8_t)value;
+    } else if (v->width == 4) {
+        int32_t x = (int32_t)value;
+        memcpy(v->items + (size_t)i * 4, &x, 4);
+    } else {
+        memcpy(v->items + (size_t)i * 8, &value, 8);
     }
-    return 0;
 }
 
-static int lerl_release(lua_State* L) {
-    lerl_encoder* e = lerl_get_encoder(L, 1);
-    if (e->pk.length == 0 || e->pk.buf == NULL) {
-        lua_pushliteral(L, "");
+static int lerl_vector_index(lua_State* L) {
+    lerl_vector* v = luaL_checkudata(L, 1, lerl_vector_type);
+    int isnum;
+    lua_Integer i = lua_tointegerx(L, 2, &isnum);
+    if (isnum) {
+        if (i >= 1 && i <= v->count)
+            lua_pushinteger(L, lerl_vector_get(v, (uint32_t)(i - 1)));
+        else
+            lua_pushnil(L);
     } else {
-        lua_pushlstring(L, e->pk.buf, e->pk.length);
-        e->pk.length = 0;
-        e->ret = erlpack_append_version(&e->pk);
-        if (e->ret != 0)
-            lua_warning(L, "lerl_encoder.release: Issue re-initializing buffer.", 0);
+        lua_pushvalue(L, 2);
+        lua_rawget(L, lua_upvalueindex(1));
     }
     return 1;
 }
 
-static int lerl_pack(lua_State* L) {
-   luaL_argcheck(L, !lua_isnone(L, 2), 2, "You must pass nil explicitly to encode nil.");
+static int lerl_vector_len(lua_State* L) {
+    lerl_vector* v = luaL_checkudata(L, 1, lerl_vector_type);
+    lua_pushinteger(L, v->count);
+    return 1;
+}
 
-   lerl_pack_at(L, 1, 2, DEFAULT_RECURSE_LIMIT);
-   lua_settop(L, 1);
-   return 1;
+static int lerl_vector_next(lua_State* L) {
+    lerl_vector* v = luaL_checkudata(L, 1, lerl_vector_type);
+    lua_Integer i = luaL_optinteger(L, 2, 0);
+    if (i < 0 || i >= v->count)
+        return 0;
+    lua_pushinteger(L, i + 1);
+    lua_pushinteger(L, lerl_vector_get(v, (uint32_t)i));
+    return 2;
 }
 
-static int lerl_pack_all(lua_State* L) {
-    lerl_encoder* e = lerl_get_encoder(L, 1);
-    int slots = lua_gettop(L);
-    int count = 1;
-    while (count < slots) {
-        count = count + 1;
-        lerl_pack_at(L, 1, count, DEFAULT_RECURSE_LIMIT);
+static int lerl_vector_pairs(lua_State* L) {
+    luaL_checkudata(L, 1, lerl_vector_type);
+    lua_pushcfunction(L, lerl_vector_next);
+    lua_pushvalue(L, 1);
+    lua_pushinteger(L, 0);
+    return 3;
+}
+
+/* Copies the elements into a lerl.array. */
+static int lerl_vector_totable(lua_State* L) {
+    lerl_vector* v = luaL_checkudata(L, 1, lerl_vector_type);
+    lua_createtable(L, v->count, 0);
+    for (uint32_t i = 0; i < v->count; i++) {
+        lua_pushinteger(L, lerl_vector_get(v, i));
+        lua_rawseti(L, -2, (lua_Integer)i + 1);
     }
-    lua_settop(L, 1);
+    luaL_getmetatable(L, lerl_array_mt);
+    lua_setmetatable(L, -2);
     return 1;
 }
 
-static luaL_Reg encoder_metamethods[] = {
-    {"__gc", lerl_encoder_gc},
+static luaL_Reg vector_metamethods[] = {
+    {"__len", lerl_vector_len},
+    {"__pairs", lerl_vector_pairs},
     {NULL, NULL}
 };
 
-static luaL_Reg encoder_methods[] = {
-    {"pack", lerl_pack},
-    {"pack_all", lerl_pack_all},
-    {"release", lerl_release},
+static luaL_Reg vector_methods[] = {
+    {"totable", lerl_vector_totable},
     {NULL, NULL}
 };
 
-static int lerl_encoder_init(lua_State* L) {
-    luaL_newmetatable(L, lerl_encoder_type);
-    luaL_setfuncs(L, encoder_metamethods, 0);
-    lua_pushliteral(L, "__index");
-    lua_createtable(L, 0, 2);
-    luaL_setfuncs(L, encoder_methods, 0);
-    lua_settable(L, -3);
+static void lerl_vector_init(lua_State* L) {
+    luaL_newmetatable(L, lerl_vector_type);
+    luaL_setfuncs(L, vector_metamethods, 0);
+    luaL_newlib(L, vector_methods);
+    lua_pushcclosure(L, lerl_vector_index, 1);
+    lua_setfield(L, -2, "__index");
     lua_pop(L, 1);
-    return 0;
 }
 
+static int lerl_append_integer(lerl_encoder* e, lua_Integer I) {
+    if (0 <= I && I <= 255)
+        return erlpack_append_small_integer(e->out, (unsigned char)I);
+#if LUA_INT_TYPE == LUA_INT_LONGLONG
+    return erlpack_append_long_long(e->out, I);
+#else
+    return erlpack_append_integer(e->out, I);
+#endif
+}
 
-typedef struct {
-    char* data;
-    size_t size;
-    bool invalid;
-    int offset;
-    int empty_ref;
-} lerl_decoder;
+static int lerl_pack_vector(lerl_encoder* e, const lerl_vector* v) {
+    int ret;
+    if (v->string && v->count <= UINT16_MAX)
+        return erlpack_append_string(e->out, v->items, v->count);
 
-static int lerl_unpack(lua_State* L);
+    if (v->count == 0)
+        return erlpack_append_nil_ext(e->out);
 
-static lerl_decoder* lerl_get_decoder(lua_State* L, int at) {
-    return luaL_checkudata(L, at, lerl_decoder_type);
+    ret = erlpack_append_list_header(e->out, v->count);
+    if (ret != 0)
+        return ret;
+
+    for (uint32_t i = 0; i < v->count; i++) {
+        ret = lerl_append_integer(e, lerl_vector_get(v, i));
+        if (ret != 0)
+            return ret;
+    }
+    return erlpack_append_nil_ext(e->out);
 }
 
-static uint8_t lerl_read8_out(lua_State* L) {
-    lerl_decoder* the_decoder = lerl_get_decoder(L, 1);
-    int offset = the_decoder->offset;
-    char* data = the_decoder->data;
-    if (offset + sizeof(uint8_t) > the_decoder->size)
-        return luaL_error(L, "lerl_decoder.read8: Reading passes the end of the buffer.");
+/* PIDs, ports and references. Each is a userdata holding its header, ids and node
+   name, and those same bytes key a weak table of every live one, so a given
+   identifier always decodes to the same userdata and can key tables directly. */
 
-    const uint8_t val = data[offset];
-    the_decoder->offset = offset + sizeof(uint8_t);
-    return val;
+enum { LERL_PID, LERL_PORT, LERL_REF };
+
+typedef struct {
+    uint8_t kind;
+    uint16_t count; // ids: id and serial for PIDs, the high and low id words for ports.
+    uint32_t creation;
+    uint32_t ids[];
+    // Followed by the node name.
+} lerl_ident;
+
+static const char* lerl_ident_node(const lerl_ident* ident, size_t size, size_t* len) {
+    size_t at = sizeof(lerl_ident) + (size_t)ident->count * sizeof(uint32_t);
+    *len = size - at;
+    return (const char*)ident + at;
 }
 
-static int lerl_new_decoder(lua_State* L) {
-    size_t size;
-    const char* buf = luaL_checklstring(L, 1, &size);
+/* Starts the intern key in b. Add count ids and then the node name before
+   finishing it with lerl_push_ident. */
+static void lerl_ident_begin(luaL_Buffer* b, uint8_t kind, uint16_t count, uint32_t creation) {
+    lerl_ident header;
+    memset(&header, 0, sizeof(header));
+    header.kind = kind;
+    header.count = count;
+    header.creation = creation;
+    luaL_addlstring(b, (const char*)&header, sizeof(header));
+}
+
+static void lerl_ident_add_id(luaL_Buffer* b, uint32_t id) {
+    luaL_addlstring(b, (const char*)&id, sizeof(id));
+}
+
+/* Replaces the node name below the buffer with the interned identifier. */
+static void lerl_push_ident(lua_State* L, luaL_Buffer* b) {
+    luaL_pushresult(b); // Stack: ..., node, key
+    lua_getfield(L, LUA_REGISTRYINDEX, "lerl_idents");
+    lua_pushvalue(L, -2);
+    if (lua_rawget(L, -2) == LUA_TNIL) {
+        lua_pop(L, 1);
+        size_t size;
+        const char* key = lua_tolstring(L, -2, &size);
+        void* ident = lua_newuserdatauv(L, size, 0);
+        memcpy(ident, key, size);
+        luaL_getmetatable(L, lerl_ident_type);
+        lua_setmetatable(L, -2);
+        lua_pushvalue(L, -3);
+        lua_pushvalue(L, -2);
+        lua_rawset(L, -4);
+    }
+    lua_replace(L, -4); // Stack: ..., ident, key, idents
+    lua_pop(L, 2);
+}
+
+static int lerl_ident_index(lua_State* L) {
+    const lerl_ident* ident = luaL_checkudata(L, 1, lerl_ident_type);
+    const char* field = luaL_checkstring(L, 2);
+    size_t len;
+    const char* node = lerl_ident_node(ident, lua_rawlen(L, 1), &len);
+
+    if (strcmp(field, "node") == 0) {
+        lua_pushlstring(L, node, len);
+    } else if (strcmp(field, "creation") == 0) {
+        lua_pushinteger(L, ident->creation);
+    } else if (strcmp(field, "type") == 0) {
+        lua_pushstring(L, ident->kind == LERL_PID ? "pid" : ident->kind == LERL_PORT ? "port" : "reference");
+    } else if (strcmp(field, "id") == 0 && ident->kind == LERL_PID) {
+        lua_pushinteger(L, ident->ids[0]);
+    } else if (strcmp(field, "serial") == 0 && ident->kind == LERL_PID) {
+        lua_pushinteger(L, ident->ids[1]);
+    } else if (strcmp(field, "id") == 0 && ident->kind == LERL_PORT) {
+        lua_pushinteger(L, (lua_Integer)(((uint64_t)ident->ids[0] << 32) | ident->ids[1]));
+    } else if (strcmp(field, "ids") == 0 && ident->kind == LERL_REF) {
+        lua_createtable(L, ident->count, 0);
+        for (uint16_t i = 0; i < ident->count; i++) {
+            lua_pushinteger(L, ident->ids[i]);
+            lua_rawseti(L, -2, i + 1);
+        }
+    } else {
+        lua_pushnil(L);
+    }
+    return 1;
+}
+
+static int lerl_ident_eq(lua_State* L) {
+    const void* a = luaL_testudata(L, 1, lerl_ident_type);
+    const void* b = luaL_testudata(L, 2, lerl_ident_type);
+    size_t size = lua_rawlen(L, 1);
+    lua_pushboolean(L, a != NULL && b != NULL && size == lua_rawlen(L, 2) && memcmp(a, b, size) == 0);
+    return 1;
+}
+
+/* In Erlang's notation, with the node name where Erlang shows its local index. */
+static int lerl_ident_tostring(lua_State* L) {
+    const lerl_ident* ident = luaL_checkudata(L, 1, lerl_ident_type);
+    size_t len;
+    const char* node = lerl_ident_node(ident, lua_rawlen(L, 1), &len);
+    luaL_Buffer b;
+    luaL_buffinit(L, &b);
+
+    if (ident->kind == LERL_PID) {
+        luaL_addchar(&b, '<');
+        luaL_addlstring(&b, node, len);
+        lua_pushfstring(L, ".%I.%I>", (lua_Integer)ident->ids[0], (lua_Integer)ident->ids[1]);
+        luaL_addvalue(&b);
+    } else if (ident->kind == LERL_PORT) {
+        luaL_addstring(&b, "#Port<");
+        luaL_addlstring(&b, node, len);
+        lua_pushfstring(L, ".%I>", (lua_Integer)(((uint64_t)ident->ids[0] << 32) | ident->ids[1]));
+        luaL_addvalue(&b);
+    } else {
+        luaL_addstring(&b, "#Ref<");
+        luaL_addlstring(&b, node, len);
+        for (uint16_t i = ident->count; i > 0; i--) {
+            lua_pushfstring(L, ".%I", (lua_Integer)ident->ids[i - 1]);
+            luaL_addvalue(&b);
+        }
+        luaL_addchar(&b, '>');
+    }
+    luaL_pushresult(&b);
+    return 1;
+}
+
+const luaL_Reg ident_metamethods[] = {
+    {"__index", lerl_ident_index},
+    {"__eq", lerl_ident_eq},
+    {"__tostring", lerl_ident_tostring},
+    {NULL, NULL}
+};
+
+static void lerl_ident_init(lua_State* L) {
+    luaL_newmetatable(L, lerl_ident_type);
+    luaL_setfuncs(L, ident_metamethods, 0);
+    lua_pop(L, 1);
+
+    lua_newtable(L);
+    lua_createtable(L, 0, 1);
+    lua_pushliteral(L, "v");
+    lua_setfield(L, -2, "__mode");
+    lua_setmetatable(L, -2);
+    lua_setfield(L, LUA_REGISTRYINDEX, "lerl_idents");
+}
+
+/* PIDs go out as NEW_PID_EXT, ports as NEW_PORT_EXT (V4_PORT_EXT when the id
+   needs 64 bits) and references as NEWER_REFERENCE_EXT. */
+static int lerl_pack_ident(lerl_encoder* e, const lerl_ident* ident, size_t size) {
+    size_t len;
+    const char* node = lerl_ident_node(ident, size, &len);
+    unsigned char buf[1 + 2];
+    int ret;
+
+    if (ident->kind == LERL_REF) {
+        buf[0] = NEWER_REFERENCE_EXT;
+        _erlpack_store16(buf + 1, ident->count);
+        ret = erlpack_buffer_write(e->out, (const char*)buf, 3);
+    } else {
+        buf[0] = ident->kind == LERL_PID ? NEW_PID_EXT : ident->ids[0] != 0 ? V4_PORT_EXT : NEW_PORT_EXT;
+        ret = erlpack_buffer_write(e->out, (const char*)buf, 1);
+    }
+    if (ret != 0)
+        return ret;
+    ret = erlpack_append_atom(e->out, node, len);
+    if (ret != 0)
+        return ret;
+
+    unsigned char words[4 * 2 + 4];
+    size_t at = 0;
+    if (ident->kind == LERL_REF) {
+        _erlpack_store32(words, ident->creation);
+        ret = erlpack_buffer_write(e->out, (const char*)words, 4);
+        for (uint16_t i = 0; ret == 0 && i < ident->count; i++) {
+            _erlpack_store32(words, ident->ids[i]);
+            ret = erlpack_buffer_write(e->out, (const char*)words, 4);
+        }
+        return ret;
+    }
+
+    if (ident->kind == LERL_PID || ident->ids[0] != 0) {
+        _erlpack_store32(words, ident->ids[0]);
+        at = 4;
+    }
+    _erlpack_store32(words + at, ident->ids[1]);
+    _erlpack_store32(words + at + 4, ident->creation);
+    return erlpack_buffer_write(e->out, (const char*)words, at + 8);
+}
+
+static int lerl_pack_at(lua_State* L, lerl_encoder* e, int object_at, int limit);
+
+/* Whether traversal ends after key n, the last element of a list. Keys added to a
+   list since it was classified follow its elements, which sit in the array part. */
+static bool lerl_nothing_after(lua_State* L, int object_at, lua_Unsigned n) {
+    if (n == 0)
+        lua_pushnil(L);
+    else
+        lua_pushinteger(L, (lua_Integer)n);
+    if (lua_next(L, object_at) == 0)
+        return true;
+    lua_pop(L, 2);
+    return false;
+}
+
+/* Packs a table without a __lerl_type as a list when its keys are exactly 1..#t
+   and as a map otherwise, counting and checking the keys in a single traversal.
+   With shapes enabled lists are remembered with their length, so later packs
+   skip the traversal while the length is unchanged and no key follows the last
+   element; anything else is classified again. A remembered list found to have a
+   hole while it is packed is rolled back and classified again too, so shapes
+   never change what is packed. */
+static int lerl_pack_untagged(lua_State* L, lerl_encoder* e, int object_at, int limit) {
+    lua_Unsigned n = lua_rawlen(L, object_at);
+    bool is_array = false, known_list = false, known_map = false;
+    size_t count = 0;
+    int ret;
+
+    if (e->shapes_ref != LUA_NOREF) {
+        lua_rawgeti(L, LUA_REGISTRYINDEX, e->shapes_ref);
+        lua_pushvalue(L, object_at);
+        int shape = lua_rawget(L, -2);
+        known_list = shape == LUA_TNUMBER && (lua_Unsigned)lua_tointeger(L, -1) == n;
+        known_map = shape == LUA_TBOOLEAN;
+        lua_pop(L, 2);
+        is_array = known_list = known_list && lerl_nothing_after(L, object_at, n);
+    }
+
+    if (!known_list) {
+        bool keys_in_range = true;
+        lua_pushnil(L);
+        while (lua_next(L, object_at) != 0) {
+            lua_pop(L, 1);
+            count = count + 1;
+            if (keys_in_range) {
+                int isnum;
+                lua_Integer k = lua_tointegerx(L, -1, &isnum);
+                keys_in_range = isnum && lua_type(L, -1) == LUA_TNUMBER && k >= 1 && (lua_Unsigned)k <= n;
+            }
+        }
+
+        // n distinct keys all within 1..n are exactly 1..n.
+        is_array = keys_in_range && count == n && (n > 0 || e->empty_array);
+        if (e->shapes_ref != LUA_NOREF && (is_array || !known_map)) {
+            lua_rawgeti(L, LUA_REGISTRYINDEX, e->shapes_ref);
+            lua_pushvalue(L, object_at);
+            if (is_array)
+                lua_pushinteger(L, (lua_Integer)n);
+            else
+                lua_pushboolean(L, false);
+            lua_rawset(L, -3);
+            lua_pop(L, 1);
+        }
+    }
+
+    if (is_array) {
+        if (n > UINT32_MAX)
+            return luaL_error(L, "lerl_encoder.pack: Table has too many elements!");
+
+        if (n > 0) {
+            size_t start = e->out->length;
+            ret = erlpack_append_list_header(e->out, (size_t)n);
+            check_ret("pack list header")
+
+            for (lua_Unsigned i = 1; i <= n; i++) {
+                if (lua_rawgeti(L, object_at, (lua_Integer)i) == LUA_TNIL && known_list) {
+                    lua_pop(L, 1);
+                    e->out->length = start;
+                    lua_rawgeti(L, LUA_REGISTRYINDEX, e->shapes_ref);
+                    lua_pushvalue(L, object_at);
+                    lua_pushnil(L);
+                    lua_rawset(L, -3);
+                    lua_pop(L, 1);
+                    return lerl_pack_untagged(L, e, object_at, limit);
+                }
+                ret = lerl_pack_at(L, e, lua_gettop(L), limit - 1);
+                lua_pop(L, 1);
+                take_ret()
+            }
+        }
+
+        ret = erlpack_append_nil_ext(e->out);
+        check_ret("pack nil tail")
+        return 0;
+    }
+
+    if (count > INT32_MAX)
+        return luaL_error(L, "lerl_encoder.pack: Table has too many key-value properties!");
+
+    ret = erlpack_append_map_header(e->out, count);
+    check_ret("pack map header")
+
+    lua_pushnil(L);
+    while (lua_next(L, object_at) != 0) {
+        int top = lua_gettop(L);
+
+        ret = lerl_pack_at(L, e, top - 1, limit - 1);
+        take_ret()
+
+        ret = lerl_pack_at(L, e, top, limit - 1);
+        take_ret()
+
+        lua_pop(L, 1);
+    }
+    return 0;
+}
+
+/* Packs a decoded record as the tuple it came from: the record name followed by
+   the values of its fields, in order. */
+static int lerl_pack_record(lua_State* L, lerl_encoder* e, int object_at, int limit) {
+    if (luaL_getmetafield(L, object_at, "__lerl_record") != LUA_TSTRING
+            || luaL_getmetafield(L, object_at, "__lerl_fields") != LUA_TTABLE)
+        return luaL_error(L, "lerl_encoder.pack: Record is missing its name or fields.");
+
+    int fields_at = lua_gettop(L);
+    size_t name_len;
+    const char* name = lua_tolstring(L, fields_at - 1, &name_len);
+    lua_Unsigned count = lua_rawlen(L, fields_at);
+    if (count >= UINT32_MAX)
+        return luaL_error(L, "lerl_encoder.pack: Record has too many fields!");
+
+    int ret = erlpack_append_tuple_header(e->out, (size_t)count + 1);
+    check_ret("pack record header")
+    ret = erlpack_append_atom(e->out, name, name_len);
+    check_ret("pack record name")
+
+    for (lua_Unsigned i = 1; i <= count; i++) {
+        lua_rawgeti(L, fields_at, (lua_Integer)i);
+        lua_rawget(L, object_at);
+        ret = lerl_pack_at(L, e, lua_gettop(L), limit - 1);
+        lua_pop(L, 1);
+        take_ret()
+    }
+
+    lua_pop(L, 2);
+    return 0;
+}
+
+static int lerl_pack_at(lua_State* L, lerl_encoder* e, int object_at, int limit) {
+    if (limit <= 0)
+        return luaL_error(L, "lerl_encoder:pack Maximum pack depth reached!");
+
+    if (e->ret != 0)
+        return luaL_error(L, "lerl_encoder:pack Encoder buffer is in a bad state.");
+
+    int the_type = lua_type(L, object_at);
+    int ret;
+    switch (the_type) {
+        case LUA_TNIL:;
+            ret = erlpack_append_nil(e->out);
+            check_ret("pack nil")
+            break;
+        case LUA_TBOOLEAN:;
+            ret = lua_toboolean(L, object_at) ? erlpack_append_true(e->out) : erlpack_append_false(e->out);
+            check_ret("pack boolean")
+            break;
+        case LUA_TNUMBER:
+            if (lua_isinteger(L, object_at)) {
+                lua_Integer I = lua_tointeger(L, object_at);
+
+                if (0 <= I && I <= 255) {
+                    ret = erlpack_append_small_integer(e->out, (unsigned char)I);
+                    check_ret("pack small integer")
+                } else {
+#if LUA_INT_TYPE == LUA_INT_LONGLONG
+                    ret = erlpack_append_long_long(e->out, I);
+                    check_ret("pack long long integer")
+#elif LUA_INT_TYPE == LUA_INT_LONG
+                    ret = erlpack_append_integer(e->out, I);
+                    check_ret("pack long integer")
+#elif LUA_INT_TYPE == LUA_INT_INT
+                    ret = erlpack_append_integer(e->out, I);
+                    check_ret("pack integer")
+#endif
+                }
+            } else {
+                lua_Number N = lua_tonumber(L, object_at);
+                ret = erlpack_append_double(e->out, (double)N);
+                check_ret("pack double")
+            }
+        break;
+
+        case LUA_TSTRING:;
+            size_t len;
+            const char *str = lua_tolstring(L, object_at, &len);
+            if (lerl_streaming(e) && len >= e->chunk_size) {
+                // Large binaries go straight to the sink instead of through the buffer.
+                char header[5] = {BINARY_EXT};
+                _erlpack_store32(header + 1, len);
+                ret = erlpack_buffer_write(e->out, header, 5);
+                check_ret("pack string header")
+                lerl_flush_buffer(L, e);
+                lerl_write_sink(L, e, str, len, object_at);
+                break;
+            }
+            ret = erlpack_append_binary(e->out, str, len);
+            check_ret("pack string")
+            break;
+        case LUA_TTABLE: {
+            // Each level holds its metafield or key and value on the stack.
+            luaL_checkstack(L, 3, "lerl_encoder.pack: Table is nested too deeply.");
+            int field_type = luaL_getmetafield(L, object_at, "__lerl_type");
+            if (field_type == LUA_TSTRING && luaL_getmetafield(L, object_at, "__lerl_frozen") != LUA_TNIL) {
+                // Cached terms are proxies, pack the table behind them.
+                lua_pop(L, 2);
+                luaL_getmetafield(L, object_at, "__index");
+                ret = lerl_pack_at(L, e, lua_gettop(L), limit);
+                lua_pop(L, 1);
+                take_ret()
+                break;
+            }
+            if (field_type == LUA_TSTRING) {
+                size_t flen;
+                const char* ttype = lua_tolstring(L, -1, &flen);
+
+                if (flen == 5 && strncmp(ttype, "array", 5) == 0) {
+                    lua_pop(L, 1);
+                    size_t count = lerl_count_array(L, object_at);
+
+                    if (count > UINT32_MAX)
+                        return luaL_error(L, "lerl_encoder.pack: lerl.array has too many elements!");
+
+                    ret = erlpack_append_list_header(e->out, count);
+
+                    check_ret("pack list header")
+
+                    for (size_t i = 1; i <= count; i++) {
+                        lua_geti(L, object_at, i);
+
+                        ret = lerl_pack_at(L, e, lua_gettop(L), limit - 1);
+
+                        lua_pop(L, 1);
+                        take_ret()
+                    }
+
+                    ret = erlpack_append_nil_ext(e->out);
+
+                    check_ret("pack nil tail")
+
+                } else if (flen == 3 && strcmp(ttype, "map") == 0) {
+                    lua_pop(L, 1);
+                    size_t count = lerl_count_map(L, object_at);
+
+                    if (count > INT32_MAX)
+                        return luaL_error(L, "lerl_encoder.pack: lerl.map has too many key-value properties!");
+
+                    ret = erlpack_append_map_header(e->out, count);
+
+                    check_ret("pack map header")
+
+                    lua_pushnil(L);
+
+                    while (lua_next(L, object_at) != 0) {
+                        int top = lua_gettop(L);
+
+                        ret = lerl_pack_at(L, e, top - 1, limit - 1);
+                        take_ret()
+
+                        ret = lerl_pack_at(L, e, top, limit - 1);
+                        take_ret()
+
+                        lua_pop(L, 1);
+                    }
+
+                } else if (flen == 5 && strncmp(ttype, "tuple", 5) == 0) {
+                    lua_pop(L, 1);
+                    size_t count = lerl_count_array(L, object_at);
+
+                    if (count > UINT32_MAX)
+                        return luaL_error(L, "lerl_encoder.pack: lerl.tuple has too many elements!");
+
+                    ret = erlpack_append_tuple_header(e->out, count);
+                    check_ret("pack tuple header")
+
+                    for (size_t i = 1; i <= count; i++) {
+                        lua_geti(L, object_at, i);
+                        ret = lerl_pack_at(L, e, lua_gettop(L), limit - 1);
+                        lua_pop(L, 1);
+                        take_ret()
+                    }
+
+                } else if (flen == 6 && strncmp(ttype, "record", 6) == 0) {
+                    lua_pop(L, 1);
+                    ret = lerl_pack_record(L, e, object_at, limit);
+                    take_ret()
+
+                } else if (flen == 6 && strncmp(ttype, "binary", 6) == 0) {
+                    lua_pop(L, 1);
+                    size_t len;
+                    lua_rawgeti(L, object_at, 1);
+                    const char* bytes = lua_tolstring(L, -1, &len);
+                    if (bytes == NULL)
+                        return luaL_error(L, "lerl_encoder.pack: lerl_binary holds no string.");
+                    ret = erlpack_append_binary(e->out, bytes, len);
+                    lua_pop(L, 1);
+                    check_ret("pack binary")
+
+                } else if (flen == 4 && strncmp(ttype, "user", 4) == 0) {
+                    lua_pop(L, 1);
+                    if (luaL_getmetafield(L, object_at, "__lerl_user") != LUA_TNIL) {
+                        lua_pushvalue(L, object_at);
+                        lua_call(L, 1, 1);
+                        return lerl_pack_at(L, e, lua_gettop(L), limit - 1);
+                    }
+                } else {
+                    return luaL_error(L, "lerl_encoder.pack: Unsure what to do with a table with a strange lerl_type set.");
+                }
+            } else {
+                if (field_type != LUA_TNIL)
+                    lua_pop(L, 1);
+                if (!e->auto_tables)
+                    return luaL_error(L, "lerl_encoder.pack: Unsure what to do with a table with no lerl_type set.");
+                ret = lerl_pack_untagged(L, e, object_at, limit);
+                take_ret()
+            }
+            break;
+        }
+
+        case LUA_TUSERDATA: {
+            lerl_ident* ident = luaL_testudata(L, object_at, lerl_ident_type);
+            if (ident != NULL) {
+                ret = lerl_pack_ident(e, ident, lua_rawlen(L, object_at));
+                check_ret("pack identifier")
+                break;
+            }
+
+            lerl_vector* v = luaL_testudata(L, object_at, lerl_vector_type);
+            if (v == NULL)
+                return luaL_error(L, "lerl_encoder.pack: You cannot pack a %s.", lua_typename(L, the_type));
+            ret = lerl_pack_vector(e, v);
+            check_ret("pack vector")
+            break;
+        }
+
+        default:
+            return luaL_error(L, "lerl_encoder.pack: You cannot pack a %s.", lua_typename(L, the_type));
+    }
+    lerl_maybe_flush(L, e);
+    return 0;
+}
+
+/* Options: auto, to pack tables without a __lerl_type by their keys; shapes, to
+   remember each such table's shape in a weak table; and empty = "array" to pack
+   empty untagged tables as lists instead of maps. */
+static void lerl_configure_encoder(lua_State* L, lerl_encoder* e, int at) {
+    if (lua_isnoneornil(L, at))
+        return;
+
+    luaL_checktype(L, at, LUA_TTABLE);
+    e->auto_tables = lerl_opt_boolean(L, at, "auto", e->auto_tables);
+
+    if (lua_getfield(L, at, "empty") != LUA_TNIL) {
+        const char* empty = luaL_checkstring(L, -1);
+        if (strcmp(empty, "array") != 0 && strcmp(empty, "map") != 0)
+            luaL_error(L, "lerl: Option 'empty' must be \"array\" or \"map\".");
+        e->empty_array = strcmp(empty, "array") == 0;
+    }
+    lua_pop(L, 1);
+
+    bool shapes = lerl_opt_boolean(L, at, "shapes", e->shapes_ref != LUA_NOREF);
+    if (shapes && e->shapes_ref == LUA_NOREF) {
+        lua_newtable(L);
+        lua_createtable(L, 0, 1);
+        lua_pushliteral(L, "k");
+        lua_setfield(L, -2, "__mode");
+        lua_setmetatable(L, -2);
+        e->shapes_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+    } else if (!shapes && e->shapes_ref != LUA_NOREF) {
+        luaL_unref(L, LUA_REGISTRYINDEX, e->shapes_ref);
+        e->shapes_ref = LUA_NOREF;
+    }
+}
+
+static int lerl_encoder_configure(lua_State* L) {
+    lerl_encoder* e = lerl_get_encoder(L, 1);
+    luaL_checktype(L, 2, LUA_TTABLE);
+    lerl_configure_encoder(L, e, 2);
+    lua_settop(L, 1);
+    return 1;
+}
+
+static int lerl_release(lua_State* L) {
+    lerl_encoder* e = lerl_get_encoder(L, 1);
+    if (lerl_streaming(e))
+        return luaL_error(L, "lerl_encoder.release: Streaming encoders must be flushed instead.");
+
+    if (e->pk.length == 0 || e->pk.buf == NULL) {
+        lua_pushliteral(L, "");
+    } else {
+        lua_pushlstring(L, e->pk.buf, e->pk.length);
+        e->pk.length = 0;
+        e->ret = erlpack_append_version(&e->pk);
+        if (e->ret != 0)
+            lua_warning(L, "lerl_encoder.release: Issue re-initializing buffer.", 0);
+    }
+    return 1;
+}
+
+static int lerl_check_frame_header(lua_State* L, int at) {
+    lua_Integer header = luaL_optinteger(L, at, 4);
+    luaL_argcheck(L, header == 1 || header == 2 || header == 4, at, "frame header must be 1, 2 or 4 bytes");
+    return (int)header;
+}
+
+/* Releases the buffer prefixed with its big-endian length, as expected by {packet, N}. */
+static int lerl_release_framed2(lua_State* L, lerl_encoder* e, int header) {
+    if (lerl_streaming(e))
+        return luaL_error(L, "lerl_encoder.release_framed: Streaming encoders cannot be framed.");
+
+    size_t len = e->pk.length;
+    if (header < 4 && len >= (1u << (header * 8)))
+        return luaL_error(L, "lerl_encoder.release_framed: Term is too large for a %d byte frame header.", header);
+    if (len > UINT32_MAX)
+        return luaL_error(L, "lerl_encoder.release_framed: Term is too large for a frame.");
+
+    luaL_Buffer b;
+    char* out = luaL_buffinitsize(L, &b, header + len);
+    for (int i = header - 1; i >= 0; i--) {
+        out[i] = (char)(len >> ((header - 1 - i) * 8));
+    }
+    memcpy(out + header, e->pk.buf, len);
+    luaL_pushresultsize(&b, header + len);
+
+    e->pk.length = 0;
+    e->ret = erlpack_append_version(&e->pk);
+    if (e->ret != 0)
+        lua_warning(L, "lerl_encoder.release_framed: Issue re-initializing buffer.", 0);
+    return 1;
+}
+
+static int lerl_release_framed(lua_State* L) {
+    lerl_encoder* e = lerl_get_encoder(L, 1);
+    return lerl_release_framed2(L, e, lerl_check_frame_header(L, 2));
+}
+
+static int lerl_flush(lua_State* L) {
+    lerl_encoder* e = lerl_get_encoder(L, 1);
+    if (!lerl_streaming(e))
+        return luaL_error(L, "lerl_encoder.flush: This encoder has no sink, use release instead.");
+
+    lerl_flush_buffer(L, e);
+    if (e->file != NULL)
+        fflush(e->file);
+
+    lua_settop(L, 1);
+    return 1;
+}
+
+static int lerl_close(lua_State* L) {
+    lerl_encoder* e = lerl_get_encoder(L, 1);
+    if (!lerl_streaming(e))
+        return 0;
+
+    lerl_flush_buffer(L, e);
+    if (e->file != NULL) {
+        int failed = fclose(e->file);
+        e->file = NULL;
+        if (failed)
+            return luaL_error(L, "lerl_encoder.close: Failed to close the snapshot file.");
+    }
+    return 0;
+}
+
+static int lerl_pack(lua_State* L) {
+   luaL_argcheck(L, !lua_isnone(L, 2), 2, "You must pass nil explicitly to encode nil.");
+
+   lerl_pack_at(L, lerl_get_encoder(L, 1), 2, DEFAULT_RECURSE_LIMIT);
+   lua_settop(L, 1);
+   return 1;
+}
+
+static int lerl_pack_all(lua_State* L) {
+    lerl_encoder* e = lerl_get_encoder(L, 1);
+    int slots = lua_gettop(L);
+    int count = 1;
+    while (count < slots) {
+        count = count + 1;
+        lerl_pack_at(L, e, count, DEFAULT_RECURSE_LIMIT);
+    }
+    lua_settop(L, 1);
+    return 1;
+}
+
+static luaL_Reg encoder_metamethods[] = {
+    {"__gc", lerl_encoder_gc},
+    {NULL, NULL}
+};
+
+static luaL_Reg encoder_methods[] = {
+    {"pack", lerl_pack},
+    {"pack_all", lerl_pack_all},
+    {"release", lerl_release},
+    {"release_framed", lerl_release_framed},
+    {"flush", lerl_flush},
+    {"close", lerl_close},
+    {"configure", lerl_encoder_configure},
+    {NULL, NULL}
+};
+
+static int lerl_encoder_init(lua_State* L) {
+    luaL_newmetatable(L, lerl_encoder_type);
+    luaL_setfuncs(L, encoder_metamethods, 0);
+    lua_pushliteral(L, "__index");
+    lua_createtable(L, 0, 6);
+    luaL_setfuncs(L, encoder_methods, 0);
+    lua_settable(L, -3);
+    lua_pop(L, 1);
+    return 0;
+}
+
+/* A read position over raw ETF bytes, used by the paths that walk terms without
+   building Lua values. */
+typedef struct {
+    size_t max_size;
+    size_t max_inflated;
+    int max_depth;
+    uint64_t max_elements;
+} lerl_limits;
+
+typedef struct {
+    const uint8_t* data;
+    size_t size;
+    size_t offset;
+    const lerl_limits* limits; // Optional, checked by lerl_cursor_skip.
+    uint64_t terms;
+    const char* error;
+} lerl_cursor;
+
+static void lerl_cursor_init(lerl_cursor* c, const void* data, size_t size, const lerl_limits* limits) {
+    c->data = data;
+    c->size = size;
+    c->offset = 0;
+    c->limits = limits;
+    c->terms = 0;
+    c->error = NULL;
+}
+
+/* zlib cannot inflate more than about 1032 bytes per input byte, anything
+   claiming more is lying about its size. */
+static bool lerl_plausible_inflated_size(size_t compressed, size_t inflated) {
+    return inflated <= compressed * 1032 + 64;
+}
+
+/* Inflates the zlib stream at the start of the len bytes at src into the size
+   bytes at out, or just runs through it if out is NULL. Terms may follow the
+   stream, so it returns the bytes the stream took, or 0 if it is corrupt or does
+   not inflate to exactly size bytes. */
+static size_t lerl_inflate(const uint8_t* src, size_t len, uint8_t* out, size_t size) {
+    uint8_t scratch[4096];
+    z_stream zs;
+    memset(&zs, 0, sizeof(zs));
+    if (inflateInit(&zs) != Z_OK)
+        return 0;
+
+    zs.next_in = (Bytef*)src;
+    zs.avail_in = len > UINT_MAX ? UINT_MAX : (uInt)len;
+    size_t produced = 0;
+    int ret;
+    do {
+        size_t room = size - produced;
+        if (out == NULL && room > sizeof(scratch))
+            room = sizeof(scratch);
+        zs.next_out = out != NULL && room > 0 ? out + produced : scratch;
+        zs.avail_out = (uInt)room;
+        ret = inflate(&zs, Z_NO_FLUSH);
+        produced += room - zs.avail_out;
+    } while (ret == Z_OK);
+
+    size_t used = (size_t)zs.total_in;
+    inflateEnd(&zs);
+    return ret == Z_STREAM_END && produced == size ? used : 0;
+}
+
+static bool lerl_cursor_has(lerl_cursor* c, size_t n) {
+    return c->offset <= c->size && n <= c->size - c->offset;
+}
+
+static bool lerl_cursor_advance(lerl_cursor* c, size_t n) {
+    if (!lerl_cursor_has(c, n))
+        return false;
+    c->offset += n;
+    return true;
+}
+
+static bool lerl_cursor_read8(lerl_cursor* c, uint8_t* out) {
+    if (!lerl_cursor_has(c, 1))
+        return false;
+    *out = c->data[c->offset++];
+    return true;
+}
+
+static bool lerl_cursor_read16(lerl_cursor* c, uint16_t* out) {
+    if (!lerl_cursor_has(c, 2))
+        return false;
+    const uint8_t* p = c->data + c->offset;
+    *out = (uint16_t)((p[0] << 8) | p[1]);
+    c->offset += 2;
+    return true;
+}
+
+static bool lerl_cursor_read32(lerl_cursor* c, uint32_t* out) {
+    if (!lerl_cursor_has(c, 4))
+        return false;
+    const uint8_t* p = c->data + c->offset;
+    *out = ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+    c->offset += 4;
+    return true;
+}
+
+static bool lerl_cursor_skip(lerl_cursor* c, int depth);
+
+static bool lerl_cursor_skip_many(lerl_cursor* c, uint64_t count, int depth) {
+    for (uint64_t i = 0; i < count; i++) {
+        if (!lerl_cursor_skip(c, depth))
+            return false;
+    }
+    return true;
+}
+
+/* Advances past one term without decoding it. Returns false if the term is
+   malformed, nested deeper than depth or runs past the end of the buffer. */
+static bool lerl_cursor_skip(lerl_cursor* c, int depth) {
+    uint8_t type, len8;
+    uint16_t len16;
+    uint32_t len32;
+
+    if (depth <= 0) {
+        c->error = "Term is nested too deeply.";
+        return false;
+    }
+
+    if (c->limits != NULL && ++c->terms > c->limits->max_elements) {
+        c->error = "Term has too many elements.";
+        return false;
+    }
+
+    if (!lerl_cursor_read8(c, &type))
+        return false;
+
+    switch (type) {
+        case SMALL_INTEGER_EXT:
+            return lerl_cursor_advance(c, 1);
+        case INTEGER_EXT:
+            return lerl_cursor_advance(c, 4);
+        case FLOAT_EXT:
+            return lerl_cursor_advance(c, 31);
+        case NEW_FLOAT_EXT:
+            return lerl_cursor_advance(c, 8);
+        case ATOM_EXT:
+        case ATOM_UTF8_EXT:
+        case STRING_EXT:
+            return lerl_cursor_read16(c, &len16) && lerl_cursor_advance(c, len16);
+        case SMALL_ATOM_EXT:
+        case SMALL_ATOM_UTF8_EXT:
+            return lerl_cursor_read8(c, &len8) && lerl_cursor_advance(c, len8);
+        case BINARY_EXT:
+            return lerl_cursor_read32(c, &len32) && lerl_cursor_advance(c, len32);
+        case BIT_BINARY_EXT:
+            return lerl_cursor_read32(c, &len32) && lerl_cursor_advance(c, (size_t)len32 + 1);
+        case SMALL_BIG_EXT:
+            return lerl_cursor_read8(c, &len8) && lerl_cursor_advance(c, (size_t)len8 + 1);
+        case LARGE_BIG_EXT:
+            return lerl_cursor_read32(c, &len32) && lerl_cursor_advance(c, (size_t)len32 + 1);
+        case NIL_EXT:
+            return true;
+        case SMALL_TUPLE_EXT:
+            return lerl_cursor_read8(c, &len8) && lerl_cursor_skip_many(c, len8, depth - 1);
+        case LARGE_TUPLE_EXT:
+            return lerl_cursor_read32(c, &len32) && lerl_cursor_skip_many(c, len32, depth - 1);
+        case LIST_EXT:
+            return lerl_cursor_read32(c, &len32) && lerl_cursor_skip_many(c, (uint64_t)len32 + 1, depth - 1);
+        case MAP_EXT:
+            return lerl_cursor_read32(c, &len32) && lerl_cursor_skip_many(c, (uint64_t)len32 * 2, depth - 1);
+        case REFERENCE_EXT:
+        case PORT_EXT:
+            return lerl_cursor_skip(c, depth - 1) && lerl_cursor_advance(c, 5);
+        case NEW_PORT_EXT:
+            return lerl_cursor_skip(c, depth - 1) && lerl_cursor_advance(c, 8);
+        case V4_PORT_EXT:
+            return lerl_cursor_skip(c, depth - 1) && lerl_cursor_advance(c, 12);
+        case PID_EXT:
+            return lerl_cursor_skip(c, depth - 1) && lerl_cursor_advance(c, 9);
+        case NEW_PID_EXT:
+            return lerl_cursor_skip(c, depth - 1) && lerl_cursor_advance(c, 12);
+        case NEW_REFERENCE_EXT:
+            return lerl_cursor_read16(c, &len16) && lerl_cursor_skip(c, depth - 1)
+                && lerl_cursor_advance(c, 1 + (size_t)len16 * 4);
+        case NEWER_REFERENCE_EXT:
+            return lerl_cursor_read16(c, &len16) && lerl_cursor_skip(c, depth - 1)
+                && lerl_cursor_advance(c, 4 + (size_t)len16 * 4);
+        case EXPORT_EXT:
+            return lerl_cursor_skip_many(c, 3, depth - 1);
+        case NEW_FUN_EXT:
+            // The size includes its own four bytes.
+            return lerl_cursor_read32(c, &len32) && len32 >= 4 && lerl_cursor_advance(c, len32 - 4);
+        case COMPRESSED: {
+            // Only inflating finds where the stream ends, the output is thrown away.
+            if (!lerl_cursor_read32(c, &len32))
+                return false;
+            if (!lerl_plausible_inflated_size(c->size - c->offset, len32)
+                    || (c->limits != NULL && len32 > c->limits->max_inflated)) {
+                c->error = "Compressed term inflates past the limit.";
+                return false;
+            }
+            size_t used = lerl_inflate(c->data + c->offset, c->size - c->offset, NULL, len32);
+            if (used == 0) {
+                c->error = "Failed to uncompress compressed item.";
+                return false;
+            }
+            c->offset += used;
+            return true;
+        }
+        default:
+            c->error = "Unsupported erlang term type identifier found.";
+            return false;
+    }
+}
+
+/* Whether the length elements at c are all {Key, Value} tuples with an atom or
+   binary key, followed by the list tail. */
+static bool lerl_is_proplist(lerl_cursor c, uint32_t length) {
+    for (uint32_t i = 0; i < length; i++) {
+        uint8_t type, arity;
+        if (!lerl_cursor_read8(&c, &type) || type != SMALL_TUPLE_EXT)
+            return false;
+        if (!lerl_cursor_read8(&c, &arity) || arity != 2 || !lerl_cursor_has(&c, 1))
+            return false;
+
+        uint8_t key = c.data[c.offset];
+        if (key != ATOM_EXT && key != SMALL_ATOM_EXT && key != ATOM_UTF8_EXT
+                && key != SMALL_ATOM_UTF8_EXT && key != BINARY_EXT)
+            return false;
+        if (!lerl_cursor_skip_many(&c, 2, DEFAULT_RECURSE_LIMIT))
+            return false;
+    }
+    uint8_t tail;
+    return lerl_cursor_read8(&c, &tail) && tail == NIL_EXT;
+}
+
+static void lerl_default_limits(lerl_limits* limits) {
+    limits->max_size = SIZE_MAX;
+    limits->max_inflated = SIZE_MAX;
+    limits->max_depth = DEFAULT_RECURSE_LIMIT;
+    limits->max_elements = UINT64_MAX;
+}
+
+/* Returns whether any limit was given. */
+static bool lerl_read_limits(lua_State* L, int at, lerl_limits* limits) {
+    if (lua_isnoneornil(L, at))
+        return false;
+
+    luaL_checktype(L, at, LUA_TTABLE);
+    lua_Integer max_size = lerl_opt_integer(L, at, "max_size", -1);
+    lua_Integer max_inflated = lerl_opt_integer(L, at, "max_inflated", -1);
+    lua_Integer max_depth = lerl_opt_integer(L, at, "max_depth", -1);
+    lua_Integer max_elements = lerl_opt_integer(L, at, "max_elements", -1);
+
+    if (max_size >= 0)
+        limits->max_size = (size_t)max_size;
+    if (max_inflated >= 0)
+        limits->max_inflated = (size_t)max_inflated;
+    if (max_depth >= 0)
+        limits->max_depth = max_depth >= INT_MAX ? INT_MAX - 1 : (int)max_depth;
+    if (max_elements >= 0)
+        limits->max_elements = (uint64_t)max_elements;
+
+    return max_size >= 0 || max_inflated >= 0 || max_depth >= 0 || max_elements >= 0;
+}
+
+/* Checks that bytes hold a sequence of well formed terms within limits without
+   allocating. Returns NULL or the reason the bytes were rejected. */
+static const char* lerl_scan(const void* bytes, size_t size, const lerl_limits* limits, bool versioned, size_t* offset) {
+    lerl_cursor c;
+    lerl_cursor_init(&c, bytes, size, limits);
+
+    const char* error = NULL;
+    while (c.offset < c.size) {
+        if (versioned && c.data[c.offset] == FORMAT_VERSION) {
+            c.offset++;
+            continue;
+        }
+        if (!lerl_cursor_skip(&c, limits->max_depth + 1)) {
+            error = c.error != NULL ? c.error : "Reading passes the end of the buffer.";
+            break;
+        }
+    }
+
+    if (offset != NULL)
+        *offset = c.offset;
+    return error;
+}
+
+/* lerl.validate(bytes [, limits]) returns true, or nil, the reason and the offset
+   the scan stopped at. Limits: max_size, max_inflated, max_depth, max_elements. */
+static int lerl_validate(lua_State* L) {
+    size_t size;
+    const char* bytes = luaL_checklstring(L, 1, &size);
+    lerl_limits limits;
+    lerl_default_limits(&limits);
+    lerl_read_limits(L, 2, &limits);
+
+    size_t offset = 0;
+    const char* error = NULL;
+    if (size == 0 || (uint8_t)bytes[0] != FORMAT_VERSION)
+        error = "Version mismatch!";
+    else if (size > limits.max_size)
+        error = "Buffer is larger than the size limit.";
+    else {
+        error = lerl_scan(bytes + 1, size - 1, &limits, false, &offset);
+        offset = offset + 1;
+    }
+
+    if (error != NULL) {
+        lua_pushnil(L);
+        lua_pushstring(L, error);
+        lua_pushinteger(L, offset);
+        return 3;
+    }
+
+    lua_pushboolean(L, true);
+    return 1;
+}
+
+typedef enum {
+    LERL_DATA_OWNED,    // malloc'd by the decoder.
+    LERL_DATA_BORROWED, // Belongs to someone else (e.g. a ring) and must not be freed.
+    LERL_DATA_MAPPED    // A read-only file mapping of size bytes.
+} lerl_data_kind;
+
+/* A cached sub-term, keyed by its raw bytes which follow the struct. */
+typedef struct lerl_cache_entry {
+    uint64_t hash;
+    size_t len;
+    size_t cost;
+    int slot; // Reference into the cache's table of values.
+    struct lerl_cache_entry* chain; // Next entry in the same bucket.
+    struct lerl_cache_entry* newer;
+    struct lerl_cache_entry* older;
+    char bytes[];
+} lerl_cache_entry;
+
+typedef struct {
+    lerl_cache_entry** buckets;
+    size_t bucket_count; // Always a power of two.
+    size_t count;
+    lerl_cache_entry* newest;
+    lerl_cache_entry* oldest;
+    size_t used;
+    size_t budget;
+    size_t min_size;
+    size_t max_size;
+    int min_depth;
+    int max_depth;
+    uint64_t hits;
+    uint64_t misses;
+} lerl_cache;
+
+typedef struct {
+    char* data;
+    size_t size;
+    bool invalid;
+    lerl_data_kind data_kind;
+    int offset;
+    int empty_ref;
+    lerl_limits limits;
+    bool checked; // Scan buffers against limits before decoding them.
+    int depth;
+    uint64_t elements;
+    lerl_cache* cache; // Optional, kept alive by cache_ref.
+    int cache_ref;
+    int frozen; // Non-zero while decoding a term that is going into the cache.
+    bool vectors; // Decode integer lists and STRING_EXT as lerl_vector.
+    bool strings; // Decode STRING_EXT as a Lua string, ahead of vectors.
+    bool proplists; // Decode lists of {Key, Value} tuples as maps.
+    int records_ref; // Table of record name to record metatable, or LUA_NOREF.
+    lerl_utf8_mode utf8; // What to do with binaries that are not UTF-8.
+    bool versioned; // Terms may each start with a version byte, as in concatenated packs.
+    int frame_header; // Default header size for frames, from open_snapshot.
+} lerl_decoder;
+
+static int lerl_unpack(lua_State* L, lerl_decoder* the_decoder);
+
+static lerl_decoder* lerl_get_decoder(lua_State* L, int at) {
+    return luaL_checkudata(L, at, lerl_decoder_type);
+}
+
+static void lerl_release_data(lerl_decoder* the_decoder) {
+    if (the_decoder->data != NULL) {
+        if (the_decoder->data_kind == LERL_DATA_OWNED)
+            free(the_decoder->data);
+#ifndef _WIN32
+        else if (the_decoder->data_kind == LERL_DATA_MAPPED)
+            munmap(the_decoder->data, the_decoder->size);
+#endif
+    }
+
+    the_decoder->data = NULL;
+    the_decoder->data_kind = LERL_DATA_OWNED;
+}
+
+static void lerl_set_cache(lua_State* L, lerl_decoder* the_decoder, int at);
+static void lerl_set_records(lua_State* L, lerl_decoder* the_decoder, int at);
+static void lerl_bind_cache(lua_State* L, lerl_decoder* the_decoder);
+
+/* Options: max_size, max_inflated, max_depth and max_elements, giving any of which
+   makes the decoder validate each buffer before building Lua values from it,
+   cache, a lerl.new_cache shared by any number of decoders, vectors, which
+   decodes integer lists and byte strings to packed lerl_vectors, strings, which
+   decodes STRING_EXT byte lists to Lua strings, proplists, which decodes lists of
+   {Key, Value} tuples to maps, records, a table of record name to field names
+   that decodes matching tuples to keyed tables, and utf8 = "flag" or "reject",
+   which checks binaries are UTF-8 and decodes those that are not as lerl_binary
+   tables or raises an error. A cache only serves decoders with the empty value,
+   options and records of the first decoder that used it. */
+static void lerl_configure_decoder(lua_State* L, lerl_decoder* the_decoder, int at) {
+    if (lua_isnoneornil(L, at))
+        return;
+
+    if (lerl_read_limits(L, at, &the_decoder->limits))
+        the_decoder->checked = true;
+
+    if (lua_getfield(L, at, "cache") != LUA_TNIL)
+        lerl_set_cache(L, the_decoder, lua_gettop(L));
+    lua_pop(L, 1);
+
+    the_decoder->vectors = lerl_opt_boolean(L, at, "vectors", the_decoder->vectors);
+    the_decoder->strings = lerl_opt_boolean(L, at, "strings", the_decoder->strings);
+    the_decoder->proplists = lerl_opt_boolean(L, at, "proplists", the_decoder->proplists);
+    the_decoder->utf8 = lerl_opt_utf8(L, at, false, the_decoder->utf8);
+
+    if (lua_getfield(L, at, "records") != LUA_TNIL)
+        lerl_set_records(L, the_decoder, lua_gettop(L));
+    lua_pop(L, 1);
+
+    if (the_decoder->cache != NULL)
+        lerl_bind_cache(L, the_decoder);
+}
+
+static void lerl_init_decoder(lerl_decoder* the_decoder, int empty_ref) {
+    the_decoder->data = NULL;
+    the_decoder->size = 0;
+    the_decoder->offset = 0;
+    the_decoder->empty_ref = empty_ref;
+    the_decoder->invalid = true;
+    the_decoder->data_kind = LERL_DATA_OWNED;
+    lerl_default_limits(&the_decoder->limits);
+    the_decoder->checked = false;
+    the_decoder->depth = 0;
+    the_decoder->elements = 0;
+    the_decoder->cache = NULL;
+    the_decoder->cache_ref = LUA_NOREF;
+    the_decoder->frozen = 0;
+    the_decoder->vectors = false;
+    the_decoder->strings = false;
+    the_decoder->proplists = false;
+    the_decoder->utf8 = LERL_UTF8_OFF;
+    the_decoder->records_ref = LUA_NOREF;
+    the_decoder->versioned = false;
+    the_decoder->frame_header = 4;
+}
+
+static void lerl_check_buffer(lua_State* L, lerl_decoder* the_decoder, const char* who) {
+    if (the_decoder->size > the_decoder->limits.max_size)
+        luaL_error(L, "%s: Buffer is larger than the size limit.", who);
+
+    if (!the_decoder->checked)
+        return;
+
+    size_t offset = 0;
+    const char* error = lerl_scan(the_decoder->data + the_decoder->offset,
+        the_decoder->size - the_decoder->offset, &the_decoder->limits, the_decoder->versioned, &offset);
+    if (error != NULL)
+        luaL_error(L, "%s: %s (at offset %d)", who, error, (int)(the_decoder->offset + offset));
+}
+
+/* Steps over the version byte in front of the next term of a versioned decoder.
+   FORMAT_VERSION is never a term tag, so this cannot misread a term. */
+static void lerl_skip_version(lerl_decoder* the_decoder) {
+    if (the_decoder->versioned && !the_decoder->invalid && (size_t)the_decoder->offset < the_decoder->size
+            && (uint8_t)the_decoder->data[the_decoder->offset] == FORMAT_VERSION)
+        the_decoder->offset++;
+}
+
+static uint8_t lerl_read8_out(lua_State* L, lerl_decoder* the_decoder) {
+    int offset = the_decoder->offset;
+    char* data = the_decoder->data;
+    if (offset + sizeof(uint8_t) > the_decoder->size)
+        return luaL_error(L, "lerl_decoder.read8: Reading passes the end of the buffer.");
+
+    const uint8_t val = data[offset];
+    the_decoder->offset = offset + sizeof(uint8_t);
+    return val;
+}
+
+static int lerl_new_decoder(lua_State* L) {
+    size_t size;
+    const char* buf = luaL_checklstring(L, 1, &size);
+    lua_settop(L, 3);
+    int empty_ref;
+    if (!lua_isnoneornil(L, 2)) {
+        lua_pushvalue(L, 2);
+        empty_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+    } else {
+        lua_getfield(L, LUA_REGISTRYINDEX, "lerl_empty");
+        empty_ref = lua_tointeger(L, -1);
+        lua_pop(L, 1);
+    }
+
+    lerl_decoder* the_decoder = lua_newuserdata(L, sizeof(lerl_decoder));
+    lerl_init_decoder(the_decoder, empty_ref);
+    luaL_getmetatable(L, lerl_decoder_type);
+    lua_setmetatable(L, -2);
+    lerl_configure_decoder(L, the_decoder, 3);
+
+    char* data = malloc(size * sizeof(char));
+
+    if (data == NULL)
+        return luaL_error(L, "lerl_decoder.new: Failed to allocate buffer!");
+
+    memcpy(data, buf, size);
+    lua_replace(L, 1);
+    lua_settop(L, 1);
+
+    the_decoder->data = data;
+    the_decoder->size = size;
+    the_decoder->invalid = 0;
+
+    int ver = lerl_read8_out(L, the_decoder);
+    if(ver != FORMAT_VERSION)
+        return luaL_error(L, "lerl_decoder.new: Version mismatch!");
+
+    lerl_check_buffer(L, the_decoder, "lerl_decoder.new");
+    return 1;
+}
+
+static int lerl_push_empty_decoder(lua_State* L, int empty_ref) {
+    lerl_decoder* the_decoder = lua_newuserdata(L, sizeof(lerl_decoder));
+    lerl_init_decoder(the_decoder, empty_ref);
+
+    luaL_getmetatable(L, lerl_decoder_type);
+    lua_setmetatable(L, -2);
+
+    return 1;
+}
+
+static int lerl_empty_decoder(lua_State* L) {
+    lua_settop(L, 2);
+
+    int empty_ref;
+    if (!lua_isnoneornil(L, 1)) {
+        lua_pushvalue(L, 1);
+        empty_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+    } else {
+        lua_getfield(L, LUA_REGISTRYINDEX, "lerl_empty");
+        empty_ref = lua_tointeger(L, -1);
+        lua_pop(L, 1);
+    }
+
+    lerl_push_empty_decoder(L, empty_ref);
+    lerl_configure_decoder(L, lerl_get_decoder(L, -1), 2);
+    return 1;
+}
+
+static int lerl_configure(lua_State* L) {
+    lerl_decoder* the_decoder = lerl_get_decoder(L, 1);
+    luaL_checktype(L, 2, LUA_TTABLE);
+    lerl_configure_decoder(L, the_decoder, 2);
+    lua_settop(L, 1);
+    return 1;
+}
+
+static int lerl_reset_decoder(lua_State* L) {
+    lerl_decoder* the_decoder = lerl_get_decoder(L, 1);
+    size_t size;
+    const char* buf = luaL_checklstring(L, 2, &size);
+
+    char* data = malloc(size * sizeof(char));
+    if (data == NULL)
+        return luaL_error(L, "lerl_decoder.reset: Failed to allocate buffer!");
+
+    memcpy(data, buf, size);
+    lua_pop(L, 1);
+
+    lerl_release_data(the_decoder);
+    the_decoder->data = data;
+    the_decoder->size = size;
+    the_decoder->offset = 0;
+    the_decoder->invalid = 0;
+    the_decoder->elements = 0;
+
+    int ver = lerl_read8_out(L, the_decoder);
+    if(ver != FORMAT_VERSION)
+        return luaL_error(L, "lerl_decoder.reset: Version mismatch!");
+
+    lerl_check_buffer(L, the_decoder, "lerl_decoder.reset");
+    return 1;
+}
+
+/* Appends bytes to the decoder, discarding whatever has already been consumed. */
+static int lerl_feed_decoder(lua_State* L) {
+    lerl_decoder* the_decoder = lerl_get_decoder(L, 1);
+    size_t len;
+    const char* buf = luaL_checklstring(L, 2, &len);
+
+    size_t pending = 0;
+    if (!the_decoder->invalid && the_decoder->data != NULL && (size_t)the_decoder->offset < the_decoder->size)
+        pending = the_decoder->size - the_decoder->offset;
+
+    if (pending + len > INT_MAX)
+        return luaL_error(L, "lerl_decoder.feed: Buffer is too large.");
+
+    char* data;
+    if (the_decoder->data_kind != LERL_DATA_OWNED) {
+        // Never write into memory we don't own, take a private copy of the tail instead.
+        data = malloc(pending + len);
+        if (data == NULL && pending + len > 0)
+            return luaL_error(L, "lerl_decoder.feed: Failed to allocate buffer!");
+        if (pending > 0)
+            memcpy(data, the_decoder->data + the_decoder->offset, pending);
+        lerl_release_data(the_decoder);
+    } else {
+        if (pending > 0 && the_decoder->offset > 0)
+            memmove(the_decoder->data, the_decoder->data + the_decoder->offset, pending);
+
+        data = realloc(the_decoder->data, pending + len);
+        if (data == NULL && pending + len > 0)
+            return luaL_error(L, "lerl_decoder.feed: Failed to allocate buffer!");
+    }
+
+    memcpy(data + pending, buf, len);
+
+    the_decoder->data = data;
+    the_decoder->size = pending + len;
+    the_decoder->offset = 0;
+    the_decoder->invalid = false;
+    the_decoder->elements = 0;
+
+    if (the_decoder->size > the_decoder->limits.max_size)
+        return luaL_error(L, "lerl_decoder.feed: Buffer is larger than the size limit.");
+
+    lua_settop(L, 1);
+    return 1;
+}
+
+/* Opens a snapshot file for decoding without reading it into a Lua string. The
+   file is mapped read-only (read into memory on Windows). Besides the decoder
+   options, framed gives the layout: 0, the default, for the output of
+   new_snapshot_writer or concatenated lerl.pack results, read with unpack, or
+   1, 2 or 4 for {packet, N} frames, read with frames. */
+static int lerl_open_snapshot(lua_State* L) {
+    const char* path = luaL_checkstring(L, 1);
+    lua_settop(L, 3);
+    lua_Integer framed = lerl_opt_integer(L, 3, "framed", 0);
+    luaL_argcheck(L, framed == 0 || framed == 1 || framed == 2 || framed == 4, 3, "framed must be 0, 1, 2 or 4");
     int empty_ref;
-    if (lua_gettop(L) >= 2 && !lua_isnoneornil(L, 2)) {
-        lua_settop(L, 2);
+    if (!lua_isnoneornil(L, 2)) {
         lua_pushvalue(L, 2);
         empty_ref = luaL_ref(L, LUA_REGISTRYINDEX);
     } else {
-        lua_getfield(L, LUA_REGISTRYINDEX, "lerl_empty");
-        empty_ref = lua_tointeger(L, -1);
-        lua_pop(L, 1);
+        lua_getfield(L, LUA_REGISTRYINDEX, "lerl_empty");
+        empty_ref = lua_tointeger(L, -1);
+        lua_pop(L, 1);
+    }
+
+    char* data;
+    size_t size;
+    lerl_data_kind data_kind;
+#ifndef _WIN32
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return luaL_fileresult(L, 0, path);
+
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        return luaL_fileresult(L, 0, path);
+    }
+
+    size = (size_t)st.st_size;
+    if (size == 0 || size > INT_MAX) {
+        close(fd);
+        return luaL_error(L, "lerl.open_snapshot: Snapshot must be between 1 byte and 2GB.");
+    }
+
+    data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED)
+        return luaL_fileresult(L, 0, path);
+
+    posix_madvise(data, size, POSIX_MADV_SEQUENTIAL);
+    data_kind = LERL_DATA_MAPPED;
+#else
+    FILE* f = fopen(path, "rb");
+    if (f == NULL)
+        return luaL_fileresult(L, 0, path);
+
+    fseek(f, 0, SEEK_END);
+    long length = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    if (length <= 0 || length > INT_MAX) {
+        fclose(f);
+        return luaL_error(L, "lerl.open_snapshot: Snapshot must be between 1 byte and 2GB.");
+    }
+
+    size = (size_t)length;
+    data = malloc(size);
+    if (data == NULL || fread(data, 1, size, f) != size) {
+        free(data);
+        fclose(f);
+        return luaL_error(L, "lerl.open_snapshot: Failed to read snapshot.");
+    }
+    fclose(f);
+    data_kind = LERL_DATA_OWNED;
+#endif
+
+    lerl_push_empty_decoder(L, empty_ref);
+    lerl_decoder* the_decoder = lerl_get_decoder(L, -1);
+    the_decoder->data = data;
+    the_decoder->size = size;
+    the_decoder->data_kind = data_kind;
+    the_decoder->invalid = false;
+    lerl_configure_decoder(L, the_decoder, 3);
+    lua_replace(L, 1);
+    lua_settop(L, 1);
+
+    if (framed != 0) {
+        the_decoder->frame_header = (int)framed;
+        return 1;
+    }
+
+    if ((uint8_t)data[0] != FORMAT_VERSION)
+        return luaL_error(L, "lerl.open_snapshot: Version mismatch!");
+    the_decoder->versioned = true;
+    the_decoder->offset = 1;
+    lerl_check_buffer(L, the_decoder, "lerl.open_snapshot");
+    return 1;
+}
+
+static int lerl_read8(lua_State* L) {
+    lua_pushinteger(L, lerl_read8_out(L, lerl_get_decoder(L, 1)));
+    return 1;
+}
+
+static uint16_t lerl_read16_out(lua_State* L, lerl_decoder* the_decoder) {
+    int offset = the_decoder->offset;
+    char* data = the_decoder->data;
+    if (offset + sizeof(uint16_t) > the_decoder->size)
+        return luaL_error(L, "lerl_decoder.read16: Reading passes the end of the buffer.");
+
+    const uint16_t val = _erlpack_be16(*(const uint16_t*)(data + offset));
+    the_decoder->offset = offset + sizeof(uint16_t);
+    return val;
+}
+
+static int lerl_read16(lua_State* L) {
+    lua_pushinteger(L, lerl_read16_out(L, lerl_get_decoder(L, 1)));
+    return 1;
+}
+
+static uint32_t lerl_read32_out(lua_State* L, lerl_decoder* the_decoder) {
+    int offset = the_decoder->offset;
+    char* data = the_decoder->data;
+    if (offset + sizeof(uint32_t) > the_decoder->size)
+        return luaL_error(L, "lerl_decoder.read32: Reading passes the end of the buffer.");
+
+    const uint32_t val = _erlpack_be32(*(const uint32_t*)(data + offset));
+    the_decoder->offset = offset + sizeof(uint32_t);
+    return val;
+}
+
+static int lerl_read32(lua_State* L) {
+    lua_pushinteger(L, lerl_read32_out(L, lerl_get_decoder(L, 1)));
+    return 1;
+}
+
+static uint64_t lerl_read64_out(lua_State* L, lerl_decoder* the_decoder) {
+    int offset = the_decoder->offset;
+    char* data = the_decoder->data;
+    if (offset + sizeof(uint64_t) > the_decoder->size)
+        return luaL_error(L, "lerl_decoder.read64: Reading passes the end of the buffer.");
+
+    const uint64_t val = _erlpack_be64(*(const uint64_t*)(data + offset));
+    the_decoder->offset = offset + sizeof(uint64_t);
+    return val;
+}
+
+static int lerl_read64(lua_State* L) {
+    lua_pushinteger(L, (lua_Integer)lerl_read64_out(L, lerl_get_decoder(L, 1)));
+    return 1;
+}
+
+static int lerl_decodeSmallInteger(lua_State* L, lerl_decoder* the_decoder) {
+    lua_pushinteger(L, lerl_read8_out(L, the_decoder));
+    return 1;
+}
+
+static int lerl_decodeInteger(lua_State* L, lerl_decoder* the_decoder) {
+    lua_pushinteger(L, lerl_read32_out(L, the_decoder));
+    return 1;
+}
+
+/* Every container passes through here before its table is sized, so untrusted
+   lengths can't ask for more slots than there are bytes left to fill them. */
+static void lerl_enter_container(lua_State* L, lerl_decoder* the_decoder, uint64_t length, size_t min_bytes) {
+    if (the_decoder->depth >= the_decoder->limits.max_depth)
+        luaL_error(L, "lerl_decoder.unpack: Term is nested too deeply.");
+
+    luaL_checkstack(L, 3, "lerl_decoder.unpack: Term is nested too deeply.");
+
+    if (length * min_bytes > the_decoder->size - the_decoder->offset)
+        luaL_error(L, "lerl_decoder.unpack: Reading sequence past the end of the buffer.");
+
+    the_decoder->depth++;
+}
+
+static int lerl_frozen_newindex(lua_State* L) {
+    return luaL_error(L, "lerl: Cached terms are read-only.");
+}
+
+static int lerl_frozen_len(lua_State* L) {
+    luaL_getmetafield(L, 1, "__index");
+    lua_pushinteger(L, (lua_Integer)lua_rawlen(L, -1));
+    return 1;
+}
+
+static int lerl_frozen_next(lua_State* L) {
+    lua_settop(L, 2);
+    if (lua_next(L, 1))
+        return 2;
+    lua_pushnil(L);
+    return 1;
+}
+
+static int lerl_frozen_pairs(lua_State* L) {
+    lua_pushcfunction(L, lerl_frozen_next);
+    luaL_getmetafield(L, 1, "__index");
+    lua_pushnil(L);
+    return 3;
+}
+
+/* Replaces the filled table on top of the stack with an empty read-only proxy.
+   The proxy's metatable copies the table's, so it keeps __lerl_type and any
+   record fields, and sends reads, #, pairs and the encoder to the table. */
+static void lerl_freeze(lua_State* L) {
+    luaL_checkstack(L, 4, "lerl_decoder.unpack: Term is nested too deeply.");
+    int data = lua_gettop(L);
+    lua_createtable(L, 0, 0);
+    lua_createtable(L, 0, 8);
+    if (lua_getmetatable(L, data)) {
+        lua_pushnil(L);
+        while (lua_next(L, -2)) {
+            lua_pushvalue(L, -2);
+            lua_insert(L, -2);
+            lua_rawset(L, -5);
+        }
+        lua_pop(L, 1);
+    }
+    lua_pushvalue(L, data);
+    lua_setfield(L, -2, "__index");
+    lua_pushcfunction(L, lerl_frozen_newindex);
+    lua_setfield(L, -2, "__newindex");
+    lua_pushcfunction(L, lerl_frozen_len);
+    lua_setfield(L, -2, "__len");
+    lua_pushcfunction(L, lerl_frozen_pairs);
+    lua_setfield(L, -2, "__pairs");
+    lua_pushboolean(L, true);
+    lua_setfield(L, -2, "__lerl_frozen");
+    lua_setmetatable(L, -2);
+    lua_replace(L, data);
+}
+
+/* Tables decoded to go into the cache are filled first and then frozen. */
+static void lerl_set_decoded_mt(lua_State* L, lerl_decoder* the_decoder, const char* mt, const char* frozen_mt) {
+    if (the_decoder->frozen)
+        mt = frozen_mt;
+    if (mt != NULL) {
+        luaL_getmetatable(L, mt);
+        lua_setmetatable(L, -2);
+    }
+    if (the_decoder->frozen)
+        lerl_freeze(L);
+}
+
+static int lerl_decodeSequential(lua_State* L, lerl_decoder* the_decoder, uint32_t length) {
+    lerl_enter_container(L, the_decoder, length, 1);
+    lua_createtable(L, length, 0);
+    for (lua_Integer i = 1; i <= length; i++) {
+        lerl_unpack(L, the_decoder);
+        if (the_decoder->invalid) {
+            return 0;
+        }
+        lua_rawseti(L, -2, i);
+    }
+    the_decoder->depth--;
+    return 1;
+}
+
+static uint32_t lerl_load32(const uint8_t* p) {
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+/* Reads one integer element of a list at *pos, accepting exactly the integers the
+   decoder would turn into a lua_Integer. */
+static bool lerl_read_vector_item(const uint8_t* p, size_t size, size_t* pos, int64_t* value) {
+    size_t at = *pos;
+    if (at + 2 > size)
+        return false;
+
+    switch (p[at]) {
+        case SMALL_INTEGER_EXT:
+            *value = p[at + 1];
+            *pos = at + 2;
+            return true;
+        case INTEGER_EXT:
+            if (at + 5 > size)
+                return false;
+            *value = (int32_t)lerl_load32(p + at + 1);
+            *pos = at + 5;
+            return true;
+        case SMALL_BIG_EXT: {
+            uint8_t digits = p[at + 1];
+            if (digits > 8 || at + 3 + digits > size)
+                return false;
+            uint8_t sign = p[at + 2];
+            uint64_t v = 0;
+            for (uint8_t i = 0; i < digits; i++) {
+                v |= (uint64_t)p[at + 3 + i] << (8 * i);
+            }
+            if (sign != 0 && (v & (1ULL << 63)) != 0)
+                return false;
+            *value = sign == 0 ? (int64_t)v : -(int64_t)v;
+            *pos = at + 3 + digits;
+            return true;
+        }
+        default:
+            return false;
+    }
+}
+
+/* Decodes the LIST_EXT at the offset, just past its tag, into a vector if every
+   element is an integer. Returns false, consuming nothing, when it is not. */
+static bool lerl_decode_vector(lua_State* L, lerl_decoder* the_decoder) {
+    const uint8_t* p = (const uint8_t*)the_decoder->data + the_decoder->offset;
+    size_t size = the_decoder->size - the_decoder->offset;
+    if (size < 4)
+        return false;
+
+    uint32_t count = lerl_load32(p);
+    if (count == 0 || count > size / 2)
+        return false;
+
+    size_t pos = 4;
+    int64_t value, min = 0, max = 0;
+    for (uint32_t i = 0; i < count; i++) {
+        if (!lerl_read_vector_item(p, size, &pos, &value))
+            return false;
+        if (value < min)
+            min = value;
+        if (value > max)
+            max = value;
+    }
+    if (pos >= size || p[pos] != NIL_EXT)
+        return false;
+
+    if (the_decoder->depth >= the_decoder->limits.max_depth)
+        luaL_error(L, "lerl_decoder.unpack: Term is nested too deeply.");
+    the_decoder->elements += (uint64_t)count + 1;
+    if (the_decoder->elements > the_decoder->limits.max_elements)
+        luaL_error(L, "lerl_decoder.unpack: Term has too many elements.");
+
+    uint8_t width = (min >= 0 && max <= UINT8_MAX) ? 1 : (min >= INT32_MIN && max <= INT32_MAX) ? 4 : 8;
+    lerl_vector* v = lerl_push_vector(L, count, width, false);
+    pos = 4;
+    for (uint32_t i = 0; i < count; i++) {
+        lerl_read_vector_item(p, size, &pos, &value);
+        lerl_vector_set(v, i, value);
+    }
+    the_decoder->offset += pos + 1;
+    return true;
+}
+
+/* Decodes a list already checked by lerl_is_proplist as a map. As with
+   proplists:get_value the first value for a key wins. */
+static void lerl_decode_proplist(lua_State* L, lerl_decoder* the_decoder, uint32_t length) {
+    lerl_enter_container(L, the_decoder, length, 4);
+    lerl_enter_container(L, the_decoder, 0, 0); // The tuples.
+
+    lua_createtable(L, 0, length);
+    for (uint32_t i = 0; i < length; i++) {
+        the_decoder->offset += 2; // SMALL_TUPLE_EXT, 2.
+        if (++the_decoder->elements > the_decoder->limits.max_elements)
+            luaL_error(L, "lerl_decoder.unpack: Term has too many elements.");
+
+        lerl_unpack(L, the_decoder);
+        if (lua_isnil(L, -1) || (lua_pushvalue(L, -1), lua_rawget(L, -3) != LUA_TNIL)) {
+            if (!lua_isnil(L, -1))
+                lua_pop(L, 1);
+            // No key, or a repeated one: decode the value and drop it.
+            lerl_unpack(L, the_decoder);
+            lua_pop(L, 2);
+            continue;
+        }
+        lua_pop(L, 1);
+        lerl_unpack(L, the_decoder);
+        lua_rawset(L, -3);
+    }
+    the_decoder->depth -= 2;
+    lerl_set_decoded_mt(L, the_decoder, lerl_map_mt, lerl_frozen_map_mt);
+}
+
+static int lerl_decodeList(lua_State* L, lerl_decoder* the_decoder) {
+    if (the_decoder->vectors && lerl_decode_vector(L, the_decoder))
+        return 1;
+
+    uint32_t length = lerl_read32_out(L, the_decoder);
+    lerl_cursor c;
+    lerl_cursor_init(&c, the_decoder->data + the_decoder->offset, the_decoder->size - the_decoder->offset, NULL);
+    if (the_decoder->proplists && length > 0 && lerl_is_proplist(c, length)) {
+        lerl_decode_proplist(L, the_decoder, length);
+    } else {
+        lerl_decodeSequential(L, the_decoder, length);
+        lerl_set_decoded_mt(L, the_decoder, lerl_array_mt, lerl_frozen_array_mt);
+    }
+    uint8_t tailMarker = lerl_read8_out(L, the_decoder);
+    if (tailMarker != NIL_EXT)
+        return luaL_error(L, "lerl_decoder.decodeList: List doesn't end with a tail marker.");
+
+    // The tail counts as a term, as it does when validating.
+    the_decoder->elements++;
+    return 1;
+}
+
+static int lerl_decodeNil(lua_State* L, lerl_decoder* the_decoder) {
+    lua_createtable(L, 0, 0);
+    lerl_set_decoded_mt(L, the_decoder, NULL, lerl_frozen_array_mt);
+    return 1;
+}
+
+
+static int lerl_decodeMap(lua_State* L, lerl_decoder* the_decoder) {
+    uint32_t length = lerl_read32_out(L, the_decoder);
+    lerl_enter_container(L, the_decoder, length, 2);
+
+    lua_createtable(L, 0, length);
+
+    for (uint32_t i = 0; i < length; ++i) {
+        lerl_unpack(L, the_decoder);
+        lerl_unpack(L, the_decoder);
+        if (the_decoder->invalid){
+            return 0;
+        }
+        lua_rawset(L, -3);
+    }
+    the_decoder->depth--;
+    lerl_set_decoded_mt(L, the_decoder, lerl_map_mt, lerl_frozen_map_mt);
+    return 1;
+}
+
+static const char* lerl_readString(lua_State* L, lerl_decoder* the_decoder, uint32_t length) {
+    int offset = the_decoder->offset;
+    char* data = the_decoder->data;
+    if (offset + length > the_decoder->size){
+        luaL_error(L, "lerl_decoder.readString: Reading passes the end of the buffer.");
+        return NULL;
+    }
+
+    the_decoder->offset = offset + length;
+    return (const char*)(data + offset);
+}
+
+static int lerl_processAtom(lua_State* L, lerl_decoder* the_decoder, const char* atom, uint16_t len) {
+    if (atom == NULL){
+        return 0;
+    }
+
+    if (len == 3 && strncmp(atom, "nil", 3) == 0 ){
+        lua_pushnil(L);
+    } else if (len == 4 && strncmp(atom, "null", 4) == 0 ){
+        lua_rawgeti(L, LUA_REGISTRYINDEX, the_decoder->empty_ref);
+    } else if (len == 4 && strncmp(atom, "true", 4) == 0 ){
+        lua_pushboolean(L, 1);
+    } else if (len == 5 && strncmp(atom, "false", 5) == 0 ){
+        lua_pushboolean(L, 0);
+    } else
+        lua_pushlstring(L, atom, len);
+    return 1;
+}
+
+static int lerl_decodeAtom(lua_State* L, lerl_decoder* the_decoder) {
+    uint16_t len = lerl_read16_out(L, the_decoder);
+    const char* atom = lerl_readString(L, the_decoder, len);
+    lerl_processAtom(L, the_decoder, atom, len);
+    return 1;
+}
+
+static int lerl_decodeSmallAtom(lua_State* L, lerl_decoder* the_decoder) {
+    uint8_t len = lerl_read8_out(L, the_decoder);
+    const char* atom = lerl_readString(L, the_decoder, len);
+    lerl_processAtom(L, the_decoder, atom, len);
+    return 1;
+}
+
+/* FLOAT_EXT holds a double printed as "%.20e" in 31 NUL padded bytes. The 21
+   significant digits pin down the double, so scaling the first 19 of them with
+   64-bit mantissa long doubles rounds to it; anything else goes through strtod. */
+
+#define FLOAT_EXT_SIZE 31
+
+static const long double lerl_pow10[28] = {
+    1e0L, 1e1L, 1e2L, 1e3L, 1e4L, 1e5L, 1e6L, 1e7L, 1e8L, 1e9L, 1e10L, 1e11L, 1e12L, 1e13L,
+    1e14L, 1e15L, 1e16L, 1e17L, 1e18L, 1e19L, 1e20L, 1e21L, 1e22L, 1e23L, 1e24L, 1e25L,
+    1e26L, 1e27L
+};
+
+static bool lerl_parse_float_fixed(const char* s, size_t size, double* out) {
+#if LDBL_MANT_DIG < 64
+    return false;
+#else
+    size_t i = 0;
+    bool negative = false;
+    if (i < size && (s[i] == '-' || s[i] == '+'))
+        negative = s[i++] == '-';
+
+    uint64_t mantissa = 0;
+    int digits = 0, dropped = 0, point = -1;
+    for (; i < size; i++) {
+        char ch = s[i];
+        if (ch >= '0' && ch <= '9') {
+            if (digits < 19) {
+                mantissa = mantissa * 10 + (uint64_t)(ch - '0');
+                digits++;
+            } else {
+                if (dropped == 0 && ch >= '5')
+                    mantissa++; // Round on the first dropped digit.
+                dropped++;
+            }
+        } else if (ch == '.' && point < 0) {
+            point = digits + dropped;
+        } else {
+            break;
+        }
+    }
+    if (digits == 0 || i >= size || (s[i] != 'e' && s[i] != 'E'))
+        return false;
+    i++;
+
+    bool negative_exp = false;
+    if (i < size && (s[i] == '-' || s[i] == '+'))
+        negative_exp = s[i++] == '-';
+    if (i >= size || s[i] < '0' || s[i] > '9')
+        return false;
+    int exponent = 0;
+    for (; i < size && s[i] >= '0' && s[i] <= '9'; i++) {
+        if (exponent > 10000)
+            return false;
+        exponent = exponent * 10 + (s[i] - '0');
+    }
+    for (; i < size; i++) {
+        if (s[i] != '\0')
+            return false;
+    }
+
+    if (point < 0)
+        point = digits + dropped;
+    int scale = (negative_exp ? -exponent : exponent) + point - digits;
+
+    long double value = (long double)mantissa;
+    if (scale > 0) {
+        for (; scale > 27; scale -= 27)
+            value *= lerl_pow10[27];
+        value *= lerl_pow10[scale];
+    } else {
+        for (; scale < -27; scale += 27)
+            value /= lerl_pow10[27];
+        value /= lerl_pow10[-scale];
+    }
+
+    *out = (double)(negative ? -value : value);
+    return true;
+#endif
+}
+
+static bool lerl_parse_float_ext(const char* s, double* out) {
+    if (lerl_parse_float_fixed(s, FLOAT_EXT_SIZE, out))
+        return true;
+
+    char nullterminated[FLOAT_EXT_SIZE + 1] = {0};
+    memcpy(nullterminated, s, FLOAT_EXT_SIZE);
+    char* end;
+    *out = strtod(nullterminated, &end);
+    return end != nullterminated;
+}
+
+static int lerl_decodeFloat(lua_State* L, lerl_decoder* the_decoder) {
+    const char* floatStr = lerl_readString(L, the_decoder, 31);
+    if (floatStr == NULL){
+        return 0;
+    }
+
+    double number;
+    if (!lerl_parse_float_ext(floatStr, &number))
+        return luaL_error(L, "lerl_decoder.decodeFloat: Invalid float encoded.");
+
+    lua_pushnumber(L, number);
+    return 1;
+}
+
+static int lerl_decodeNewFloat(lua_State* L, lerl_decoder* the_decoder) {
+    union {
+        uint64_t ui64;
+        double df;
+    } val;
+
+    val.ui64 = lerl_read64_out(L, the_decoder);
+
+    lua_pushnumber(L, val.df);
+    return 1;
+}
+
+static int lerl_decodeBig(lua_State* L, lerl_decoder* the_decoder, uint32_t digits) {
+    uint8_t sign = lerl_read8_out(L, the_decoder);
+
+    if (digits > 8)
+        return luaL_error(L, "lerl_decoder.decodeBig: Unable to decode big ints larger than 8 bytes");
+
+    uint64_t value = 0;
+    uint64_t b = 1;
+    for(uint32_t i = 0; i < digits; ++i) {
+            uint64_t digit = lerl_read8_out(L, the_decoder);
+            value += digit * b;
+            b <<= 8;
+    }
+
+    if (digits <= 8) {
+        if (sign == 0) {
+            lua_pushinteger(L, value);
+            return 1;
+        } else if ((value & (1ULL << 63)) == 0) {
+            lua_pushinteger(L, -(lua_Integer)value);
+            return 1;
+        }
+    }
+
+    char outBuffer[32] = {0};
+    const char* fmt = (sign == 0) ? (PRIu64) : ("-" PRIu64);
+    int res = sprintf(outBuffer, fmt, value);
+
+    if (res < 0)
+        return luaL_error(L, "lerl_decoder.decodeBig: Unable to convert big int to string.");
+
+    lua_pushlstring(L, outBuffer, res);
+    return 1;
+}
+
+static int lerl_decodeSmallBig(lua_State* L, lerl_decoder* the_decoder) {
+    return lerl_decodeBig(L, the_decoder, lerl_read8_out(L, the_decoder));
+}
+
+static int lerl_decodeLargeBig(lua_State* L, lerl_decoder* the_decoder) {
+    return lerl_decodeBig(L, the_decoder, lerl_read32_out(L, the_decoder));
+}
+
+static int lerl_decodeBinary(lua_State* L, lerl_decoder* the_decoder) {
+    uint32_t size = lerl_read32_out(L, the_decoder);
+    const char* data = lerl_readString(L, the_decoder, size);
+    bool ascii;
+    if (the_decoder->utf8 != LERL_UTF8_OFF && !lerl_utf8_valid((const uint8_t*)data, size, &ascii)) {
+        if (the_decoder->utf8 == LERL_UTF8_REJECT)
+            return luaL_error(L, "lerl_decoder.unpack: Binary is not valid UTF-8.");
+        lua_createtable(L, 1, 0);
+        lua_pushlstring(L, data, size);
+        lua_rawseti(L, -2, 1);
+        lerl_set_decoded_mt(L, the_decoder, lerl_binary_mt, lerl_binary_mt);
+        return 1;
+    }
+    lua_pushlstring(L, data, size);
+    return 1;
+}
+
+static int lerl_decodeString(lua_State* L, lerl_decoder* the_decoder) {
+    uint16_t size = lerl_read16_out(L, the_decoder);
+    lua_pushlstring(L, lerl_readString(L, the_decoder, size), size);
+    return 1;
+}
+
+static int lerl_decodeStringAsList(lua_State* L, lerl_decoder* the_decoder) {
+    uint16_t length = lerl_read16_out(L, the_decoder);
+    if (the_decoder->offset + length > the_decoder->size)
+        return luaL_error(L, "lerl_decode.decodeStringAsList: Reading sequence past the end of the buffer.");
+
+    const uint8_t* bytes = (const uint8_t*)lerl_readString(L, the_decoder, length);
+
+    if (the_decoder->strings) {
+        lua_pushlstring(L, (const char*)bytes, length);
+        return 1;
+    }
+
+    if (the_decoder->vectors) {
+        lerl_vector* v = lerl_push_vector(L, length, 1, true);
+        memcpy(v->items, bytes, length);
+        return 1;
+    }
+
+    lua_createtable(L, length, 0);
+
+    for (uint16_t i = 0; i < length; ++i) {
+        lua_pushinteger(L, bytes[i]);
+        lua_rawseti(L, -2, i + 1);
+    }
+    return 1;
+}
+
+/* Decodes a tuple whose first element is a registered record name as a table of
+   field name to value. Returns false, consuming nothing, if it is not one. */
+static bool lerl_decode_record(lua_State* L, lerl_decoder* the_decoder, uint32_t arity) {
+    const uint8_t* p = (const uint8_t*)the_decoder->data + the_decoder->offset;
+    size_t avail = the_decoder->size - the_decoder->offset;
+    size_t name_at, name_len;
+    if (avail < 2)
+        return false;
+
+    switch (p[0]) {
+        case SMALL_ATOM_EXT:
+            name_len = p[1];
+            name_at = 2;
+            break;
+        case ATOM_EXT:
+            if (avail < 3)
+                return false;
+            name_len = ((size_t)p[1] << 8) | p[2];
+            name_at = 3;
+            break;
+        default:
+            return false;
+    }
+    if (name_at + name_len > avail)
+        return false;
+
+    lua_rawgeti(L, LUA_REGISTRYINDEX, the_decoder->records_ref);
+    lua_pushlstring(L, (const char*)p + name_at, name_len);
+    if (lua_rawget(L, -2) != LUA_TTABLE) {
+        lua_pop(L, 2);
+        return false;
+    }
+    lua_remove(L, -2);
+    lua_pushliteral(L, "__lerl_fields");
+    lua_rawget(L, -2); // Stack: ..., mt, fields
+    if (lua_rawlen(L, -1) != (lua_Unsigned)arity - 1) {
+        lua_pop(L, 2);
+        return false;
+    }
+
+    the_decoder->offset += name_at + name_len;
+    if (++the_decoder->elements > the_decoder->limits.max_elements)
+        luaL_error(L, "lerl_decoder.unpack: Term has too many elements.");
+
+    lerl_enter_container(L, the_decoder, arity - 1, 1);
+    lua_createtable(L, 0, arity - 1);
+    for (uint32_t i = 1; i < arity; i++) {
+        lua_rawgeti(L, -2, i);
+        lerl_unpack(L, the_decoder);
+        lua_rawset(L, -3);
+    }
+    the_decoder->depth--;
+
+    lua_replace(L, -2); // Stack: ..., mt, record
+    lua_insert(L, -2);
+    lua_setmetatable(L, -2);
+    if (the_decoder->frozen)
+        lerl_freeze(L);
+    return true;
+}
+
+static int lerl_decodeTuple(lua_State* L, lerl_decoder* the_decoder, uint32_t arity) {
+    if (the_decoder->records_ref != LUA_NOREF && arity > 0 && lerl_decode_record(L, the_decoder, arity))
+        return 1;
+
+    lerl_decodeSequential(L, the_decoder, arity);
+    lerl_set_decoded_mt(L, the_decoder, lerl_tuple_mt, lerl_frozen_tuple_mt);
+    return 1;
+}
+
+static int lerl_decodeSmallTuple(lua_State* L, lerl_decoder* the_decoder) {
+    return lerl_decodeTuple(L, the_decoder, lerl_read8_out(L, the_decoder));
+}
+
+static int lerl_decodeLargeTuple(lua_State* L, lerl_decoder* the_decoder) {
+    return lerl_decodeTuple(L, the_decoder, lerl_read32_out(L, the_decoder));
+}
+
+static int lerl_decodeCompressed(lua_State* L, lerl_decoder* the_decoder) {
+    uint32_t uncompressedSize = lerl_read32_out(L, the_decoder);
+
+    size_t compressedSize = the_decoder->size - the_decoder->offset;
+    if (uncompressedSize > the_decoder->limits.max_inflated || !lerl_plausible_inflated_size(compressedSize, uncompressedSize))
+        return luaL_error(L, "lerl_decoder.decodeCompressed: Compressed term inflates past the limit.");
+
+    uint8_t* outBuffer = (uint8_t*)malloc(uncompressedSize);
+    if (outBuffer == NULL && uncompressedSize > 0)
+        return luaL_error(L, "lerl_decoder.decodeCompressed: Failed to allocate buffer!");
+
+    size_t used = lerl_inflate((const uint8_t*)(the_decoder->data + the_decoder->offset), compressedSize, outBuffer, uncompressedSize);
+    if (used == 0) {
+        free(outBuffer);
+        return luaL_error(L, "lerl_decoder.decodeCompressed: Failed to uncompresss compressed item.");
+    }
+    the_decoder->offset += (int)used;
+
+    // The child needs its own reference to a custom empty value, its __gc releases it.
+    lua_getfield(L, LUA_REGISTRYINDEX, "lerl_empty");
+    int empty_ref = lua_tointeger(L, -1);
+    lua_pop(L, 1);
+    if (the_decoder->empty_ref != empty_ref) {
+        lua_rawgeti(L, LUA_REGISTRYINDEX, the_decoder->empty_ref);
+        empty_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+    }
+
+    lerl_decoder* children = lua_newuserdata(L, sizeof(lerl_decoder));
+    lerl_init_decoder(children, empty_ref);
+    children->data = (char*)outBuffer;
+    children->size = uncompressedSize;
+    children->invalid = false;
+    children->limits = the_decoder->limits;
+    children->checked = the_decoder->checked;
+    children->depth = the_decoder->depth;
+    children->elements = the_decoder->elements;
+    if (the_decoder->cache_ref != LUA_NOREF) {
+        // Cache hits and inserts reach the cache's values through cache_ref.
+        lua_rawgeti(L, LUA_REGISTRYINDEX, the_decoder->cache_ref);
+        children->cache_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+        children->cache = the_decoder->cache;
+    }
+    children->frozen = the_decoder->frozen;
+    children->vectors = the_decoder->vectors;
+    children->strings = the_decoder->strings;
+    children->proplists = the_decoder->proplists;
+    children->utf8 = the_decoder->utf8;
+    if (the_decoder->records_ref != LUA_NOREF) {
+        lua_rawgeti(L, LUA_REGISTRYINDEX, the_decoder->records_ref);
+        children->records_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+    }
+
+    luaL_getmetatable(L, lerl_decoder_type);
+    lua_setmetatable(L, -2); // Stack : ..., children
+    lerl_check_buffer(L, children, "lerl_decoder.decodeCompressed");
+    lerl_unpack(L, children); // Stack : ..., children, value
+    the_decoder->elements = children->elements;
+    lerl_release_data(children);
+    children->size = 0;
+    children->offset = 0;
+
+    lua_remove(L, -2); // Stack : ..., value
+    return 1;
+}
+
+/* Decodes the node atom of a PID, port or reference and leaves its name on the
+   stack for lerl_push_ident. */
+static const char* lerl_decode_node(lua_State* L, lerl_decoder* the_decoder, size_t* len) {
+    lerl_unpack(L, the_decoder);
+    if (lua_type(L, -1) != LUA_TSTRING)
+        luaL_error(L, "lerl_decoder.unpack: Node name is not an atom.");
+    return lua_tolstring(L, -1, len);
+}
+
+static int lerl_decodeReference(lua_State* L, lerl_decoder* the_decoder) {
+    size_t len;
+    const char* node = lerl_decode_node(L, the_decoder, &len);
+    uint32_t id = lerl_read32_out(L, the_decoder);
+    uint32_t creation = lerl_read8_out(L, the_decoder);
+
+    luaL_Buffer b;
+    luaL_buffinit(L, &b);
+    lerl_ident_begin(&b, LERL_REF, 1, creation);
+    lerl_ident_add_id(&b, id);
+    luaL_addlstring(&b, node, len);
+    lerl_push_ident(L, &b);
+    return 1;
+}
+
+/* NEW_REFERENCE_EXT, or NEWER_REFERENCE_EXT with its 32-bit creation. */
+static int lerl_decode_new_reference(lua_State* L, lerl_decoder* the_decoder, bool newer) {
+    uint16_t count = lerl_read16_out(L, the_decoder);
+    size_t len;
+    const char* node = lerl_decode_node(L, the_decoder, &len);
+    uint32_t creation = newer ? lerl_read32_out(L, the_decoder) : lerl_read8_out(L, the_decoder);
+
+    luaL_Buffer b;
+    luaL_buffinit(L, &b);
+    lerl_ident_begin(&b, LERL_REF, count, creation);
+    for (uint16_t i = 0; i < count; i++)
+        lerl_ident_add_id(&b, lerl_read32_out(L, the_decoder));
+    luaL_addlstring(&b, node, len);
+    lerl_push_ident(L, &b);
+    return 1;
+}
+
+static int lerl_decodeNewReference(lua_State* L, lerl_decoder* the_decoder) {
+    return lerl_decode_new_reference(L, the_decoder, false);
+}
+
+static int lerl_decodeNewerReference(lua_State* L, lerl_decoder* the_decoder) {
+    return lerl_decode_new_reference(L, the_decoder, true);
+}
+
+/* PORT_EXT, NEW_PORT_EXT or V4_PORT_EXT by tag. */
+static int lerl_decode_port(lua_State* L, lerl_decoder* the_decoder, uint8_t tag) {
+    size_t len;
+    const char* node = lerl_decode_node(L, the_decoder, &len);
+    uint32_t high = tag == V4_PORT_EXT ? lerl_read32_out(L, the_decoder) : 0;
+    uint32_t low = lerl_read32_out(L, the_decoder);
+    uint32_t creation = tag == PORT_EXT ? lerl_read8_out(L, the_decoder) : lerl_read32_out(L, the_decoder);
+
+    luaL_Buffer b;
+    luaL_buffinit(L, &b);
+    lerl_ident_begin(&b, LERL_PORT, 2, creation);
+    lerl_ident_add_id(&b, high);
+    lerl_ident_add_id(&b, low);
+    luaL_addlstring(&b, node, len);
+    lerl_push_ident(L, &b);
+    return 1;
+}
+
+static int lerl_decodePort(lua_State* L, lerl_decoder* the_decoder) {
+    return lerl_decode_port(L, the_decoder, PORT_EXT);
+}
+
+/* PID_EXT, or NEW_PID_EXT with its 32-bit creation. */
+static int lerl_decode_pid(lua_State* L, lerl_decoder* the_decoder, bool newer) {
+    size_t len;
+    const char* node = lerl_decode_node(L, the_decoder, &len);
+    uint32_t id = lerl_read32_out(L, the_decoder);
+    uint32_t serial = lerl_read32_out(L, the_decoder);
+    uint32_t creation = newer ? lerl_read32_out(L, the_decoder) : lerl_read8_out(L, the_decoder);
+
+    luaL_Buffer b;
+    luaL_buffinit(L, &b);
+    lerl_ident_begin(&b, LERL_PID, 2, creation);
+    lerl_ident_add_id(&b, id);
+    lerl_ident_add_id(&b, serial);
+    luaL_addlstring(&b, node, len);
+    lerl_push_ident(L, &b);
+    return 1;
+}
+
+static int lerl_decodePID(lua_State* L, lerl_decoder* the_decoder) {
+    return lerl_decode_pid(L, the_decoder, false);
+}
+
+static int lerl_decodeExport(lua_State* L, lerl_decoder* the_decoder) {
+    lua_createtable(L, 0, 3);
+    lua_pushliteral(L, "mod");
+    lerl_unpack(L, the_decoder);
+    lua_settable(L, -3);
+
+    lua_pushliteral(L, "fun");
+    lerl_unpack(L, the_decoder);
+    lua_settable(L, -3);
+
+    lua_pushliteral(L, "arity");
+    lerl_unpack(L, the_decoder);
+    lua_settable(L, -3);
+    return 1;
+}
+
+static int lerl_unpack_term(lua_State* L, lerl_decoder* the_decoder);
+
+/* Sub-term cache. Entries are found by a hash of the term's bytes and compared in
+   full, their tables live in the cache userdata's uservalue and the least recently
+   used are dropped to stay within the budget. */
+
+#define lerl_cache_type "lerl_cache"
+#define LERL_CACHE_SEED 0x6c65726c2d636163ULL
+// Rough heap cost of the Lua tables built from each byte of a term.
+#define LERL_CACHE_TABLE_FACTOR 4
+
+static inline uint64_t lerl_mix64(uint64_t x) {
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdULL;
+    x ^= x >> 33;
+    x *= 0xc4ceb9fe1a85ec53ULL;
+    x ^= x >> 33;
+    return x;
+}
+
+static uint64_t lerl_hash_bytes(const void* data, size_t len, uint64_t seed) {
+    const uint8_t* p = data;
+    uint64_t h = seed ^ (len * 0x9e3779b97f4a7c15ULL);
+    while (len >= 8) {
+        uint64_t k;
+        memcpy(&k, p, 8);
+        h = (h ^ lerl_mix64(k)) * 0x9e3779b97f4a7c15ULL;
+        p += 8;
+        len -= 8;
+    }
+    uint64_t k = 0;
+    memcpy(&k, p, len);
+    return lerl_mix64(h ^ lerl_mix64(k ^ len));
+}
+
+static lerl_cache* lerl_get_cache(lua_State* L, int at) {
+    return luaL_checkudata(L, at, lerl_cache_type);
+}
+
+static void lerl_set_cache(lua_State* L, lerl_decoder* the_decoder, int at) {
+    lerl_cache* cache = lerl_get_cache(L, at);
+    if (the_decoder->cache_ref != LUA_NOREF)
+        luaL_unref(L, LUA_REGISTRYINDEX, the_decoder->cache_ref);
+    lua_pushvalue(L, at);
+    the_decoder->cache_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+    the_decoder->cache = cache;
+}
+
+/* Builds the name -> metatable table for the records option from a table of
+   record name to its list of field names. It is built again on every configure,
+   so later changes to the table take effect. */
+static void lerl_set_records(lua_State* L, lerl_decoder* the_decoder, int at) {
+    luaL_checktype(L, at, LUA_TTABLE);
+    lua_newtable(L);
+    lua_pushnil(L);
+    while (lua_next(L, at) != 0) {
+        if (lua_type(L, -2) != LUA_TSTRING || lua_type(L, -1) != LUA_TTABLE)
+            luaL_error(L, "lerl_decoder.configure: records must map record names to lists of field names.");
+
+        lua_Unsigned count = lua_rawlen(L, -1);
+        lua_createtable(L, (int)count, 0);
+        for (lua_Unsigned i = 1; i <= count; i++) {
+            if (lua_rawgeti(L, -2, (lua_Integer)i) != LUA_TSTRING)
+                luaL_error(L, "lerl_decoder.configure: Record field names must be strings.");
+            lua_rawseti(L, -2, (lua_Integer)i);
+        }
+
+        lua_createtable(L, 0, 3);
+        lua_pushliteral(L, "record");
+        lua_setfield(L, -2, "__lerl_type");
+        lua_pushvalue(L, -4);
+        lua_setfield(L, -2, "__lerl_record");
+        lua_insert(L, -2);
+        lua_setfield(L, -2, "__lerl_fields");
+
+        lua_pushvalue(L, -3);
+        lua_insert(L, -2);
+        lua_rawset(L, -5); // records[name] = mt
+        lua_pop(L, 1);
+    }
+
+    if (the_decoder->records_ref != LUA_NOREF)
+        luaL_unref(L, LUA_REGISTRYINDEX, the_decoder->records_ref);
+    the_decoder->records_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+}
+
+/* Whether the record metatable tables at a and b, or false for no records, name
+   the same records with the same fields. */
+static bool lerl_same_records(lua_State* L, int a, int b) {
+    if (!lua_istable(L, a) || !lua_istable(L, b))
+        return lua_rawequal(L, a, b);
+
+    lua_Integer names = 0;
+    lua_pushnil(L);
+    while (lua_next(L, a) != 0) {
+        names++;
+        lua_pushvalue(L, -2);
+        bool same = lua_rawget(L, b) == LUA_TTABLE;
+        if (same) {
+            lua_getfield(L, -2, "__lerl_fields");
+            lua_getfield(L, -2, "__lerl_fields");
+            lua_Unsigned count = lua_rawlen(L, -2);
+            same = lua_rawlen(L, -1) == count;
+            for (lua_Unsigned i = 1; same && i <= count; i++) {
+                lua_rawgeti(L, -2, (lua_Integer)i);
+                lua_rawgeti(L, -2, (lua_Integer)i);
+                same = lua_rawequal(L, -1, -2);
+                lua_pop(L, 2);
+            }
+            lua_pop(L, 2);
+        }
+        lua_pop(L, 2);
+        if (!same) {
+            lua_pop(L, 1);
+            return false;
+        }
+    }
+
+    lua_pushnil(L);
+    while (lua_next(L, b) != 0) {
+        lua_pop(L, 1);
+        names--;
+    }
+    return names == 0;
+}
+
+/* Cached values are built once and handed to every decoder using the cache, so
+   the first decoder binds the cache to its empty value, records and value
+   options, and decoders that would build other values from the same bytes are
+   refused. reset clears the binding. */
+static void lerl_bind_cache(lua_State* L, lerl_decoder* the_decoder) {
+    lua_Integer options = (lua_Integer)the_decoder->vectors | (lua_Integer)the_decoder->strings << 1
+        | (lua_Integer)the_decoder->proplists << 2 | (lua_Integer)the_decoder->utf8 << 3;
+
+    luaL_checkstack(L, 12, "lerl_decoder.configure: Out of stack space.");
+    lua_rawgeti(L, LUA_REGISTRYINDEX, the_decoder->cache_ref);
+    int cache_at = lua_gettop(L);
+    lua_rawgeti(L, LUA_REGISTRYINDEX, the_decoder->empty_ref);
+    if (the_decoder->records_ref != LUA_NOREF)
+        lua_rawgeti(L, LUA_REGISTRYINDEX, the_decoder->records_ref);
+    else
+        lua_pushboolean(L, false);
+
+    if (lua_getiuservalue(L, cache_at, 2) != LUA_TTABLE) {
+        lua_createtable(L, 3, 0);
+        lua_pushinteger(L, options);
+        lua_rawseti(L, -2, 1);
+        lua_pushvalue(L, cache_at + 1);
+        lua_rawseti(L, -2, 2);
+        lua_pushvalue(L, cache_at + 2);
+        lua_rawseti(L, -2, 3);
+        lua_setiuservalue(L, cache_at, 2);
+    } else {
+        int binding = lua_gettop(L);
+        lua_rawgeti(L, binding, 1);
+        if (lua_tointeger(L, -1) != options)
+            luaL_error(L, "lerl_decoder.configure: The cache is bound to decoders with other options.");
+        lua_rawgeti(L, binding, 2);
+        if (!lua_rawequal(L, -1, cache_at + 1))
+            luaL_error(L, "lerl_decoder.configure: The cache is bound to decoders with another empty value.");
+        lua_rawgeti(L, binding, 3);
+        if (!lerl_same_records(L, lua_gettop(L), cache_at + 2))
+            luaL_error(L, "lerl_decoder.configure: The cache is bound to decoders with other records.");
+    }
+    lua_settop(L, cache_at - 1);
+}
+
+static lerl_cache_entry* lerl_cache_find(lerl_cache* cache, uint64_t hash, const char* bytes, size_t len) {
+    if (cache->bucket_count == 0)
+        return NULL;
+    lerl_cache_entry* e = cache->buckets[hash & (cache->bucket_count - 1)];
+    while (e != NULL) {
+        if (e->hash == hash && e->len == len && memcmp(e->bytes, bytes, len) == 0)
+            return e;
+        e = e->chain;
+    }
+    return NULL;
+}
+
+static void lerl_cache_unlink(lerl_cache* cache, lerl_cache_entry* e) {
+    if (e->newer != NULL)
+        e->newer->older = e->older;
+    else
+        cache->newest = e->older;
+    if (e->older != NULL)
+        e->older->newer = e->newer;
+    else
+        cache->oldest = e->newer;
+    e->newer = e->older = NULL;
+}
+
+static void lerl_cache_push_newest(lerl_cache* cache, lerl_cache_entry* e) {
+    e->older = cache->newest;
+    e->newer = NULL;
+    if (cache->newest != NULL)
+        cache->newest->newer = e;
+    cache->newest = e;
+    if (cache->oldest == NULL)
+        cache->oldest = e;
+}
+
+/* Drops an entry, the cache's value table must be on top of the stack. */
+static void lerl_cache_evict(lua_State* L, lerl_cache* cache, lerl_cache_entry* e) {
+    lerl_cache_entry** link = &cache->buckets[e->hash & (cache->bucket_count - 1)];
+    while (*link != e)
+        link = &(*link)->chain;
+    *link = e->chain;
+
+    lerl_cache_unlink(cache, e);
+    luaL_unref(L, -1, e->slot);
+    cache->used -= e->cost;
+    cache->count--;
+    free(e);
+}
+
+static bool lerl_cache_grow(lerl_cache* cache) {
+    size_t count = cache->bucket_count == 0 ? 64 : cache->bucket_count * 2;
+    lerl_cache_entry** buckets = calloc(count, sizeof(lerl_cache_entry*));
+    if (buckets == NULL)
+        return false;
+
+    for (size_t i = 0; i < cache->bucket_count; i++) {
+        lerl_cache_entry* e = cache->buckets[i];
+        while (e != NULL) {
+            lerl_cache_entry* next = e->chain;
+            e->chain = buckets[e->hash & (count - 1)];
+            buckets[e->hash & (count - 1)] = e;
+            e = next;
+        }
+    }
+    free(cache->buckets);
+    cache->buckets = buckets;
+    cache->bucket_count = count;
+    return true;
+}
+
+/* Adds the value on top of the stack under bytes. The cache has to be full before
+   it is dropped, so failing to allocate just leaves the value uncached. */
+static void lerl_cache_insert(lua_State* L, lerl_decoder* the_decoder, uint64_t hash, const char* bytes, size_t len) {
+    lerl_cache* cache = the_decoder->cache;
+    size_t cost = sizeof(lerl_cache_entry) + len + len * LERL_CACHE_TABLE_FACTOR;
+    if (cost > cache->budget)
+        return;
+
+    if (cache->count >= cache->bucket_count && !lerl_cache_grow(cache))
+        return;
+
+    lerl_cache_entry* e = malloc(sizeof(lerl_cache_entry) + len);
+    if (e == NULL)
+        return;
+
+    lua_rawgeti(L, LUA_REGISTRYINDEX, the_decoder->cache_ref);
+    lua_getiuservalue(L, -1, 1); // Stack: ..., value, cache, values
+
+    while (cache->used + cost > cache->budget)
+        lerl_cache_evict(L, cache, cache->oldest);
+
+    lua_pushvalue(L, -3);
+    e->slot = luaL_ref(L, -2);
+    lua_pop(L, 2);
+
+    e->hash = hash;
+    e->len = len;
+    e->cost = cost;
+    memcpy(e->bytes, bytes, len);
+    e->chain = cache->buckets[hash & (cache->bucket_count - 1)];
+    cache->buckets[hash & (cache->bucket_count - 1)] = e;
+    lerl_cache_push_newest(cache, e);
+    cache->used += cost;
+    cache->count++;
+}
+
+/* Decodes the next term through the cache. Returns false, having consumed nothing,
+   when the term is not a table the cache keeps at this depth and size. */
+static bool lerl_unpack_cached(lua_State* L, lerl_decoder* the_decoder) {
+    lerl_cache* cache = the_decoder->cache;
+    if (the_decoder->depth < cache->min_depth || the_decoder->depth > cache->max_depth)
+        return false;
+
+    size_t start = the_decoder->offset;
+    if (start >= the_decoder->size)
+        return false;
+
+    uint8_t type = (uint8_t)the_decoder->data[start];
+    if (type != MAP_EXT && type != LIST_EXT && type != SMALL_TUPLE_EXT && type != LARGE_TUPLE_EXT)
+        return false;
+
+    // Find the end of the term, giving up as soon as it is too big to keep.
+    size_t window = the_decoder->size - start;
+    if (window > cache->max_size)
+        window = cache->max_size;
+
+    lerl_limits limits;
+    lerl_default_limits(&limits);
+    lerl_cursor c;
+    lerl_cursor_init(&c, the_decoder->data + start, window, &limits);
+    if (!lerl_cursor_skip(&c, the_decoder->limits.max_depth + 1 - the_decoder->depth))
+        return false;
+
+    size_t len = c.offset;
+    if (len < cache->min_size)
+        return false;
+
+    const char* bytes = the_decoder->data + start;
+    uint64_t hash = lerl_hash_bytes(bytes, len, LERL_CACHE_SEED);
+    lerl_cache_entry* e = lerl_cache_find(cache, hash, bytes, len);
+    if (e != NULL) {
+        the_decoder->elements += c.terms;
+        if (the_decoder->elements > the_decoder->limits.max_elements)
+            luaL_error(L, "lerl_decoder.unpack: Term has too many elements.");
+
+        lua_rawgeti(L, LUA_REGISTRYINDEX, the_decoder->cache_ref);
+        lua_getiuservalue(L, -1, 1);
+        lua_rawgeti(L, -1, e->slot);
+        lua_replace(L, -3);
+        lua_pop(L, 1);
+
+        lerl_cache_unlink(cache, e);
+        lerl_cache_push_newest(cache, e);
+        the_decoder->offset = start + len;
+        cache->hits++;
+        return true;
+    }
+
+    cache->misses++;
+    the_decoder->frozen++;
+    lerl_unpack_term(L, the_decoder);
+    the_decoder->frozen--;
+    lerl_cache_insert(L, the_decoder, hash, bytes, len);
+    return true;
+}
+
+static void lerl_cache_clear(lerl_cache* cache) {
+    lerl_cache_entry* e = cache->newest;
+    while (e != NULL) {
+        lerl_cache_entry* older = e->older;
+        free(e);
+        e = older;
+    }
+    free(cache->buckets);
+    cache->buckets = NULL;
+    cache->bucket_count = 0;
+    cache->count = 0;
+    cache->newest = cache->oldest = NULL;
+    cache->used = 0;
+}
+
+/* lerl.new_cache{budget = bytes, min_size, max_size, min_depth, max_depth}. Terms
+   nested min_depth to max_depth levels deep that are min_size to max_size bytes
+   long are cached, the top-level term is depth 0. Cached values are shared, so
+   a cache only serves decoders with the same empty value and options. */
+static int lerl_new_cache(lua_State* L) {
+    lua_settop(L, 1);
+    lua_Integer budget = lerl_opt_integer(L, 1, "budget", 4 * 1024 * 1024);
+    lua_Integer min_size = lerl_opt_integer(L, 1, "min_size", 32);
+    lua_Integer max_size = lerl_opt_integer(L, 1, "max_size", 16 * 1024);
+    lua_Integer min_depth = lerl_opt_integer(L, 1, "min_depth", 1);
+    lua_Integer max_depth = lerl_opt_integer(L, 1, "max_depth", 4);
+    luaL_argcheck(L, budget >= 0 && min_size >= 0 && max_size >= min_size, 1, "invalid cache sizes");
+    luaL_argcheck(L, min_depth >= 0 && max_depth >= min_depth && max_depth < INT_MAX, 1, "invalid cache depths");
+
+    lerl_cache* cache = lua_newuserdatauv(L, sizeof(lerl_cache), 2);
+    memset(cache, 0, sizeof(lerl_cache));
+    cache->budget = (size_t)budget;
+    cache->min_size = (size_t)min_size;
+    cache->max_size = (size_t)max_size;
+    cache->min_depth = (int)min_depth;
+    cache->max_depth = (int)max_depth;
+
+    lua_newtable(L);
+    lua_setiuservalue(L, -2, 1);
+    luaL_getmetatable(L, lerl_cache_type);
+    lua_setmetatable(L, -2);
+    return 1;
+}
+
+static int lerl_cache_gc(lua_State* L) {
+    lerl_cache_clear(lerl_get_cache(L, 1));
+    return 0;
+}
+
+static int lerl_cache_reset(lua_State* L) {
+    lerl_cache_clear(lerl_get_cache(L, 1));
+    lua_newtable(L);
+    lua_setiuservalue(L, 1, 1);
+    lua_pushnil(L);
+    lua_setiuservalue(L, 1, 2);
+    lua_settop(L, 1);
+    return 1;
+}
+
+/* Returns hits, misses, entries and the bytes of budget in use. */
+static int lerl_cache_stats(lua_State* L) {
+    lerl_cache* cache = lerl_get_cache(L, 1);
+    lua_pushinteger(L, (lua_Integer)cache->hits);
+    lua_pushinteger(L, (lua_Integer)cache->misses);
+    lua_pushinteger(L, (lua_Integer)cache->count);
+    lua_pushinteger(L, (lua_Integer)cache->used);
+    return 4;
+}
+
+static luaL_Reg cache_metamethods[] = {
+    {"__gc", lerl_cache_gc},
+    {NULL, NULL}
+};
+
+static luaL_Reg cache_methods[] = {
+    {"reset", lerl_cache_reset},
+    {"stats", lerl_cache_stats},
+    {NULL, NULL}
+};
+
+static void lerl_cache_init(lua_State* L) {
+    luaL_newmetatable(L, lerl_cache_type);
+    luaL_setfuncs(L, cache_metamethods, 0);
+    luaL_newlib(L, cache_methods);
+    lua_setfield(L, -2, "__index");
+    lua_pop(L, 1);
+
+    const char* frozen[3] = {lerl_frozen_array_mt, lerl_frozen_map_mt, lerl_frozen_tuple_mt};
+    const char* types[3] = {"array", "map", "tuple"};
+    for (int i = 0; i < 3; i++) {
+        luaL_newmetatable(L, frozen[i]);
+        lua_pushstring(L, types[i]);
+        lua_setfield(L, -2, "__lerl_type");
+        lua_pushcfunction(L, lerl_frozen_newindex);
+        lua_setfield(L, -2, "__newindex");
+        lua_pop(L, 1);
+    }
+}
+
+static int lerl_unpack(lua_State* L, lerl_decoder* the_decoder) {
+
+    if (the_decoder->invalid)
+        return luaL_error(L, "Unpacking an invalidated buffer");
+
+    if (the_decoder->offset > the_decoder->size)
+        return luaL_error(L, "Unpacking beyond the end of the buffer");
+
+    if (the_decoder->cache != NULL && lerl_unpack_cached(L, the_decoder))
+        return 1;
+
+    return lerl_unpack_term(L, the_decoder);
+}
+
+static int lerl_unpack_term(lua_State* L, lerl_decoder* the_decoder) {
+    if (++the_decoder->elements > the_decoder->limits.max_elements)
+        return luaL_error(L, "lerl_decoder.unpack: Term has too many elements.");
+
+    uint8_t type = lerl_read8_out(L, the_decoder);
+
+    switch(type) {
+        case SMALL_INTEGER_EXT:
+            lerl_decodeSmallInteger(L, the_decoder);
+            return 1;
+        case INTEGER_EXT:
+            lerl_decodeInteger(L, the_decoder);
+            return 1;
+        case FLOAT_EXT:
+            lerl_decodeFloat(L, the_decoder);
+            return 1;
+        case NEW_FLOAT_EXT:
+            lerl_decodeNewFloat(L, the_decoder);
+            return 1;
+        case ATOM_EXT:
+            lerl_decodeAtom(L, the_decoder);
+            return 1;
+        case SMALL_ATOM_EXT:
+            lerl_decodeSmallAtom(L, the_decoder);
+            return 1;
+        case SMALL_TUPLE_EXT:
+            lerl_decodeSmallTuple(L, the_decoder);
+            return 1;
+        case LARGE_TUPLE_EXT:
+            lerl_decodeLargeTuple(L, the_decoder);
+            return 1;
+        case NIL_EXT:
+            lerl_decodeNil(L, the_decoder);
+            return 1;
+        case STRING_EXT:
+            lerl_decodeStringAsList(L, the_decoder);
+            return 1;
+        case LIST_EXT:
+            lerl_decodeList(L, the_decoder);
+            return 1;
+        case MAP_EXT:
+            lerl_decodeMap(L, the_decoder);
+            return 1;
+        case BINARY_EXT:
+            lerl_decodeBinary(L, the_decoder);
+            return 1;
+        case SMALL_BIG_EXT:
+            lerl_decodeSmallBig(L, the_decoder);
+            return 1;
+        case LARGE_BIG_EXT:
+            lerl_decodeLargeBig(L, the_decoder);
+            return 1;
+        case REFERENCE_EXT:
+            lerl_decodeReference(L, the_decoder);
+            return 1;
+        case NEW_REFERENCE_EXT:
+            lerl_decodeNewReference(L, the_decoder);
+            return 1;
+        case NEWER_REFERENCE_EXT:
+            lerl_decodeNewerReference(L, the_decoder);
+            return 1;
+        case PORT_EXT:
+            lerl_decodePort(L, the_decoder);
+            return 1;
+        case NEW_PORT_EXT:
+        case V4_PORT_EXT:
+            lerl_decode_port(L, the_decoder, type);
+            return 1;
+        case PID_EXT:
+            lerl_decodePID(L, the_decoder);
+            return 1;
+        case NEW_PID_EXT:
+            lerl_decode_pid(L, the_decoder, true);
+            return 1;
+        case EXPORT_EXT:
+            lerl_decodeExport(L, the_decoder);
+            return 1;
+        case COMPRESSED:
+            lerl_decodeCompressed(L, the_decoder);
+            return 1;
+        default:
+            return luaL_error(L, "Unsupported erlang term type identifier found");
+    }
+}
+
+static int lerl_unpack_fun(lua_State* L) {
+    lerl_decoder* the_decoder = lerl_get_decoder(L, 1);
+    the_decoder->depth = 0;
+    the_decoder->frozen = 0;
+    lerl_skip_version(the_decoder);
+    if (lerl_unpack(L, the_decoder)) {
+        return 1;
+    } else {
+        lua_pushnil(L);
+        lua_pushinteger(L, the_decoder->offset);
+        return 2;
+    }
+}
+
+static int lerl_unpack_all(lua_State* L) {
+    lerl_decoder* the_decoder = lerl_get_decoder(L, 1);
+    the_decoder->depth = 0;
+    the_decoder->frozen = 0;
+    int count = 0;
+    lerl_skip_version(the_decoder);
+    while((the_decoder->offset < the_decoder->size) && !the_decoder->invalid){
+        count = count + 1;
+        luaL_checkstack(L, 1, "lerl_decoder.unpack_all: Too many terms.");
+        lerl_unpack(L, the_decoder);
+        lerl_skip_version(the_decoder);
+    }
+    lua_remove(L, 1);
+    return count;
+}
+
+/* Iterator over {packet, N} framed terms, decoded in place from the buffer.
+   Stops without consuming anything when the next frame is incomplete. */
+static int lerl_next_frame(lua_State* L) {
+    lerl_decoder* the_decoder = lerl_get_decoder(L, 1);
+    int header = (int)lua_tointeger(L, lua_upvalueindex(1));
+    lua_settop(L, 1);
+
+    if (the_decoder->invalid || the_decoder->offset + (size_t)header > the_decoder->size)
+        return 0;
+
+    const uint8_t* head = (const uint8_t*)(the_decoder->data + the_decoder->offset);
+    size_t length = 0;
+    for (int i = 0; i < header; i++) {
+        length = (length << 8) | head[i];
+    }
+
+    size_t frame_end = the_decoder->offset + header + length;
+    if (frame_end > the_decoder->size)
+        return 0;
+
+    the_decoder->offset += header;
+    if (lerl_read8_out(L, the_decoder) != FORMAT_VERSION)
+        return luaL_error(L, "lerl_decoder.frames: Version mismatch!");
+
+    if (the_decoder->checked) {
+        size_t offset = 0;
+        const char* error = lerl_scan(the_decoder->data + the_decoder->offset,
+            frame_end - the_decoder->offset, &the_decoder->limits, false, &offset);
+        if (error != NULL)
+            return luaL_error(L, "lerl_decoder.frames: %s (at offset %d)", error, (int)(the_decoder->offset + offset));
+    }
+
+    the_decoder->depth = 0;
+    the_decoder->frozen = 0;
+    the_decoder->elements = 0;
+    lerl_unpack(L, the_decoder);
+    if ((size_t)the_decoder->offset != frame_end)
+        return luaL_error(L, "lerl_decoder.frames: Frame length does not match its term.");
+
+    lua_pushinteger(L, the_decoder->offset);
+    lua_insert(L, -2);
+    return 2;
+}
+
+static int lerl_frames(lua_State* L) {
+    lerl_decoder* the_decoder = lerl_get_decoder(L, 1);
+    if (lua_isnoneornil(L, 2)) {
+        lua_settop(L, 1);
+        lua_pushinteger(L, the_decoder->frame_header);
+    }
+    lua_pushinteger(L, lerl_check_frame_header(L, 2));
+    lua_pushcclosure(L, lerl_next_frame, 1);
+    lua_pushvalue(L, 1);
+    return 2;
+}
+
+static int lerl_decoder_gc(lua_State* L) {
+    lerl_decoder* the_decoder = lerl_get_decoder(L, 1);
+
+    lerl_release_data(the_decoder);
+
+    the_decoder->size = 0;
+    the_decoder->invalid = true;
+    the_decoder->offset = 0;
+    lua_getfield(L, LUA_REGISTRYINDEX, "lerl_empty");
+    int defaultref = lua_tointeger(L, -1);
+    if (the_decoder->empty_ref != defaultref)
+        luaL_unref(L, LUA_REGISTRYINDEX, the_decoder->empty_ref);
+    the_decoder->empty_ref = defaultref;
+
+    lua_pop(L, 1);
+
+    if (the_decoder->cache_ref != LUA_NOREF)
+        luaL_unref(L, LUA_REGISTRYINDEX, the_decoder->cache_ref);
+    the_decoder->cache_ref = LUA_NOREF;
+    the_decoder->cache = NULL;
+
+    if (the_decoder->records_ref != LUA_NOREF)
+        luaL_unref(L, LUA_REGISTRYINDEX, the_decoder->records_ref);
+    the_decoder->records_ref = LUA_NOREF;
+    return 0;
+}
+
+static int lerl_make_array(lua_State* L) {
+    if (!lua_isnoneornil(L, 1)) {
+        luaL_getmetatable(L, lerl_array_mt);
+        lua_setmetatable(L, -2);
+        return 1;
+    } else {
+        lua_newtable(L);
+        luaL_getmetatable(L, lerl_array_mt);
+        lua_setmetatable(L, -2);
+        return 1;
+    }
+}
+
+
+static int lerl_make_map(lua_State* L) {
+    if (!lua_isnoneornil(L, 1)) {
+        luaL_getmetatable(L, lerl_map_mt);
+        lua_setmetatable(L, -2);
+        return 1;
+    } else {
+        lua_newtable(L);
+        luaL_getmetatable(L, lerl_map_mt);
+        lua_setmetatable(L, -2);
+        return 1;
     }
+}
 
-    lerl_decoder* the_decoder = lua_newuserdata(L, sizeof(lerl_decoder));
-    char* data = malloc(size * sizeof(char));
+static int lerl_make_tuple(lua_State* L) {
+    if (lua_isnoneornil(L, 1))
+        lua_newtable(L);
+    else
+        luaL_checktype(L, 1, LUA_TTABLE);
+    luaL_getmetatable(L, lerl_tuple_mt);
+    lua_setmetatable(L, -2);
+    return 1;
+}
 
-    if (data == NULL)
-        return luaL_error(L, "lerl_decoder.new: Failed to allocate buffer!");
+const luaL_Reg decoder_metamethods[] = {
+    {"__gc", lerl_decoder_gc},
+    {NULL, NULL}
+};
 
-    memcpy(data, buf, size);
-    lua_remove(L, 1);
+const luaL_Reg decoder_methods[] = {
+    {"unpack", lerl_unpack_fun},
+    {"unpack_all", lerl_unpack_all},
+    {"reset", lerl_reset_decoder},
+    {"feed", lerl_feed_decoder},
+    {"configure", lerl_configure},
+    {"frames", lerl_frames},
+    {"read8", lerl_read8},
+    {"read16", lerl_read16},
+    {"read32", lerl_read32},
+    {"read64", lerl_read64},
+    {NULL, NULL}
+};
 
-    the_decoder->data = data;
-    the_decoder->size = size;
-    the_decoder->offset = 0;
-    the_decoder->empty_ref = empty_ref;
-    the_decoder->invalid = 0;
+/* ETF to JSON, written straight from the bytes into a reusable buffer. */
 
-    luaL_getmetatable(L, lerl_decoder_type);
-    lua_setmetatable(L, -2);
-    int ver = lerl_read8_out(L);
-    if(ver != FORMAT_VERSION)
-        return luaL_error(L, "lerl_decoder.new: Version mismatch!");
+#define JSON_MAX_SAFE_INTEGER 9007199254740991ULL
+#define JSON_MAX_BIG_BYTES 1024
+
+typedef struct {
+    lua_State* L;
+    lerl_cursor c;
+    erlpack_buffer* out;
+    bool proplists;
+    bool strings;
+    bool big_strings;
+    lerl_utf8_mode utf8;
+    size_t max_inflated;
+} lerl_json_state;
+
+static void lerl_json_write(lerl_json_state* js, const char* bytes, size_t len) {
+    if (erlpack_buffer_write(js->out, bytes, len) != 0)
+        luaL_error(js->L, "lerl.to_json: Failed to grow output buffer.");
+}
+
+#define lerl_json_literal(js, s) lerl_json_write((js), "" s, sizeof(s) - 1)
+
+static void lerl_json_need(lerl_json_state* js, bool ok) {
+    if (!ok)
+        luaL_error(js->L, "lerl.to_json: Malformed term at offset %d.", (int)js->c.offset);
+}
+
+static void lerl_json_string(lerl_json_state* js, const uint8_t* str, size_t len) {
+    static const char hex[] = "0123456789abcdef";
+    int classes = js->utf8 == LERL_UTF8_OFF ? LERL_TEXT_JSON : LERL_TEXT_JSON | LERL_TEXT_HIGH;
+    lerl_json_literal(js, "\"");
+    size_t start = 0, i = 0;
+    while ((i += lerl_text_scan(str + i, len - i, classes)) < len) {
+        uint8_t ch = str[i];
+        if (ch >= 0x80) {
+            size_t n = lerl_utf8_sequence(str + i, len - i);
+            if (n == 0 && js->utf8 == LERL_UTF8_REJECT)
+                luaL_error(js->L, "lerl.to_json: String is not valid UTF-8.");
+            if (n == 0) {
+                lerl_json_write(js, (const char*)str + start, i - start);
+                lerl_json_literal(js, "\\ufffd");
+                start = ++i;
+                continue;
+            }
+            i += n;
+            continue;
+        }
+
+        lerl_json_write(js, (const char*)str + start, i - start);
+        start = ++i;
+        switch (ch) {
+            case '"': lerl_json_literal(js, "\\\""); break;
+            case '\\': lerl_json_literal(js, "\\\\"); break;
+            case '\n': lerl_json_literal(js, "\\n"); break;
+            case '\r': lerl_json_literal(js, "\\r"); break;
+            case '\t': lerl_json_literal(js, "\\t"); break;
+            case '\b': lerl_json_literal(js, "\\b"); break;
+            case '\f': lerl_json_literal(js, "\\f"); break;
+            default: {
+                char escape[6] = {'\\', 'u', '0', '0', hex[ch >> 4], hex[ch & 0xF]};
+                lerl_json_write(js, escape, 6);
+            }
+        }
+    }
+    lerl_json_write(js, (const char*)str + start, len - start);
+    lerl_json_literal(js, "\"");
+}
+
+static void lerl_json_integer(lerl_json_state* js, int64_t value, bool quoted) {
+    char buf[24];
+    int len = snprintf(buf, sizeof(buf), quoted ? "\"%" PRId64 "\"" : "%" PRId64, value);
+    lerl_json_write(js, buf, len);
+}
+
+/* Big integers that don't fit a double exactly are written as strings. Digits are
+   little-endian base 256 and are converted with schoolbook division into base 1e9. */
+static void lerl_json_big(lerl_json_state* js, const uint8_t* digits, size_t n, bool negative, bool as_key) {
+    char buf[32];
+    if (n <= 8) {
+        uint64_t value = 0;
+        for (size_t i = n; i-- > 0;) {
+            value = (value << 8) | digits[i];
+        }
+        bool quoted = as_key || js->big_strings || value > JSON_MAX_SAFE_INTEGER;
+        int len = snprintf(buf, sizeof(buf), "%s%s%" PRIu64 "%s",
+            quoted ? "\"" : "", negative && value != 0 ? "-" : "", value, quoted ? "\"" : "");
+        lerl_json_write(js, buf, len);
+        return;
+    }
+
+    if (n > JSON_MAX_BIG_BYTES)
+        luaL_error(js->L, "lerl.to_json: Big integer is too large.");
+
+    uint32_t limbs[JSON_MAX_BIG_BYTES * 8 / 29 + 2];
+    size_t count = 0;
+    for (size_t i = n; i-- > 0;) {
+        uint64_t carry = digits[i];
+        for (size_t j = 0; j < count; j++) {
+            uint64_t v = (uint64_t)limbs[j] * 256 + carry;
+            limbs[j] = (uint32_t)(v % 1000000000);
+            carry = v / 1000000000;
+        }
+        while (carry != 0) {
+            limbs[count++] = (uint32_t)(carry % 1000000000);
+            carry = carry / 1000000000;
+        }
+    }
+
+    lerl_json_literal(js, "\"");
+    if (negative)
+        lerl_json_literal(js, "-");
+    if (count == 0)
+        lerl_json_literal(js, "0");
+    for (size_t j = count; j-- > 0;) {
+        int len = snprintf(buf, sizeof(buf), j == count - 1 ? "%" PRIu32 : "%09" PRIu32, limbs[j]);
+        lerl_json_write(js, buf, len);
+    }
+    lerl_json_literal(js, "\"");
+}
+
+static void lerl_json_double(lerl_json_state* js, double value, bool as_key) {
+    if (value != value || value - value != 0) {
+        // NaN and infinities have no JSON form.
+        lerl_json_literal(js, "null");
+        return;
+    }
+    char buf[40];
+    int len = snprintf(buf, sizeof(buf), as_key ? "\"%.17g\"" : "%.17g", value);
+    lerl_json_write(js, buf, len);
+}
+
+static void lerl_json_atom(lerl_json_state* js, const uint8_t* atom, size_t len, bool as_key) {
+    if (!as_key) {
+        if ((len == 3 && memcmp(atom, "nil", 3) == 0) || (len == 4 && memcmp(atom, "null", 4) == 0)) {
+            lerl_json_literal(js, "null");
+            return;
+        } else if (len == 4 && memcmp(atom, "true", 4) == 0) {
+            lerl_json_literal(js, "true");
+            return;
+        } else if (len == 5 && memcmp(atom, "false", 5) == 0) {
+            lerl_json_literal(js, "false");
+            return;
+        }
+    }
+    lerl_json_string(js, atom, len);
+}
+
+/* A proplist is a proper list whose elements are all {Key, Value} with an atom or
+   binary key. */
+static void lerl_json_term(lerl_json_state* js, int depth, bool as_key);
+
+static void lerl_json_sequence(lerl_json_state* js, uint32_t length, int depth) {
+    lerl_json_literal(js, "[");
+    for (uint32_t i = 0; i < length; i++) {
+        if (i > 0)
+            lerl_json_literal(js, ",");
+        lerl_json_term(js, depth - 1, false);
+    }
+    lerl_json_literal(js, "]");
+}
+
+static void lerl_json_pairs(lerl_json_state* js, uint32_t length, int depth, bool tuples) {
+    lerl_json_literal(js, "{");
+    for (uint32_t i = 0; i < length; i++) {
+        if (i > 0)
+            lerl_json_literal(js, ",");
+        if (tuples)
+            js->c.offset += 2; // Checked by lerl_is_proplist.
+        lerl_json_term(js, depth - 1, true);
+        lerl_json_literal(js, ":");
+        lerl_json_term(js, depth - 1, false);
+    }
+    lerl_json_literal(js, "}");
+}
+
+static void lerl_json_compressed(lerl_json_state* js, int depth, bool as_key) {
+    uint32_t uncompressed_size;
+    lerl_json_need(js, lerl_cursor_read32(&js->c, &uncompressed_size));
+    if (uncompressed_size > js->max_inflated || !lerl_plausible_inflated_size(js->c.size - js->c.offset, uncompressed_size))
+        luaL_error(js->L, "lerl.to_json: Compressed term inflates past the limit.");
+
+    // Held by Lua so it is released even if transcoding raises an error.
+    uint8_t* inflated = lua_newuserdatauv(js->L, uncompressed_size, 0);
+    size_t used = lerl_inflate(js->c.data + js->c.offset, js->c.size - js->c.offset, inflated, uncompressed_size);
+    if (used == 0)
+        luaL_error(js->L, "lerl.to_json: Failed to uncompress compressed item.");
+
+    lerl_cursor outer = js->c;
+    outer.offset += used;
+    js->c.data = inflated;
+    js->c.size = uncompressed_size;
+    js->c.offset = 0;
+    lerl_json_term(js, depth - 1, as_key);
+
+    js->c = outer;
+    lua_pop(js->L, 1);
+}
+
+static void lerl_json_term(lerl_json_state* js, int depth, bool as_key) {
+    lerl_cursor* c = &js->c;
+    uint8_t type = 0, len8 = 0;
+    uint16_t len16 = 0;
+    uint32_t len32 = 0;
+
+    if (depth <= 0)
+        luaL_error(js->L, "lerl.to_json: Maximum depth reached!");
+
+    lerl_json_need(js, lerl_cursor_read8(c, &type));
+    const uint8_t* at = c->data + c->offset;
+
+    switch (type) {
+        case SMALL_INTEGER_EXT:
+            lerl_json_need(js, lerl_cursor_advance(c, 1));
+            lerl_json_integer(js, at[0], as_key);
+            return;
+        case INTEGER_EXT:
+            lerl_json_need(js, lerl_cursor_read32(c, &len32));
+            lerl_json_integer(js, (int32_t)len32, as_key);
+            return;
+        case NEW_FLOAT_EXT: {
+            lerl_json_need(js, lerl_cursor_advance(c, 8));
+            union { uint64_t ui64; double df; } val = {0};
+            for (int i = 0; i < 8; i++) {
+                val.ui64 = (val.ui64 << 8) | at[i];
+            }
+            lerl_json_double(js, val.df, as_key);
+            return;
+        }
+        case FLOAT_EXT: {
+            lerl_json_need(js, lerl_cursor_advance(c, FLOAT_EXT_SIZE));
+            double value = 0;
+            lerl_json_need(js, lerl_parse_float_ext((const char*)at, &value));
+            lerl_json_double(js, value, as_key);
+            return;
+        }
+        case ATOM_EXT:
+        case ATOM_UTF8_EXT:
+            lerl_json_need(js, lerl_cursor_read16(c, &len16) && lerl_cursor_advance(c, len16));
+            lerl_json_atom(js, at + 2, len16, as_key);
+            return;
+        case SMALL_ATOM_EXT:
+        case SMALL_ATOM_UTF8_EXT:
+            lerl_json_need(js, lerl_cursor_read8(c, &len8) && lerl_cursor_advance(c, len8));
+            lerl_json_atom(js, at + 1, len8, as_key);
+            return;
+        case BINARY_EXT:
+            lerl_json_need(js, lerl_cursor_read32(c, &len32) && lerl_cursor_advance(c, len32));
+            lerl_json_string(js, at + 4, len32);
+            return;
+        case SMALL_BIG_EXT:
+            lerl_json_need(js, lerl_cursor_read8(c, &len8) && lerl_cursor_advance(c, (size_t)len8 + 1));
+            lerl_json_big(js, at + 2, len8, at[1] != 0, as_key);
+            return;
+        case LARGE_BIG_EXT:
+            lerl_json_need(js, lerl_cursor_read32(c, &len32) && lerl_cursor_advance(c, (size_t)len32 + 1));
+            lerl_json_big(js, at + 5, len32, at[4] != 0, as_key);
+            return;
+        case COMPRESSED:
+            lerl_json_compressed(js, depth, as_key);
+            return;
+    }
+
+    if (as_key)
+        luaL_error(js->L, "lerl.to_json: Unsupported object key type (%d).", type);
+
+    switch (type) {
+        case STRING_EXT:
+            lerl_json_need(js, lerl_cursor_read16(c, &len16) && lerl_cursor_advance(c, len16));
+            if (js->strings) {
+                lerl_json_string(js, at + 2, len16);
+            } else {
+                lerl_json_literal(js, "[");
+                for (uint16_t i = 0; i < len16; i++) {
+                    if (i > 0)
+                        lerl_json_literal(js, ",");
+                    lerl_json_integer(js, at[2 + i], false);
+                }
+                lerl_json_literal(js, "]");
+            }
+            return;
+        case NIL_EXT:
+            lerl_json_literal(js, "[]");
+            return;
+        case SMALL_TUPLE_EXT:
+            lerl_json_need(js, lerl_cursor_read8(c, &len8));
+            lerl_json_sequence(js, len8, depth);
+            return;
+        case LARGE_TUPLE_EXT:
+            lerl_json_need(js, lerl_cursor_read32(c, &len32));
+            lerl_json_sequence(js, len32, depth);
+            return;
+        case LIST_EXT: {
+            lerl_json_need(js, lerl_cursor_read32(c, &len32));
+            if (js->proplists && len32 > 0 && lerl_is_proplist(*c, len32))
+                lerl_json_pairs(js, len32, depth, true);
+            else
+                lerl_json_sequence(js, len32, depth);
+
+            uint8_t tail = 0;
+            lerl_json_need(js, lerl_cursor_read8(c, &tail));
+            if (tail != NIL_EXT)
+                luaL_error(js->L, "lerl.to_json: Improper lists cannot be represented in JSON.");
+            return;
+        }
+        case MAP_EXT:
+            lerl_json_need(js, lerl_cursor_read32(c, &len32));
+            lerl_json_pairs(js, len32, depth, false);
+            return;
+        default:
+            luaL_error(js->L, "lerl.to_json: Terms of type %d cannot be represented in JSON.", type);
+    }
+}
+
+/* lerl.to_json(bytes [, opts]) transcodes one term. Options:
+   proplists: write [{Key, Value}, ...] lists as objects.
+   strings: write STRING_EXT as a JSON string instead of an array of bytes.
+   big_strings: always write big integers as strings, not only when a double
+                cannot hold them exactly.
+   max_inflated: the most bytes a compressed term may inflate to.
+   utf8: invalid UTF-8 in binaries is written as \ufffd, "reject" raises an error
+         instead and "raw" copies the bytes through, which is not valid JSON. */
+static int lerl_to_json(lua_State* L) {
+    size_t size;
+    const char* bytes = luaL_checklstring(L, 1, &size);
+
+    lerl_json_state js;
+    js.L = L;
+    lerl_cursor_init(&js.c, bytes, size, NULL);
+    js.proplists = lerl_opt_boolean(L, 2, "proplists", false);
+    js.strings = lerl_opt_boolean(L, 2, "strings", false);
+    js.big_strings = lerl_opt_boolean(L, 2, "big_strings", false);
+    js.utf8 = lerl_opt_utf8(L, 2, true, LERL_UTF8_REPLACE);
+    lua_Integer max_inflated = lerl_opt_integer(L, 2, "max_inflated", -1);
+    js.max_inflated = max_inflated >= 0 ? (size_t)max_inflated : SIZE_MAX;
+
+    uint8_t version;
+    if (!lerl_cursor_read8(&js.c, &version) || version != FORMAT_VERSION)
+        return luaL_error(L, "lerl.to_json: Version mismatch!");
 
+    lua_settop(L, 1);
+    lua_getfield(L, LUA_REGISTRYINDEX, "lerl_json_encoder");
+    lerl_encoder* e = lerl_get_encoder(L, -1);
+    e->pk.length = 0;
+    js.out = &e->pk;
+
+    lerl_json_term(&js, DEFAULT_RECURSE_LIMIT, false);
+
+    lua_pushlstring(L, e->pk.buf, e->pk.length);
+    e->pk.length = 0;
     return 1;
 }
 
-static int lerl_empty_decoder(lua_State* L) {
+/* JSON to ETF, parsed straight into a buffer. Container counts and binary lengths
+   are patched in once they are known. */
 
-    int empty_ref;
-    if (lua_gettop(L) >= 1 && !lua_isnoneornil(L, 1)) {
-        lua_settop(L, 1);
-        lua_pushvalue(L, 1);
-        empty_ref = luaL_ref(L, LUA_REGISTRYINDEX);
-    } else {
-        lua_getfield(L, LUA_REGISTRYINDEX, "lerl_empty");
-        empty_ref = lua_tointeger(L, -1);
-        lua_pop(L, 1);
+typedef struct {
+    const char* name;
+    size_t len;
+} lerl_atom_name;
+
+typedef struct {
+    lua_State* L;
+    const char* s;
+    size_t size;
+    size_t pos;
+    erlpack_buffer* out;
+    lerl_atom_name null_atom;
+    lerl_atom_name true_atom;
+    lerl_atom_name false_atom;
+    bool integers;
+    bool snowflakes;
+} lerl_json_reader;
+
+static void lerl_from_json_fail(lerl_json_reader* jr, const char* what) {
+    luaL_error(jr->L, "lerl.from_json: %s at offset %d.", what, (int)jr->pos);
+}
+
+static void lerl_from_json_write(lerl_json_reader* jr, const void* bytes, size_t len) {
+    if (erlpack_buffer_write(jr->out, bytes, len) != 0)
+        luaL_error(jr->L, "lerl.from_json: Failed to grow output buffer.");
+}
+
+static void lerl_from_json_check(lerl_json_reader* jr, int ret) {
+    if (ret != 0)
+        luaL_error(jr->L, "lerl.from_json: Failed to grow output buffer.");
+}
+
+static void lerl_from_json_patch32(lerl_json_reader* jr, size_t at, uint32_t value) {
+    _erlpack_store32(jr->out->buf + at, value);
+}
+
+static void lerl_from_json_ws(lerl_json_reader* jr) {
+    while (jr->pos < jr->size) {
+        char ch = jr->s[jr->pos];
+        if (ch != ' ' && ch != '\t' && ch != '\n' && ch != '\r')
+            break;
+        jr->pos++;
     }
+}
 
-    lerl_decoder* the_decoder = lua_newuserdata(L, sizeof(lerl_decoder));
-    the_decoder->data = NULL;
-    the_decoder->size = 0;
-    the_decoder->offset = 0;
-    the_decoder->empty_ref = empty_ref;
-    the_decoder->invalid = true;
+static void lerl_from_json_expect(lerl_json_reader* jr, char ch, const char* what) {
+    lerl_from_json_ws(jr);
+    if (jr->pos >= jr->size || jr->s[jr->pos] != ch)
+        lerl_from_json_fail(jr, what);
+    jr->pos++;
+}
 
-    luaL_getmetatable(L, lerl_decoder_type);
-    lua_setmetatable(L, -2);
+static void lerl_from_json_integer(lerl_json_reader* jr, int64_t value) {
+    if (0 <= value && value <= 255)
+        lerl_from_json_check(jr, erlpack_append_small_integer(jr->out, (unsigned char)value));
+    else if (INT32_MIN <= value && value <= INT32_MAX)
+        lerl_from_json_check(jr, erlpack_append_integer(jr->out, (int32_t)value));
+    else
+        lerl_from_json_check(jr, erlpack_append_long_long(jr->out, value));
+}
+
+static uint32_t lerl_from_json_hex4(lerl_json_reader* jr) {
+    if (jr->pos + 4 > jr->size)
+        lerl_from_json_fail(jr, "Truncated unicode escape");
+    uint32_t cp = 0;
+    for (int i = 0; i < 4; i++) {
+        char ch = jr->s[jr->pos++];
+        cp <<= 4;
+        if (ch >= '0' && ch <= '9')
+            cp |= (uint32_t)(ch - '0');
+        else if (ch >= 'a' && ch <= 'f')
+            cp |= (uint32_t)(ch - 'a' + 10);
+        else if (ch >= 'A' && ch <= 'F')
+            cp |= (uint32_t)(ch - 'A' + 10);
+        else
+            lerl_from_json_fail(jr, "Invalid unicode escape");
+    }
+    return cp;
+}
+
+static void lerl_from_json_utf8(lerl_json_reader* jr, uint32_t cp) {
+    char out[4];
+    size_t n;
+    if (cp < 0x80) {
+        out[0] = (char)cp;
+        n = 1;
+    } else if (cp < 0x800) {
+        out[0] = (char)(0xC0 | (cp >> 6));
+        out[1] = (char)(0x80 | (cp & 0x3F));
+        n = 2;
+    } else if (cp < 0x10000) {
+        out[0] = (char)(0xE0 | (cp >> 12));
+        out[1] = (char)(0x80 | ((cp >> 6) & 0x3F));
+        out[2] = (char)(0x80 | (cp & 0x3F));
+        n = 3;
+    } else {
+        out[0] = (char)(0xF0 | (cp >> 18));
+        out[1] = (char)(0x80 | ((cp >> 12) & 0x3F));
+        out[2] = (char)(0x80 | ((cp >> 6) & 0x3F));
+        out[3] = (char)(0x80 | (cp & 0x3F));
+        n = 4;
+    }
+    lerl_from_json_write(jr, out, n);
+}
 
+/* A snowflake is a string of 15 to 20 digits, without a leading zero, that fits
+   in 64 bits. */
+static bool lerl_from_json_snowflake(const char* str, size_t len, uint64_t* value) {
+    if (len < 15 || len > 20 || str[0] == '0')
+        return false;
+    uint64_t v = 0;
+    for (size_t i = 0; i < len; i++) {
+        if (str[i] < '0' || str[i] > '9')
+            return false;
+        uint64_t digit = (uint64_t)(str[i] - '0');
+        if (v > (UINT64_MAX - digit) / 10)
+            return false;
+        v = v * 10 + digit;
+    }
+    *value = v;
     return true;
 }
 
-static int lerl_reset_decoder(lua_State* L) {
-    lerl_decoder* the_decoder = lerl_get_decoder(L, 1);
-    size_t size;
-    const char* buf = luaL_checklstring(L, 2, &size);
+/* Writes the string at the cursor as a BINARY_EXT, or as an integer when it is a
+   snowflake value and snowflakes are enabled. */
+static void lerl_from_json_string(lerl_json_reader* jr, bool is_key) {
+    jr->pos++; // Opening quote.
+    size_t header = jr->out->length;
+    lerl_from_json_write(jr, "m\0\0\0\0", 5);
+
+    const char* s = jr->s;
+    for (;;) {
+        size_t run = jr->pos;
+        jr->pos += lerl_text_scan((const uint8_t*)s + run, jr->size - run, LERL_TEXT_JSON);
+        lerl_from_json_write(jr, s + run, jr->pos - run);
+
+        if (jr->pos >= jr->size)
+            lerl_from_json_fail(jr, "Unterminated string");
+
+        char ch = s[jr->pos++];
+        if (ch == '"')
+            break;
+        if (ch != '\\') {
+            jr->pos--;
+            lerl_from_json_fail(jr, "Control character in string");
+        }
+        if (jr->pos >= jr->size)
+            lerl_from_json_fail(jr, "Unterminated string");
+
+        char esc = s[jr->pos++];
+        char plain;
+        switch (esc) {
+            case '"': plain = '"'; break;
+            case '\\': plain = '\\'; break;
+            case '/': plain = '/'; break;
+            case 'b': plain = '\b'; break;
+            case 'f': plain = '\f'; break;
+            case 'n': plain = '\n'; break;
+            case 'r': plain = '\r'; break;
+            case 't': plain = '\t'; break;
+            case 'u': {
+                uint32_t cp = lerl_from_json_hex4(jr);
+                if (cp >= 0xD800 && cp <= 0xDBFF) {
+                    if (jr->pos + 2 > jr->size || s[jr->pos] != '\\' || s[jr->pos + 1] != 'u')
+                        lerl_from_json_fail(jr, "Unpaired surrogate");
+                    jr->pos += 2;
+                    uint32_t low = lerl_from_json_hex4(jr);
+                    if (low < 0xDC00 || low > 0xDFFF)
+                        lerl_from_json_fail(jr, "Unpaired surrogate");
+                    cp = 0x10000 + ((cp - 0xD800) << 10) + (low - 0xDC00);
+                } else if (cp >= 0xDC00 && cp <= 0xDFFF) {
+                    lerl_from_json_fail(jr, "Unpaired surrogate");
+                }
+                lerl_from_json_utf8(jr, cp);
+                continue;
+            }
+            default:
+                jr->pos--;
+                lerl_from_json_fail(jr, "Invalid escape");
+                return;
+        }
+        lerl_from_json_write(jr, &plain, 1);
+    }
+
+    size_t len = jr->out->length - header - 5;
+    if (len > UINT32_MAX)
+        lerl_from_json_fail(jr, "String too long");
+
+    uint64_t snowflake;
+    if (!is_key && jr->snowflakes && lerl_from_json_snowflake(jr->out->buf + header + 5, len, &snowflake)) {
+        jr->out->length = header;
+        if (snowflake <= INT64_MAX)
+            lerl_from_json_integer(jr, (int64_t)snowflake);
+        else
+            lerl_from_json_check(jr, erlpack_append_unsigned_long_long(jr->out, snowflake));
+        return;
+    }
+    lerl_from_json_patch32(jr, header + 1, (uint32_t)len);
+}
+
+static void lerl_from_json_number(lerl_json_reader* jr) {
+    const char* s = jr->s;
+    size_t start = jr->pos;
+    bool negative = s[jr->pos] == '-';
+    if (negative)
+        jr->pos++;
+
+#define lerl_json_digit(at) ((at) < jr->size && s[at] >= '0' && s[at] <= '9')
+    if (!lerl_json_digit(jr->pos))
+        lerl_from_json_fail(jr, "Invalid number");
+    if (s[jr->pos] == '0') {
+        jr->pos++;
+    } else {
+        while (lerl_json_digit(jr->pos))
+            jr->pos++;
+    }
+    size_t digits_end = jr->pos;
+
+    bool integral = true;
+    if (jr->pos < jr->size && s[jr->pos] == '.') {
+        jr->pos++;
+        if (!lerl_json_digit(jr->pos))
+            lerl_from_json_fail(jr, "Invalid number");
+        while (lerl_json_digit(jr->pos))
+            jr->pos++;
+        integral = false;
+    }
+    if (jr->pos < jr->size && (s[jr->pos] == 'e' || s[jr->pos] == 'E')) {
+        jr->pos++;
+        if (jr->pos < jr->size && (s[jr->pos] == '+' || s[jr->pos] == '-'))
+            jr->pos++;
+        if (!lerl_json_digit(jr->pos))
+            lerl_from_json_fail(jr, "Invalid number");
+        while (lerl_json_digit(jr->pos))
+            jr->pos++;
+        integral = false;
+    }
+#undef lerl_json_digit
+
+    if (integral && jr->integers) {
+        uint64_t magnitude = 0;
+        bool fits = true;
+        for (size_t i = start + negative; i < digits_end; i++) {
+            uint64_t digit = (uint64_t)(s[i] - '0');
+            if (magnitude > (UINT64_MAX - digit) / 10) {
+                fits = false;
+                break;
+            }
+            magnitude = magnitude * 10 + digit;
+        }
+        if (fits && magnitude <= INT64_MAX) {
+            lerl_from_json_integer(jr, negative ? -(int64_t)magnitude : (int64_t)magnitude);
+            return;
+        }
+        if (fits && !negative) {
+            lerl_from_json_check(jr, erlpack_append_unsigned_long_long(jr->out, magnitude));
+            return;
+        }
+    }
+
+    // Lua strings are NUL terminated, so strtod stops at the end of the input.
+    lerl_from_json_check(jr, erlpack_append_double(jr->out, strtod(s + start, NULL)));
+}
+
+static void lerl_from_json_literal(lerl_json_reader* jr, const char* text, size_t len, const lerl_atom_name* atom) {
+    if (jr->pos + len > jr->size || memcmp(jr->s + jr->pos, text, len) != 0)
+        lerl_from_json_fail(jr, "Unexpected character");
+    jr->pos += len;
+    lerl_from_json_check(jr, erlpack_append_atom(jr->out, atom->name, atom->len));
+}
+
+static void lerl_from_json_value(lerl_json_reader* jr, int depth);
+
+/* The pairs of an object as offsets into the output, so a repeated key can drop
+   the pair before it. Small objects are searched in place, bigger ones index
+   their keys in a table. Both live on the Lua stack once they outgrow local. */
+
+#define JSON_LOCAL_PAIRS 16
+
+typedef struct {
+    size_t key;
+    size_t value; // Where the key ends.
+    bool dead; // Replaced by a later pair with the same key.
+} lerl_json_pair;
+
+typedef struct {
+    lerl_json_pair local[JSON_LOCAL_PAIRS];
+    lerl_json_pair* pairs;
+    uint32_t count;
+    uint32_t capacity;
+    uint32_t dead;
+    uint64_t seen; // Bit per key length and bytes, so most new keys skip the search.
+    int pairs_at;
+    int index_at;
+} lerl_json_keys;
+
+/* Returns the live pair with the key at [key, value) in the output, or -1. */
+static int64_t lerl_from_json_find_key(lerl_json_reader* jr, lerl_json_keys* p, size_t key, size_t value) {
+    const char* buf = jr->out->buf;
+    size_t len = value - key;
+    if (p->index_at == 0) {
+        char last = buf[value - 1];
+        uint64_t bit = 1ULL << ((len * 7 + (uint8_t)last * 13 + (uint8_t)buf[key + len / 2]) & 63);
+        bool seen = (p->seen & bit) != 0;
+        p->seen |= bit;
+        if (!seen)
+            return -1;
+        for (uint32_t i = 0; i < p->count; i++) {
+            lerl_json_pair* pair = &p->pairs[i];
+            if (pair->value - pair->key == len && buf[pair->value - 1] == last && !pair->dead
+                    && memcmp(buf + pair->key, buf + key, len) == 0)
+                return i;
+        }
+        return -1;
+    }
+
+    lua_State* L = jr->L;
+    lua_pushlstring(L, buf + key, len);
+    lua_pushvalue(L, -1);
+    int64_t found = lua_rawget(L, p->index_at) == LUA_TNIL ? -1 : lua_tointeger(L, -1);
+    lua_pop(L, 1);
+    lua_pushinteger(L, p->count);
+    lua_rawset(L, p->index_at);
+    return found;
+}
+
+static void lerl_from_json_add_pair(lerl_json_reader* jr, lerl_json_keys* p, size_t key, size_t value) {
+    lua_State* L = jr->L;
+    if (p->count == p->capacity) {
+        luaL_checkstack(L, 4, "lerl.from_json: Document is nested too deeply.");
+        uint32_t capacity = p->capacity * 2;
+        lerl_json_pair* pairs = lua_newuserdatauv(L, capacity * sizeof(lerl_json_pair), 0);
+        memcpy(pairs, p->pairs, p->count * sizeof(lerl_json_pair));
+        if (p->pairs_at != 0)
+            lua_replace(L, p->pairs_at);
+        else
+            p->pairs_at = lua_gettop(L);
+        p->pairs = pairs;
+        p->capacity = capacity;
+
+        if (p->index_at == 0) {
+            lua_createtable(L, 0, capacity);
+            p->index_at = lua_gettop(L);
+            for (uint32_t i = 0; i < p->count; i++) {
+                if (p->pairs[i].dead)
+                    continue;
+                lua_pushlstring(L, jr->out->buf + p->pairs[i].key, p->pairs[i].value - p->pairs[i].key);
+                lua_pushinteger(L, i);
+                lua_rawset(L, p->index_at);
+            }
+        }
+    }
+
+    int64_t found = lerl_from_json_find_key(jr, p, key, value);
+    if (found >= 0) {
+        p->pairs[found].dead = true;
+        p->dead++;
+    }
+    p->pairs[p->count].key = key;
+    p->pairs[p->count].value = value;
+    p->pairs[p->count].dead = false;
+    p->count++;
+}
+
+/* Closes the gaps left by pairs whose key came again later, so the last value
+   wins as it does for a JSON.parse. */
+static void lerl_from_json_drop_dead(lerl_json_reader* jr, lerl_json_keys* p) {
+    char* buf = jr->out->buf;
+    size_t to = p->pairs[0].key;
+    for (uint32_t i = 0; i < p->count; i++) {
+        size_t start = p->pairs[i].key;
+        size_t end = i + 1 < p->count ? p->pairs[i + 1].key : jr->out->length;
+        if (!p->pairs[i].dead) {
+            memmove(buf + to, buf + start, end - start);
+            to += end - start;
+        }
+    }
+    jr->out->length = to;
+}
+
+static void lerl_from_json_object(lerl_json_reader* jr, int depth) {
+    jr->pos++;
+    size_t header = jr->out->length;
+    lerl_from_json_write(jr, "t\0\0\0\0", 5);
+
+    lerl_from_json_ws(jr);
+    if (jr->pos < jr->size && jr->s[jr->pos] == '}') {
+        jr->pos++;
+        return;
+    }
+
+    int top = lua_gettop(jr->L);
+    lerl_json_keys p;
+    p.pairs = p.local;
+    p.count = 0;
+    p.capacity = JSON_LOCAL_PAIRS;
+    p.dead = 0;
+    p.seen = 0;
+    p.pairs_at = 0;
+    p.index_at = 0;
+
+    for (;;) {
+        lerl_from_json_ws(jr);
+        if (jr->pos >= jr->size || jr->s[jr->pos] != '"')
+            lerl_from_json_fail(jr, "Expected a key");
+        size_t key = jr->out->length;
+        lerl_from_json_string(jr, true);
+        if (p.count == UINT32_MAX - 1)
+            lerl_from_json_fail(jr, "Object too large");
+        lerl_from_json_add_pair(jr, &p, key, jr->out->length);
+        lerl_from_json_expect(jr, ':', "Expected ':'");
+        lerl_from_json_value(jr, depth - 1);
+
+        lerl_from_json_ws(jr);
+        if (jr->pos < jr->size && jr->s[jr->pos] == ',') {
+            jr->pos++;
+            continue;
+        }
+        lerl_from_json_expect(jr, '}', "Expected ',' or '}'");
+        break;
+    }
+
+    if (p.dead > 0)
+        lerl_from_json_drop_dead(jr, &p);
+    lerl_from_json_patch32(jr, header + 1, p.count - p.dead);
+    lua_settop(jr->L, top);
+}
+
+static void lerl_from_json_array(lerl_json_reader* jr, int depth) {
+    jr->pos++;
+    size_t header = jr->out->length;
+    lerl_from_json_write(jr, "l\0\0\0\0", 5);
+
+    uint32_t count = 0;
+    lerl_from_json_ws(jr);
+    if (jr->pos < jr->size && jr->s[jr->pos] == ']') {
+        jr->pos++;
+        jr->out->length = header;
+        lerl_from_json_check(jr, erlpack_append_nil_ext(jr->out));
+        return;
+    }
+
+    for (;;) {
+        lerl_from_json_value(jr, depth - 1);
+        if (++count == UINT32_MAX)
+            lerl_from_json_fail(jr, "Array too large");
+
+        lerl_from_json_ws(jr);
+        if (jr->pos < jr->size && jr->s[jr->pos] == ',') {
+            jr->pos++;
+            continue;
+        }
+        lerl_from_json_expect(jr, ']', "Expected ',' or ']'");
+        break;
+    }
+    lerl_from_json_patch32(jr, header + 1, count);
+    lerl_from_json_check(jr, erlpack_append_nil_ext(jr->out));
+}
+
+static void lerl_from_json_value(lerl_json_reader* jr, int depth) {
+    if (depth <= 0)
+        lerl_from_json_fail(jr, "Nested too deeply");
+
+    lerl_from_json_ws(jr);
+    if (jr->pos >= jr->size)
+        lerl_from_json_fail(jr, "Unexpected end of input");
+
+    switch (jr->s[jr->pos]) {
+        case '{':
+            lerl_from_json_object(jr, depth);
+            break;
+        case '[':
+            lerl_from_json_array(jr, depth);
+            break;
+        case '"':
+            lerl_from_json_string(jr, false);
+            break;
+        case 't':
+            lerl_from_json_literal(jr, "true", 4, &jr->true_atom);
+            break;
+        case 'f':
+            lerl_from_json_literal(jr, "false", 5, &jr->false_atom);
+            break;
+        case 'n':
+            lerl_from_json_literal(jr, "null", 4, &jr->null_atom);
+            break;
+        default:
+            if (jr->s[jr->pos] != '-' && (jr->s[jr->pos] < '0' || jr->s[jr->pos] > '9'))
+                lerl_from_json_fail(jr, "Unexpected character");
+            lerl_from_json_number(jr);
+            break;
+    }
+}
+
+static void lerl_opt_atom(lua_State* L, int opts_at, const char* key, const char* def, lerl_atom_name* atom) {
+    atom->name = def;
+    atom->len = strlen(def);
+    if (!lua_istable(L, opts_at))
+        return;
+    if (lua_getfield(L, opts_at, key) != LUA_TNIL) {
+        if (lua_type(L, -1) != LUA_TSTRING)
+            luaL_error(L, "lerl: Option '%s' must be a string.", key);
+        atom->name = lua_tolstring(L, -1, &atom->len);
+        if (atom->len > 255)
+            luaL_error(L, "lerl: Option '%s' is too long for an atom.", key);
+    }
+    // The options table keeps the string alive.
+    lua_pop(L, 1);
+}
+
+/* lerl.from_json(json [, options]) returns the JSON value packed as a term, or
+   appends it to options.encoder and returns that. Objects become maps with binary
+   keys, keeping the last value of a repeated key, strings binaries and arrays
+   lists. Options:
+     null, true, false: atoms to write for those literals (nil, true, false).
+     integers: write integral numbers as integers rather than floats (true).
+     snowflakes: write strings of 15 to 20 digits as integers (false). */
+static int lerl_from_json(lua_State* L) {
+    size_t size;
+    const char* json = luaL_checklstring(L, 1, &size);
+    lua_settop(L, 2);
+
+    lerl_json_reader jr;
+    jr.L = L;
+    jr.s = json;
+    jr.size = size;
+    jr.pos = 0;
+    lerl_opt_atom(L, 2, "null", "nil", &jr.null_atom);
+    lerl_opt_atom(L, 2, "true", "true", &jr.true_atom);
+    lerl_opt_atom(L, 2, "false", "false", &jr.false_atom);
+    jr.integers = lerl_opt_boolean(L, 2, "integers", true);
+    jr.snowflakes = lerl_opt_boolean(L, 2, "snowflakes", false);
+
+    lerl_encoder* target = NULL;
+    if (lua_istable(L, 2)) {
+        if (lua_getfield(L, 2, "encoder") != LUA_TNIL)
+            target = lerl_get_encoder(L, -1);
+        lua_pop(L, 1);
+    }
+
+    lua_getfield(L, LUA_REGISTRYINDEX, "lerl_json_encoder");
+    lerl_encoder* e = lerl_get_encoder(L, -1);
+    e->pk.length = 0;
+    jr.out = &e->pk;
 
-    char* data = malloc(size * sizeof(char));
-    memcpy(data, buf, size);
-    lua_pop(L, 1);
+    // Parse into scratch first so a malformed document never reaches the target.
+    lerl_from_json_check(&jr, erlpack_append_version(jr.out));
+    lerl_from_json_value(&jr, DEFAULT_RECURSE_LIMIT);
+    lerl_from_json_ws(&jr);
+    if (jr.pos != size)
+        lerl_from_json_fail(&jr, "Trailing characters");
 
-    the_decoder->data = data;
-    the_decoder->size = size;
-    the_decoder->offset = 0;
-    the_decoder->invalid = 0;
+    if (target == NULL) {
+        lua_pushlstring(L, e->pk.buf, e->pk.length);
+        e->pk.length = 0;
+        return 1;
+    }
 
-    int ver = lerl_read8_out(L);
-    if(ver != FORMAT_VERSION)
-        return luaL_error(L, "lerl_decoder.reset: Version mismatch!");
+    if (target->ret != 0)
+        return luaL_error(L, "lerl.from_json: Encoder buffer is in a bad state.");
+    if (erlpack_buffer_write(target->out, e->pk.buf + 1, e->pk.length - 1) != 0)
+        return luaL_error(L, "lerl.from_json: Failed to grow output buffer.");
+    e->pk.length = 0;
+    lerl_maybe_flush(L, target);
 
+    lua_getfield(L, 2, "encoder");
     return 1;
 }
 
-static int lerl_read8(lua_State* L) {
-    lua_pushinteger(L, lerl_read8_out(L));
-    return 1;
-}
+/* Fingerprints of encoded terms, hashed straight from the bytes in a canonical
+   form: values that decode alike hash alike whatever tags encode them, a
+   compressed term hashes as what it inflates to and map entries are combined
+   regardless of order. Words are always read little-endian, so a fingerprint is
+   the same on every machine and across releases that keep these rules. */
 
-static uint16_t lerl_read16_out(lua_State* L) {
-    lerl_decoder* the_decoder = lerl_get_decoder(L, 1);
-    int offset = the_decoder->offset;
-    char* data = the_decoder->data;
-    if (offset + sizeof(uint16_t) > the_decoder->size)
-        return luaL_error(L, "lerl_decoder.read16: Reading passes the end of the buffer.");
+#define LERL_FP_SEED_A 0x6c65726c2d667061ULL
+#define LERL_FP_SEED_B 0x6c65726c2d667062ULL
 
-    const uint16_t val = _erlpack_be16(*(const uint16_t*)(data + offset));
-    the_decoder->offset = offset + sizeof(uint16_t);
-    return val;
-}
+typedef struct {
+    uint64_t a, b;
+} lerl_fp;
 
-static int lerl_read16(lua_State* L) {
-    lua_pushinteger(L, lerl_read16_out(L));
-    return 1;
+typedef struct {
+    lua_State* L;
+    lerl_cursor c;
+    int leaf; // A path ending inside a STRING_EXT leaves the byte here, else -1.
+    size_t max_inflated;
+} lerl_fp_state;
+
+enum {
+    LERL_FP_INTEGER = 1,
+    LERL_FP_BIG,
+    LERL_FP_FLOAT,
+    LERL_FP_ATOM,
+    LERL_FP_BINARY,
+    LERL_FP_BITS,
+    LERL_FP_TUPLE,
+    LERL_FP_LIST,
+    LERL_FP_MAP,
+    LERL_FP_PAIR,
+    LERL_FP_PID,
+    LERL_FP_PORT,
+    LERL_FP_REF,
+    LERL_FP_EXPORT,
+    LERL_FP_FUN
+};
+
+#define LERL_FP_IMPROPER (1ULL << 63)
+
+static void lerl_fp_begin(lerl_fp* h, uint64_t kind) {
+    h->a = LERL_FP_SEED_A ^ lerl_mix64(kind);
+    h->b = LERL_FP_SEED_B ^ lerl_mix64(~kind);
 }
 
-static uint32_t lerl_read32_out(lua_State* L) {
-    lerl_decoder* the_decoder = lerl_get_decoder(L, 1);
-    int offset = the_decoder->offset;
-    char* data = the_decoder->data;
-    if (offset + sizeof(uint32_t) > the_decoder->size)
-        return luaL_error(L, "lerl_decoder.read32: Reading passes the end of the buffer.");
+static void lerl_fp_word(lerl_fp* h, uint64_t w) {
+    uint64_t m = lerl_mix64(w);
+    h->a = (h->a ^ m) * 0x9e3779b97f4a7c15ULL;
+    h->b = ((h->b ^ m) << 29 | (h->b ^ m) >> 35) * 0xc2b2ae3d27d4eb4fULL + w;
+}
 
-    const uint32_t val = _erlpack_be32(*(const uint32_t*)(data + offset));
-    the_decoder->offset = offset + sizeof(uint32_t);
-    return val;
+static uint64_t lerl_fp_le64(const uint8_t* p) {
+    return (uint64_t)p[0] | (uint64_t)p[1] << 8 | (uint64_t)p[2] << 16 | (uint64_t)p[3] << 24
+        | (uint64_t)p[4] << 32 | (uint64_t)p[5] << 40 | (uint64_t)p[6] << 48 | (uint64_t)p[7] << 56;
 }
 
-static int lerl_read32(lua_State* L) {
-    lua_pushinteger(L, lerl_read32_out(L));
-    return 1;
+static void lerl_fp_bytes(lerl_fp* h, const uint8_t* p, size_t len) {
+    lerl_fp_word(h, len);
+    for (; len >= 8; p += 8, len -= 8)
+        lerl_fp_word(h, lerl_fp_le64(p));
+    if (len > 0) {
+        uint64_t w = 0;
+        for (size_t i = 0; i < len; i++)
+            w |= (uint64_t)p[i] << (8 * i);
+        lerl_fp_word(h, w);
+    }
 }
 
-static uint64_t lerl_read64_out(lua_State* L) {
-    lerl_decoder* the_decoder = lerl_get_decoder(L, 1);
-    int offset = the_decoder->offset;
-    char* data = the_decoder->data;
-    if (offset + sizeof(uint64_t) > the_decoder->size)
-        return luaL_error(L, "lerl_decoder.read64: Reading passes the end of the buffer.");
+static void lerl_fp_add(lerl_fp* h, lerl_fp child) {
+    lerl_fp_word(h, child.a);
+    lerl_fp_word(h, child.b);
+}
 
-    const uint64_t val = _erlpack_be64(*(const uint64_t*)(data + offset));
-    the_decoder->offset = offset + sizeof(uint64_t);
-    return val;
+static lerl_fp lerl_fp_end(lerl_fp h) {
+    lerl_fp out = {lerl_mix64(h.a ^ h.b), lerl_mix64(h.b + h.a)};
+    return out;
 }
 
-static int lerl_read64(lua_State* L) {
-    lua_pushinteger(L, (lua_Integer)lerl_read64_out(L));
-    return 1;
+static lerl_fp lerl_fp_integer(uint64_t value) {
+    lerl_fp h;
+    lerl_fp_begin(&h, LERL_FP_INTEGER);
+    lerl_fp_word(&h, value);
+    return lerl_fp_end(h);
 }
 
-static int lerl_decodeSmallInteger(lua_State* L) {
-    lerl_read8(L);
-    return 1;
+static void lerl_fp_need(lerl_fp_state* fs, bool ok) {
+    if (!ok)
+        luaL_error(fs->L, "lerl.fingerprint: Malformed term at offset %d.", (int)fs->c.offset);
 }
 
-static int lerl_decodeInteger(lua_State* L) {
-    lerl_read32(L);
-    return 1;
+static const uint8_t* lerl_fp_take(lerl_fp_state* fs, size_t n) {
+    const uint8_t* p = fs->c.data + fs->c.offset;
+    lerl_fp_need(fs, lerl_cursor_advance(&fs->c, n));
+    return p;
 }
 
-static int lerl_decodeSequential(lua_State* L, uint32_t length) {
-    lerl_decoder* the_decoder = lerl_get_decoder(L, 1);
-    lua_createtable(L, length, 0);
-    for (lua_Integer i = 1; i <= length; i++) {
-        lerl_unpack(L);
-        if (the_decoder->invalid) {
-            return 0;
-        }
-        lua_seti(L, -2, i);
-    }
-    return 1;
+static uint32_t lerl_fp_read32(lerl_fp_state* fs) {
+    uint32_t v = 0;
+    lerl_fp_need(fs, lerl_cursor_read32(&fs->c, &v));
+    return v;
 }
 
-static int lerl_decodeList(lua_State* L) {
-    lerl_decodeSequential(L, lerl_read32_out(L));
-    luaL_getmetatable(L, lerl_array_mt);
-    lua_setmetatable(L, -2);
-    uint8_t tailMarker = lerl_read8_out(L);
-    if (tailMarker != NIL_EXT)
-        return luaL_error(L, "lerl_decoder.decodeList: List doesn't end with a tail marker.");
-    return 1;
+static uint8_t lerl_fp_read8(lerl_fp_state* fs) {
+    uint8_t v = 0;
+    lerl_fp_need(fs, lerl_cursor_read8(&fs->c, &v));
+    return v;
 }
 
-static int lerl_decodeNil(lua_State* L) {
-    lua_createtable(L, 0, 0);
-    return 1;
+/* Points the cursor at the inflated contents of the COMPRESSED term it is in,
+   leaving them on the Lua stack. Returns the offset the term ends at in the outer
+   buffer, for the caller to carry on from there. */
+static size_t lerl_fp_inflate(lerl_fp_state* fs) {
+    uint32_t size = lerl_fp_read32(fs);
+    size_t compressed = fs->c.size - fs->c.offset;
+    if (size > fs->max_inflated || !lerl_plausible_inflated_size(compressed, size))
+        luaL_error(fs->L, "lerl.fingerprint: Compressed term inflates past the limit.");
+
+    uint8_t* inflated = lua_newuserdatauv(fs->L, size, 0);
+    size_t used = lerl_inflate(fs->c.data + fs->c.offset, compressed, inflated, size);
+    if (used == 0)
+        luaL_error(fs->L, "lerl.fingerprint: Failed to uncompress compressed item.");
+    size_t end = fs->c.offset + used;
+    lerl_cursor_init(&fs->c, inflated, size, NULL);
+    return end;
 }
 
+static lerl_fp lerl_fp_term(lerl_fp_state* fs, int depth);
+
+static lerl_fp lerl_fp_big(lerl_fp_state* fs, size_t n) {
+    uint8_t sign = lerl_fp_read8(fs);
+    const uint8_t* digits = lerl_fp_take(fs, n);
+    while (n > 0 && digits[n - 1] == 0)
+        n--;
+
+    if (n <= 8) {
+        uint64_t magnitude = 0;
+        for (size_t i = 0; i < n; i++)
+            magnitude |= (uint64_t)digits[i] << (8 * i);
+        if (sign == 0 && magnitude <= INT64_MAX)
+            return lerl_fp_integer(magnitude);
+        if (sign != 0 && magnitude <= (uint64_t)INT64_MAX + 1)
+            return lerl_fp_integer(0 - magnitude);
+    }
 
-static int lerl_decodeMap(lua_State* L) {
-    lerl_decoder* the_decoder = lerl_get_decoder(L, 1);
-    int length = lerl_read32_out(L);
+    lerl_fp h;
+    lerl_fp_begin(&h, LERL_FP_BIG);
+    lerl_fp_word(&h, sign != 0);
+    lerl_fp_bytes(&h, digits, n);
+    return lerl_fp_end(h);
+}
 
-    lua_createtable(L, 0, length);
-    luaL_getmetatable(L, lerl_map_mt);
-    lua_setmetatable(L, -2);
+static lerl_fp lerl_fp_list(lerl_fp_state* fs, uint32_t length, int depth) {
+    lerl_fp h;
+    lerl_fp_begin(&h, LERL_FP_LIST);
+    for (uint32_t i = 0; i < length; i++)
+        lerl_fp_add(&h, lerl_fp_term(fs, depth - 1));
 
-    for (int i = 0; i < length; ++i) {
-        lerl_unpack(L);
-        lerl_unpack(L);
-        if (the_decoder->invalid){
-            return 0;
-        }
-        lua_settable(L, -3);
+    if (lerl_cursor_has(&fs->c, 1) && fs->c.data[fs->c.offset] == NIL_EXT) {
+        fs->c.offset++;
+        lerl_fp_word(&h, length);
+    } else {
+        lerl_fp_add(&h, lerl_fp_term(fs, depth - 1));
+        lerl_fp_word(&h, length | LERL_FP_IMPROPER);
     }
-    return 1;
+    return lerl_fp_end(h);
 }
 
-const char* lerl_readString(lua_State* L, uint32_t length) {
-    lerl_decoder* the_decoder = lerl_get_decoder(L, 1);
-    int offset = the_decoder->offset;
-    char* data = the_decoder->data;
-    if (offset + length > the_decoder->size){
-        luaL_error(L, "lerl_decoder.readString: Reading passes the end of the buffer.");
-        return NULL;
+/* Pairs are hashed on their own and summed, so any order gives the same map. */
+static lerl_fp lerl_fp_map(lerl_fp_state* fs, uint32_t length, int depth) {
+    uint64_t sum_a = 0, sum_b = 0;
+    for (uint32_t i = 0; i < length; i++) {
+        lerl_fp pair;
+        lerl_fp_begin(&pair, LERL_FP_PAIR);
+        lerl_fp_add(&pair, lerl_fp_term(fs, depth - 1));
+        lerl_fp_add(&pair, lerl_fp_term(fs, depth - 1));
+        pair = lerl_fp_end(pair);
+        sum_a += pair.a;
+        sum_b += pair.b;
     }
 
-    the_decoder->offset = offset + length;
-    return (const char*)(data + offset);
+    lerl_fp h;
+    lerl_fp_begin(&h, LERL_FP_MAP);
+    lerl_fp_word(&h, length);
+    lerl_fp_word(&h, sum_a);
+    lerl_fp_word(&h, sum_b);
+    return lerl_fp_end(h);
 }
 
-static int lerl_processAtom(lua_State* L, const char* atom, uint16_t len) {
-    lerl_decoder* the_decoder = lerl_get_decoder(L, 1);
-    if (atom == NULL){
-        return 0;
+/* Hashes the node, then the ids and creation as PIDs, ports and references are
+   decoded, so each kind hashes alike in all of its encodings. */
+static lerl_fp lerl_fp_ident(lerl_fp_state* fs, uint8_t type, int depth) {
+    lerl_fp h;
+    uint16_t count = 1;
+    if (type == NEW_REFERENCE_EXT || type == NEWER_REFERENCE_EXT)
+        lerl_fp_need(fs, lerl_cursor_read16(&fs->c, &count));
+
+    lerl_fp node = lerl_fp_term(fs, depth - 1);
+    switch (type) {
+        case PID_EXT:
+        case NEW_PID_EXT: {
+            lerl_fp_begin(&h, LERL_FP_PID);
+            lerl_fp_add(&h, node);
+            lerl_fp_word(&h, lerl_fp_read32(fs));
+            lerl_fp_word(&h, lerl_fp_read32(fs));
+            lerl_fp_word(&h, type == PID_EXT ? lerl_fp_read8(fs) : lerl_fp_read32(fs));
+            break;
+        }
+        case PORT_EXT:
+        case NEW_PORT_EXT:
+        case V4_PORT_EXT: {
+            uint64_t id = lerl_fp_read32(fs);
+            if (type == V4_PORT_EXT)
+                id = id << 32 | lerl_fp_read32(fs);
+            lerl_fp_begin(&h, LERL_FP_PORT);
+            lerl_fp_add(&h, node);
+            lerl_fp_word(&h, id);
+            lerl_fp_word(&h, type == PORT_EXT ? lerl_fp_read8(fs) : lerl_fp_read32(fs));
+            break;
+        }
+        default: {
+            // REFERENCE_EXT has its id ahead of the creation, the newer forms after.
+            uint32_t id = type == REFERENCE_EXT ? lerl_fp_read32(fs) : 0;
+            uint32_t creation = type == NEWER_REFERENCE_EXT ? lerl_fp_read32(fs) : lerl_fp_read8(fs);
+            lerl_fp_begin(&h, LERL_FP_REF);
+            lerl_fp_add(&h, node);
+            lerl_fp_word(&h, creation);
+            lerl_fp_word(&h, count);
+            if (type == REFERENCE_EXT)
+                lerl_fp_word(&h, id);
+            else
+                for (uint16_t i = 0; i < count; i++)
+                    lerl_fp_word(&h, lerl_fp_read32(fs));
+            break;
+        }
     }
+    return lerl_fp_end(h);
+}
 
-    if (len >= 3 && len <= 5) {
-        if (len == 3 && strncmp(atom, "nil", 3) == 0 ){
-            lua_pushnil(L);
-        } else if (len == 4 && strncmp(atom, "null", 4) == 0 ){
-            lua_rawgeti(L, LUA_REGISTRYINDEX, the_decoder->empty_ref);
-        } else if (len == 4 && strncmp(atom, "true", 4) == 0 ){
-            lua_pushboolean(L, 1);
-        } else if (len == 5 && strncmp(atom, "false", 5) == 0 ){
-            lua_pushboolean(L, 0);
+static lerl_fp lerl_fp_term(lerl_fp_state* fs, int depth) {
+    lerl_cursor* c = &fs->c;
+    lerl_fp h = {0, 0};
+    uint8_t type = 0, len8 = 0;
+    uint16_t len16 = 0;
+    uint32_t len32 = 0;
+
+    if (depth <= 0)
+        luaL_error(fs->L, "lerl.fingerprint: Term is nested too deeply.");
+    lerl_fp_need(fs, lerl_cursor_read8(c, &type));
+
+    switch (type) {
+        case SMALL_INTEGER_EXT:
+            return lerl_fp_integer(lerl_fp_read8(fs));
+        case INTEGER_EXT:
+            return lerl_fp_integer((uint64_t)(int64_t)(int32_t)lerl_fp_read32(fs));
+        case SMALL_BIG_EXT:
+            return lerl_fp_big(fs, lerl_fp_read8(fs));
+        case LARGE_BIG_EXT:
+            return lerl_fp_big(fs, lerl_fp_read32(fs));
+        case FLOAT_EXT:
+        case NEW_FLOAT_EXT: {
+            double value;
+            if (type == FLOAT_EXT) {
+                lerl_fp_need(fs, lerl_parse_float_ext((const char*)lerl_fp_take(fs, FLOAT_EXT_SIZE), &value));
+            } else {
+                const uint8_t* p = lerl_fp_take(fs, 8);
+                uint64_t bits = (uint64_t)lerl_load32(p) << 32 | lerl_load32(p + 4);
+                memcpy(&value, &bits, sizeof(value));
+            }
+            uint64_t bits;
+            memcpy(&bits, &value, sizeof(bits));
+            lerl_fp_begin(&h, LERL_FP_FLOAT);
+            lerl_fp_word(&h, bits);
+            return lerl_fp_end(h);
         }
-    } else
-        lua_pushlstring(L, atom, len);
-    return 1;
+        case ATOM_EXT:
+        case ATOM_UTF8_EXT:
+            lerl_fp_need(fs, lerl_cursor_read16(c, &len16));
+            lerl_fp_begin(&h, LERL_FP_ATOM);
+            lerl_fp_bytes(&h, lerl_fp_take(fs, len16), len16);
+            return lerl_fp_end(h);
+        case SMALL_ATOM_EXT:
+        case SMALL_ATOM_UTF8_EXT:
+            len8 = lerl_fp_read8(fs);
+            lerl_fp_begin(&h, LERL_FP_ATOM);
+            lerl_fp_bytes(&h, lerl_fp_take(fs, len8), len8);
+            return lerl_fp_end(h);
+        case BINARY_EXT:
+            len32 = lerl_fp_read32(fs);
+            lerl_fp_begin(&h, LERL_FP_BINARY);
+            lerl_fp_bytes(&h, lerl_fp_take(fs, len32), len32);
+            return lerl_fp_end(h);
+        case BIT_BINARY_EXT:
+            len32 = lerl_fp_read32(fs);
+            lerl_fp_begin(&h, LERL_FP_BITS);
+            lerl_fp_word(&h, lerl_fp_read8(fs));
+            lerl_fp_bytes(&h, lerl_fp_take(fs, len32), len32);
+            return lerl_fp_end(h);
+        case SMALL_TUPLE_EXT:
+        case LARGE_TUPLE_EXT:
+            len32 = type == SMALL_TUPLE_EXT ? lerl_fp_read8(fs) : lerl_fp_read32(fs);
+            lerl_fp_begin(&h, LERL_FP_TUPLE);
+            lerl_fp_word(&h, len32);
+            for (uint32_t i = 0; i < len32; i++)
+                lerl_fp_add(&h, lerl_fp_term(fs, depth - 1));
+            return lerl_fp_end(h);
+        case NIL_EXT:
+            lerl_fp_begin(&h, LERL_FP_LIST);
+            lerl_fp_word(&h, 0);
+            return lerl_fp_end(h);
+        case STRING_EXT: {
+            // Hashed as the list of small integers it stands for.
+            lerl_fp_need(fs, lerl_cursor_read16(c, &len16));
+            const uint8_t* p = lerl_fp_take(fs, len16);
+            lerl_fp_begin(&h, LERL_FP_LIST);
+            for (uint16_t i = 0; i < len16; i++)
+                lerl_fp_add(&h, lerl_fp_integer(p[i]));
+            lerl_fp_word(&h, len16);
+            return lerl_fp_end(h);
+        }
+        case LIST_EXT:
+            return lerl_fp_list(fs, lerl_fp_read32(fs), depth);
+        case MAP_EXT:
+            return lerl_fp_map(fs, lerl_fp_read32(fs), depth);
+        case PID_EXT:
+        case NEW_PID_EXT:
+        case PORT_EXT:
+        case NEW_PORT_EXT:
+        case V4_PORT_EXT:
+        case REFERENCE_EXT:
+        case NEW_REFERENCE_EXT:
+        case NEWER_REFERENCE_EXT:
+            return lerl_fp_ident(fs, type, depth);
+        case EXPORT_EXT:
+            lerl_fp_begin(&h, LERL_FP_EXPORT);
+            for (int i = 0; i < 3; i++)
+                lerl_fp_add(&h, lerl_fp_term(fs, depth - 1));
+            return lerl_fp_end(h);
+        case NEW_FUN_EXT:
+            // The size includes its own four bytes.
+            len32 = lerl_fp_read32(fs);
+            lerl_fp_need(fs, len32 >= 4);
+            lerl_fp_begin(&h, LERL_FP_FUN);
+            lerl_fp_bytes(&h, lerl_fp_take(fs, len32 - 4), len32 - 4);
+            return lerl_fp_end(h);
+        case COMPRESSED: {
+            lerl_cursor outer = fs->c;
+            outer.offset = lerl_fp_inflate(fs);
+            h = lerl_fp_term(fs, depth - 1);
+            fs->c = outer;
+            lua_pop(fs->L, 1);
+            return h;
+        }
+        default:
+            luaL_error(fs->L, "lerl.fingerprint: Unsupported erlang term type identifier found.");
+            return h;
+    }
 }
 
-static int lerl_decodeAtom(lua_State* L) {
-    uint16_t len = lerl_read16_out(L);
-    const char* atom = lerl_readString(L, len);
-    lerl_processAtom(L, atom, len);
-    return 1;
+/* Skips count terms, raising an error if they are malformed. */
+static void lerl_fp_skip(lerl_fp_state* fs, uint64_t count) {
+    for (uint64_t i = 0; i < count; i++) {
+        if (!lerl_cursor_skip(&fs->c, DEFAULT_RECURSE_LIMIT))
+            luaL_error(fs->L, "lerl.fingerprint: %s", fs->c.error != NULL ? fs->c.error : "Malformed term.");
+    }
 }
 
-static int lerl_decodeSmallAtom(lua_State* L) {
-    uint8_t len = lerl_read8_out(L);
-    const char* atom = lerl_readString(L, len);
-    lerl_processAtom(L, atom, len);
-    return 1;
+/* Moves the cursor to the term named by the path table: integers index tuples and
+   lists from 1, strings find map values by atom or binary key. Returns false if
+   nothing is there. Inflated buffers stay on the Lua stack until the call ends. */
+static bool lerl_fp_seek(lerl_fp_state* fs, int path_at) {
+    lua_Integer steps = (lua_Integer)lua_rawlen(fs->L, path_at);
+    for (lua_Integer step = 1; step <= steps; step++) {
+        uint8_t type = lerl_fp_read8(fs);
+        while (type == COMPRESSED) {
+            lerl_fp_inflate(fs);
+            type = lerl_fp_read8(fs);
+        }
+
+        lua_rawgeti(fs->L, path_at, step);
+        int isnum;
+        lua_Integer index = lua_tointegerx(fs->L, -1, &isnum);
+        size_t key_len;
+        const char* key = lua_type(fs->L, -1) == LUA_TSTRING ? lua_tolstring(fs->L, -1, &key_len) : NULL;
+        lua_pop(fs->L, 1); // The path table keeps key alive.
+        if (!isnum && key == NULL)
+            luaL_error(fs->L, "lerl.fingerprint: Path steps must be integers or strings.");
+
+        if (isnum && type == STRING_EXT) {
+            uint16_t length = 0;
+            lerl_fp_need(fs, lerl_cursor_read16(&fs->c, &length));
+            const uint8_t* p = lerl_fp_take(fs, length);
+            if (step != steps || index < 1 || index > length)
+                return false;
+            fs->leaf = p[index - 1];
+        } else if (isnum && (type == SMALL_TUPLE_EXT || type == LARGE_TUPLE_EXT || type == LIST_EXT)) {
+            uint32_t length = type == SMALL_TUPLE_EXT ? lerl_fp_read8(fs) : lerl_fp_read32(fs);
+            if (index < 1 || index > length)
+                return false;
+            lerl_fp_skip(fs, (uint64_t)index - 1);
+        } else if (key != NULL && type == MAP_EXT) {
+            uint32_t length = lerl_fp_read32(fs);
+            uint32_t i = 0;
+            for (; i < length; i++) {
+                uint8_t key_type = lerl_fp_read8(fs);
+                uint32_t len;
+                if (key_type == SMALL_ATOM_EXT || key_type == SMALL_ATOM_UTF8_EXT) {
+                    len = lerl_fp_read8(fs);
+                } else if (key_type == ATOM_EXT || key_type == ATOM_UTF8_EXT) {
+                    uint16_t len16 = 0;
+                    lerl_fp_need(fs, lerl_cursor_read16(&fs->c, &len16));
+                    len = len16;
+                } else if (key_type == BINARY_EXT) {
+                    len = lerl_fp_read32(fs);
+                } else {
+                    fs->c.offset--;
+                    lerl_fp_skip(fs, 2);
+                    continue;
+                }
+                const uint8_t* name = lerl_fp_take(fs, len);
+                if (len == key_len && memcmp(name, key, len) == 0)
+                    break;
+                lerl_fp_skip(fs, 1);
+            }
+            if (i == length)
+                return false;
+        } else {
+            return false;
+        }
+    }
+    return true;
 }
 
-static int lerl_decodeFloat(lua_State* L) {
-    const char* floatStr = lerl_readString(L, 31);
-    if (floatStr == NULL){
-        return 0;
+/* lerl.fingerprint(bytes [, path [, opts]]) returns two integers making up a
+   128-bit fingerprint of the first term in bytes, or of the term at path within
+   it, or nil if there is no such term. The first integer alone serves as a 64-bit
+   one. opts.max_inflated bounds what a compressed term may inflate to. */
+static int lerl_fingerprint(lua_State* L) {
+    size_t size;
+    const char* bytes = luaL_checklstring(L, 1, &size);
+    if (!lua_isnoneornil(L, 2))
+        luaL_checktype(L, 2, LUA_TTABLE);
+    lua_Integer max_inflated = lerl_opt_integer(L, 3, "max_inflated", -1);
+
+    lerl_fp_state fs;
+    fs.L = L;
+    fs.leaf = -1;
+    fs.max_inflated = max_inflated >= 0 ? (size_t)max_inflated : SIZE_MAX;
+    lerl_cursor_init(&fs.c, bytes, size, NULL);
+
+    uint8_t version;
+    if (!lerl_cursor_read8(&fs.c, &version) || version != FORMAT_VERSION)
+        return luaL_error(L, "lerl.fingerprint: Version mismatch!");
+
+    if (!lua_isnoneornil(L, 2) && !lerl_fp_seek(&fs, 2)) {
+        lua_pushnil(L);
+        return 1;
     }
 
-    lua_Number number;
-    char nullterminated[32] = {0};
+    lerl_fp h = fs.leaf >= 0 ? lerl_fp_integer((uint64_t)fs.leaf) : lerl_fp_term(&fs, DEFAULT_RECURSE_LIMIT);
+    lua_pushinteger(L, (lua_Integer)h.a);
+    lua_pushinteger(L, (lua_Integer)h.b);
+    return 2;
+}
 
-    memcpy(nullterminated, floatStr, 31);
+#ifdef LERL_HAS_RING
 
-    int count = sscanf(nullterminated, "%lf", &number);
+#define RING_WRAP UINT32_MAX
+#define RING_ALIGN(n) (((n) + 7) & ~(size_t)7)
 
-    if (count != 1)
-        return luaL_error(L, "lerl_decoder.decodeFloat: Invalid float encoded.");
+/* Lives at the start of the shared mapping. head is only written by the producer
+   and tail only by the consumer, each on its own cache line. */
+typedef struct {
+    size_t capacity;
+    int wake_read;
+    int wake_write;
+    atomic_int waiting;
+    char pad0[64];
+    atomic_size_t head;
+    char pad1[64];
+    atomic_size_t tail;
+    char pad2[64];
+} lerl_ring_shared;
 
-    lua_pushnumber(L, number);
-    return 1;
+typedef struct {
+    lerl_ring_shared* shared;
+    lua_Integer id;
+    bool armed;
+} lerl_ring;
+
+/* Process-wide table of live rings. Handles are ids looked up here, so a stale or
+   forged handle is refused rather than dereferenced. A forked child inherits the
+   table along with the mappings, so ids stay valid on both sides. Ids are never
+   reused. */
+typedef struct lerl_ring_entry {
+    struct lerl_ring_entry* next;
+    lerl_ring_shared* shared;
+    lua_Integer id;
+    int refs;
+} lerl_ring_entry;
+
+static pthread_mutex_t lerl_rings_lock = PTHREAD_MUTEX_INITIALIZER;
+static lerl_ring_entry* lerl_rings = NULL;
+static lua_Integer lerl_rings_next_id = 1;
+
+static lerl_ring_entry* lerl_ring_find(lua_Integer id) {
+    for (lerl_ring_entry* entry = lerl_rings; entry != NULL; entry = entry->next) {
+        if (entry->id == id)
+            return entry;
+    }
+    return NULL;
 }
 
-static int lerl_decodeNewFloat(lua_State* L) {
-    union {
-        uint64_t ui64;
-        double df;
-    } val;
+static void lerl_ring_unmap(lerl_ring_shared* shared) {
+    close(shared->wake_read);
+    if (shared->wake_write != shared->wake_read)
+        close(shared->wake_write);
+    munmap(shared, sizeof(lerl_ring_shared) + shared->capacity);
+}
 
-    val.ui64 = lerl_read64_out(L);
+static lerl_ring* lerl_get_ring(lua_State* L, int at) {
+    lerl_ring* ring = luaL_checkudata(L, at, lerl_ring_type);
+    if (ring->shared == NULL)
+        luaL_error(L, "lerl_ring: Ring has been closed.");
+    return ring;
+}
 
-    lua_pushnumber(L, val.df);
-    return 1;
+static char* lerl_ring_data(lerl_ring_shared* shared) {
+    return (char*)shared + sizeof(lerl_ring_shared);
 }
 
-static int lerl_decodeBig(lua_State* L, uint32_t digits) {
-    uint8_t sign = lerl_read8_out(L);
+/* Wraps a shared ring in a userdata carrying the encoder and borrowed decoder it
+   uses to move terms in and out of the ring. */
+static int lerl_push_ring(lua_State* L, lerl_ring_shared* shared, lua_Integer id) {
+    lerl_ring* ring = lua_newuserdatauv(L, sizeof(lerl_ring), 2);
+    ring->shared = shared;
+    ring->id = id;
+    ring->armed = false;
+    luaL_getmetatable(L, lerl_ring_type);
+    lua_setmetatable(L, -2);
 
-    if (digits > 8)
-        return luaL_error(L, "lerl_decoder.decodeBig: Unable to decode big ints larger than 8 bytes");
+    lerl_new_encoder2(L, false, INITIAL_BUFFER_SIZE);
+    lua_setiuservalue(L, -2, 1);
 
-    uint64_t value = 0;
-    uint64_t b = 1;
-    for(uint32_t i = 0; i < digits; ++i) {
-            uint64_t digit = lerl_read8_out(L);
-            value += digit * b;
-            b <<= 8;
-    }
+    lua_getfield(L, LUA_REGISTRYINDEX, "lerl_empty");
+    int empty_ref = lua_tointeger(L, -1);
+    lua_pop(L, 1);
+    lerl_push_empty_decoder(L, empty_ref);
+    lerl_get_decoder(L, -1)->data_kind = LERL_DATA_BORROWED;
+    lua_setiuservalue(L, -2, 2);
+    return 1;
+}
 
-    if (digits <= 8) {
-        if (sign == 0) {
-            lua_pushinteger(L, value);
-            return 1;
-        } else if ((value & (1ULL << 63)) == 0) {
-            lua_pushinteger(L, -(lua_Integer)value);
-            return 1;
-        }
+static int lerl_new_ring(lua_State* L) {
+    lua_Integer capacity = luaL_checkinteger(L, 1);
+    luaL_argcheck(L, capacity >= 64 && (lua_Unsigned)capacity <= UINT32_MAX, 1, "capacity out of range");
+    lua_settop(L, 0);
+
+    size_t data_size = RING_ALIGN((size_t)capacity);
+    size_t total = sizeof(lerl_ring_shared) + data_size;
+    void* mem = mmap(NULL, total, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED)
+        return luaL_error(L, "lerl.new_ring: Failed to map shared memory.");
+
+    lerl_ring_shared* shared = mem;
+    shared->capacity = data_size;
+    atomic_init(&shared->waiting, 0);
+    atomic_init(&shared->head, 0);
+    atomic_init(&shared->tail, 0);
+
+#ifdef __linux__
+    shared->wake_read = shared->wake_write = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (shared->wake_read < 0) {
+#else
+    int fds[2];
+    if (pipe(fds) == 0) {
+        fcntl(fds[0], F_SETFL, O_NONBLOCK);
+        fcntl(fds[1], F_SETFL, O_NONBLOCK);
+        shared->wake_read = fds[0];
+        shared->wake_write = fds[1];
+    } else {
+#endif
+        munmap(mem, total);
+        return luaL_error(L, "lerl.new_ring: Unable to create a wakeup descriptor.");
     }
 
-    char outBuffer[32] = {0};
-    const char* fmt = (sign == 0) ? (PRIu64) : ("-" PRIu64);
-    int res = sprintf(outBuffer, fmt, value);
-
-    if (res < 0)
-        return luaL_error(L, "lerl_decoder.decodeBig: Unable to convert big int to string.");
-
-    lua_pushlstring(L, outBuffer, res);
-    return 1;
+    lerl_ring_entry* entry = malloc(sizeof(lerl_ring_entry));
+    if (entry == NULL) {
+        lerl_ring_unmap(shared);
+        return luaL_error(L, "lerl.new_ring: Failed to allocate ring entry.");
+    }
+    entry->shared = shared;
+    entry->refs = 1;
+    pthread_mutex_lock(&lerl_rings_lock);
+    entry->id = lerl_rings_next_id++;
+    entry->next = lerl_rings;
+    lerl_rings = entry;
+    pthread_mutex_unlock(&lerl_rings_lock);
+
+    return lerl_push_ring(L, shared, entry->id);
 }
 
-static int lerl_decodeSmallBig(lua_State* L) {
-    return lerl_decodeBig(L, lerl_read8_out(L));
+/* Attaches to a live ring created elsewhere in this process (or inherited across
+   fork) from the id returned by ring:handle(). */
+static int lerl_open_ring(lua_State* L) {
+    lua_Integer id = luaL_checkinteger(L, 1);
+    pthread_mutex_lock(&lerl_rings_lock);
+    lerl_ring_entry* entry = lerl_ring_find(id);
+    lerl_ring_shared* shared = NULL;
+    if (entry != NULL) {
+        entry->refs++;
+        shared = entry->shared;
+    }
+    pthread_mutex_unlock(&lerl_rings_lock);
+    luaL_argcheck(L, shared != NULL, 1, "not a ring handle");
+    return lerl_push_ring(L, shared, id);
 }
 
-static int lerl_decodeLargeBig(lua_State* L) {
-    return lerl_decodeBig(L, lerl_read32_out(L));
+static int lerl_ring_handle(lua_State* L) {
+    lerl_ring* ring = lerl_get_ring(L, 1);
+    lua_pushinteger(L, ring->id);
+    return 1;
 }
 
-static int lerl_decodeBinary(lua_State* L) {
-    uint32_t size = lerl_read32_out(L);
-    const char* data = lerl_readString(L, size);
-    lua_pushlstring(L, data, size);
+static int lerl_ring_fd(lua_State* L) {
+    lerl_ring* ring = lerl_get_ring(L, 1);
+    lua_pushinteger(L, ring->shared->wake_read);
     return 1;
 }
 
-static int lerl_decodeString(lua_State* L) {
-    uint16_t size = lerl_read16_out(L);
-    lua_pushlstring(L, lerl_readString(L, size), size);
-    return 1;
+static void lerl_ring_drain(lerl_ring_shared* shared) {
+    uint64_t count;
+    while (read(shared->wake_read, &count, sizeof(count)) > 0);
 }
 
-static int lerl_decodeStringAsList(lua_State* L) {
-    lerl_decoder* the_decoder = lerl_get_decoder(L, 1);
-    uint16_t length = lerl_read16_out(L);
-    if (the_decoder->offset + length > the_decoder->size)
-        return luaL_error(L, "lerl_decode.decodeStringAsList: Reading sequence past the end of the buffer.");
+/* Encodes the arguments as one record. Returns false without blocking if the ring
+   does not currently have room for it. */
+static int lerl_ring_push(lua_State* L) {
+    lerl_ring* ring = lerl_get_ring(L, 1);
+    lerl_ring_shared* shared = ring->shared;
 
-    lua_createtable(L, length, 0);
+    // Stack: encoder, ring, values...
+    lua_getiuservalue(L, 1, 1);
+    lua_rotate(L, 1, 1);
+    lerl_encoder* e = lerl_get_encoder(L, 1);
+    // A push that raised partway leaves its bytes behind.
+    e->pk.length = 0;
+    e->ret = erlpack_append_version(&e->pk);
+    int slots = lua_gettop(L);
+    for (int i = 3; i <= slots; i++) {
+        lerl_pack_at(L, e, i, DEFAULT_RECURSE_LIMIT);
+    }
+
+    size_t len = e->pk.length;
+    size_t need = RING_ALIGN(sizeof(uint32_t) + len);
+    size_t capacity = shared->capacity;
+    if (need > capacity / 2) {
+        e->pk.length = 0;
+        e->ret = erlpack_append_version(&e->pk);
+        return luaL_error(L, "lerl_ring.push: Record is too large for this ring.");
+    }
 
-    for (uint16_t i = 1; i <= length; ++i) {
-        lerl_decodeSmallInteger(L);
-        lua_seti(L, -2, i);
+    size_t head = atomic_load_explicit(&shared->head, memory_order_relaxed);
+    size_t tail = atomic_load_explicit(&shared->tail, memory_order_acquire);
+    size_t pos = head % capacity;
+    size_t skip = pos + need > capacity ? capacity - pos : 0;
+
+    bool fits = (head - tail) + skip + need <= capacity;
+    if (fits) {
+        char* base = lerl_ring_data(shared);
+        if (skip > 0) {
+            uint32_t wrap = RING_WRAP;
+            memcpy(base + pos, &wrap, sizeof(wrap));
+            pos = 0;
+        }
+        uint32_t length = (uint32_t)len;
+        memcpy(base + pos, &length, sizeof(length));
+        memcpy(base + pos + sizeof(length), e->pk.buf, len);
+        atomic_store_explicit(&shared->head, head + skip + need, memory_order_release);
+
+        // Pairs with the fence in lerl_ring_next: either the consumer sees the new
+        // head on its re-check or we see it waiting.
+        atomic_thread_fence(memory_order_seq_cst);
+        if (atomic_exchange(&shared->waiting, 0)) {
+            uint64_t one = 1;
+            ssize_t written = write(shared->wake_write, &one, sizeof(one));
+            (void)written;
+        }
     }
+
+    e->pk.length = 0;
+    e->ret = erlpack_append_version(&e->pk);
+    lua_pushboolean(L, fits);
     return 1;
 }
 
-static int lerl_decodeSmallTuple(lua_State* L) {
-    return lerl_decodeSequential(L, lerl_read8_out(L));
+/* Looks for the next record, arming the wakeup descriptor when the ring is empty. */
+static bool lerl_ring_next(lerl_ring* ring, size_t* tail_out, size_t* pos_out, uint32_t* len_out) {
+    lerl_ring_shared* shared = ring->shared;
+    size_t capacity = shared->capacity;
+    char* base = lerl_ring_data(shared);
+    size_t tail = atomic_load_explicit(&shared->tail, memory_order_relaxed);
+
+    for (;;) {
+        size_t head = atomic_load_explicit(&shared->head, memory_order_acquire);
+        if (head == tail) {
+            if (ring->armed)
+                return false;
+            ring->armed = true;
+            atomic_store(&shared->waiting, 1);
+            // Keeps the head load from moving above the store, see lerl_ring_push.
+            atomic_thread_fence(memory_order_seq_cst);
+            continue; // Re-check so a push racing with arming is not missed.
+        }
+
+        size_t pos = tail % capacity;
+        uint32_t length;
+        memcpy(&length, base + pos, sizeof(length));
+        if (length == RING_WRAP) {
+            tail += capacity - pos;
+            atomic_store_explicit(&shared->tail, tail, memory_order_release);
+            continue;
+        }
+
+        *tail_out = tail;
+        *pos_out = pos;
+        *len_out = length;
+        return true;
+    }
 }
 
-static int lerl_decodeLargeTuple(lua_State* L) {
-    return lerl_decodeSequential(L, lerl_read32_out(L));
+static int lerl_ring_unpack(lua_State* L) {
+    if (lerl_read8_out(L, lerl_get_decoder(L, 1)) != FORMAT_VERSION)
+        return luaL_error(L, "lerl_ring.pop: Version mismatch!");
+    return lerl_unpack_all(L);
 }
 
-static int lerl_decodeCompressed(lua_State* L) {
-    lerl_decoder* the_decoder = lerl_get_decoder(L, 1);
-    uint32_t uncompressedSize = lerl_read32_out(L);
+/* Decodes the next record straight out of the shared memory. Returns nothing
+   when the ring is empty. A record that fails to decode is consumed before the
+   error is raised, so it cannot wedge the ring. */
+static int lerl_ring_pop(lua_State* L) {
+    lerl_ring* ring = lerl_get_ring(L, 1);
+    lerl_ring_shared* shared = ring->shared;
+    lua_settop(L, 1);
 
-    unsigned long sourceSize = uncompressedSize;
+    size_t tail, pos;
+    uint32_t length;
+    if (!lerl_ring_next(ring, &tail, &pos, &length))
+        return 0;
 
-    uint8_t* outBuffer = (uint8_t*)malloc(uncompressedSize);
+    if (ring->armed) {
+        ring->armed = false;
+        atomic_store(&shared->waiting, 0);
+        lerl_ring_drain(shared);
+    }
 
-    int ret = uncompress(outBuffer, &sourceSize, (const unsigned char*)(the_decoder->data + the_decoder->offset), (uLong)(the_decoder->size - the_decoder->offset));
+    // Stack: ring, unpack, decoder
+    lua_pushcfunction(L, lerl_ring_unpack);
+    lua_getiuservalue(L, 1, 2);
+    lerl_decoder* the_decoder = lerl_get_decoder(L, -1);
+    the_decoder->data = lerl_ring_data(shared) + pos + sizeof(uint32_t);
+    the_decoder->size = length;
+    the_decoder->offset = 0;
+    the_decoder->invalid = false;
 
-    the_decoder->offset += sourceSize;
+    int status = lua_pcall(L, 1, LUA_MULTRET, 0);
 
-    if (ret != Z_OK) {
-        free(outBuffer);
-        return luaL_error(L, "lerl_decoder.decodeCompressed: Failed to uncompresss compressed item.");
-    }
+    the_decoder->data = NULL;
+    the_decoder->size = 0;
+    the_decoder->invalid = true;
+    atomic_store_explicit(&shared->tail, tail + RING_ALIGN(sizeof(uint32_t) + length), memory_order_release);
+    if (status != LUA_OK)
+        return lua_error(L);
+    return lua_gettop(L) - 1;
+}
 
-    lerl_decoder* children = lua_newuserdata(L, sizeof(lerl_decoder));
-    children->data = outBuffer;
-    children->size = uncompressedSize;
-    children->invalid = false;
-    children->empty_ref = the_decoder->empty_ref;
-    children->offset = 0;
+/* Blocks until a record is available or timeout milliseconds pass (forever if omitted). */
+static int lerl_ring_wait(lua_State* L) {
+    lerl_ring* ring = lerl_get_ring(L, 1);
+    int timeout = (int)luaL_optinteger(L, 2, -1);
 
-    luaL_getmetatable(L, lerl_decoder_type);
-    lua_setmetatable(L, -2); // Stack : decoder, ... children
-    lua_insert(L, 1); // Stack : children, decoder, ...
-    lerl_unpack(L); // Stack : children, decoder, value, ...
-    children->data = NULL;
-    children->size = 0;
-    children->offset = 0;
-    free(outBuffer);
+    size_t tail, pos;
+    uint32_t length;
+    if (lerl_ring_next(ring, &tail, &pos, &length)) {
+        lua_pushboolean(L, true);
+        return 1;
+    }
+
+    struct pollfd pfd = {ring->shared->wake_read, POLLIN, 0};
+    poll(&pfd, 1, timeout);
+    lua_pushboolean(L, lerl_ring_next(ring, &tail, &pos, &length));
+    return 1;
+}
 
-    lua_copy(L, 2, 1); // Stack: decoder, decoder, value, ...
-    lua_remove(L, 2); // Stack: decoder, value, ...
-    return 1;
+static int lerl_ring_close(lua_State* L) {
+    lerl_ring* ring = luaL_checkudata(L, 1, lerl_ring_type);
+    lerl_ring_shared* shared = ring->shared;
+    ring->shared = NULL;
+    if (shared == NULL)
+        return 0;
+
+    pthread_mutex_lock(&lerl_rings_lock);
+    lerl_ring_entry** link = &lerl_rings;
+    while (*link != NULL && (*link)->id != ring->id)
+        link = &(*link)->next;
+    lerl_ring_entry* entry = *link;
+    bool last = entry != NULL && --entry->refs == 0;
+    if (last)
+        *link = entry->next;
+    pthread_mutex_unlock(&lerl_rings_lock);
+
+    if (last) {
+        free(entry);
+        lerl_ring_unmap(shared);
+    }
+    return 0;
 }
 
-static int lerl_decodeReference(lua_State* L) {
-    lua_createtable(L, 0, 3);
-    lua_pushliteral(L, "node");
-    lerl_unpack(L);
-    lua_settable(L, -3);
+static luaL_Reg ring_metamethods[] = {
+    {"__gc", lerl_ring_close},
+    {"__close", lerl_ring_close},
+    {NULL, NULL}
+};
 
-    lua_pushliteral(L, "ids");
-    lua_createtable(L, 1, 0);
-    lerl_read32(L);
-    lua_rawseti(L, -2, 1);
-    lua_settable(L, -3);
+static luaL_Reg ring_methods[] = {
+    {"push", lerl_ring_push},
+    {"pop", lerl_ring_pop},
+    {"wait", lerl_ring_wait},
+    {"fd", lerl_ring_fd},
+    {"handle", lerl_ring_handle},
+    {"close", lerl_ring_close},
+    {NULL, NULL}
+};
 
-    lua_pushliteral(L, "creation");
-    lerl_read8(L);
+static int lerl_ring_init(lua_State* L) {
+    luaL_newmetatable(L, lerl_ring_type);
+    luaL_setfuncs(L, ring_metamethods, 0);
+    lua_pushliteral(L, "__index");
+    lua_createtable(L, 0, 6);
+    luaL_setfuncs(L, ring_methods, 0);
     lua_settable(L, -3);
-    return 1;
+    lua_pop(L, 1);
+    return 0;
 }
 
-static int lerl_decodeNewReference(lua_State* L) {
-    uint16_t len = lerl_read16_out(L);
-
-    lua_createtable(L, 0, 3);
-    lua_pushliteral(L, "node");
-    lerl_unpack(L);
-    lua_settable(L, -3);
+#endif
 
-    lua_createtable(L, 0, 3);
-    lua_pushliteral(L, "creation");
-    lerl_read8(L);
-    lua_settable(L, -3);
+/* Persistent deflate streams for outbound links. Every chunk ends with a sync
+   flush, so the peer can inflate each one as it arrives while the window carries
+   across messages. Encoders are compressed straight from their buffer. Threaded
+   deflaters do the work on a worker thread and signal finished chunks on a
+   descriptor. */
 
-    lua_pushliteral(L, "ids");
+#define lerl_deflater_type "lerl_deflater"
+#define DEFLATER_MAX_SPARES 4
 
-    lua_createtable(L, len, 0);
+typedef struct lerl_deflate_job {
+    struct lerl_deflate_job* next;
+    erlpack_buffer in;
+    erlpack_buffer out;
+    bool reset; // Resets the stream instead of compressing.
+    bool failed;
+} lerl_deflate_job;
 
-    for (uint16_t i = 1; i <= len; ++i){
-        lerl_read32(L);
-        lua_rawseti(L, -2, i);
-    }
+typedef struct {
+    z_stream z;
+    bool open;
+    erlpack_buffer out; // Scratch output of unthreaded deflaters.
+#ifdef LERL_HAS_THREADS
+    bool threaded;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    bool stop;
+    lerl_deflate_job* queue; // Oldest first, guarded by lock.
+    lerl_deflate_job** queue_tail;
+    lerl_deflate_job* done; // Oldest first, guarded by lock.
+    lerl_deflate_job** done_tail;
+    erlpack_buffer spares[DEFLATER_MAX_SPARES]; // Input buffers to hand back to encoders.
+    int spare_count;
+    int wake_read;
+    int wake_write;
+#endif
+} lerl_deflater;
 
-    lua_settable(L, -3);
-    return 1;
+static lerl_deflater* lerl_get_deflater(lua_State* L, int at) {
+    lerl_deflater* d = luaL_checkudata(L, at, lerl_deflater_type);
+    if (!d->open)
+        luaL_error(L, "lerl_deflater: Deflater is closed.");
+    return d;
 }
 
-static int lerl_decodePort(lua_State* L) {
-    lua_createtable(L, 0, 3);
-    lua_pushliteral(L, "node");
-    lerl_unpack(L);
-    lua_settable(L, -3);
+/* Compresses len bytes onto out and sync flushes. Returns false if zlib or the
+   allocator failed. */
+static bool lerl_deflate_chunk(z_stream* z, const char* in, size_t len, erlpack_buffer* out) {
+    z->next_in = (Bytef*)in;
+    z->avail_in = 0;
+    do {
+        if (z->avail_in == 0) {
+            uInt step = len > UINT_MAX ? UINT_MAX : (uInt)len;
+            z->avail_in = step;
+            len -= step;
+        }
 
-    lua_pushliteral(L, "id");
-    lerl_read32(L);
-    lua_settable(L, -3);
+        size_t room = deflateBound(z, z->avail_in) + 16;
+        if (out->allocated_size - out->length < room) {
+            char* buf = realloc(out->buf, out->length + room);
+            if (buf == NULL)
+                return false;
+            out->buf = buf;
+            out->allocated_size = out->length + room;
+        }
 
-    lua_pushliteral(L, "creation");
-    lerl_read8(L);
-    lua_settable(L, -3);
-    return 1;
+        z->next_out = (Bytef*)out->buf + out->length;
+        z->avail_out = (uInt)(out->allocated_size - out->length > UINT_MAX ? UINT_MAX : out->allocated_size - out->length);
+        uInt before = z->avail_out;
+        int ret = deflate(z, len > 0 ? Z_NO_FLUSH : Z_SYNC_FLUSH);
+        out->length += before - z->avail_out;
+        if (ret != Z_OK && ret != Z_BUF_ERROR)
+            return false;
+    } while (len > 0 || z->avail_in > 0 || z->avail_out == 0);
+    return true;
 }
 
-static int lerl_decodePID(lua_State* L) {
-    lua_createtable(L, 0, 4);
-    lua_pushliteral(L, "node");
-    lerl_unpack(L);
-    lua_settable(L, -3);
-
-    lua_pushliteral(L, "id");
-    lerl_read32(L);
-    lua_settable(L, -3);
-
-    lua_pushliteral(L, "serial");
-    lerl_read32(L);
-    lua_settable(L, -3);
+/* The bytes to compress: an encoder's buffer, which is then reset as by release,
+   or a string. */
+static const char* lerl_deflate_input(lua_State* L, int at, size_t* len, lerl_encoder** e) {
+    *e = luaL_testudata(L, at, lerl_encoder_type);
+    if (*e == NULL)
+        return luaL_checklstring(L, at, len);
+    if (lerl_streaming(*e))
+        luaL_error(L, "lerl_deflater: Streaming encoders cannot be compressed.");
+    if ((*e)->ret != 0)
+        luaL_error(L, "lerl_deflater: Encoder buffer is in a bad state.");
+    *len = (*e)->pk.length;
+    return (*e)->pk.buf;
+}
 
-    lua_pushliteral(L, "creation");
-    lerl_read8(L);
-    lua_settable(L, -3);
-    return 1;
+static void lerl_reset_encoder_buffer(lua_State* L, lerl_encoder* e) {
+    e->pk.length = 0;
+    e->ret = erlpack_append_version(&e->pk);
+    if (e->ret != 0)
+        lua_warning(L, "lerl_deflater: Issue re-initializing buffer.", 0);
 }
 
-static int lerl_decodeExport(lua_State* L) {
-    lua_createtable(L, 0, 3);
-    lua_pushliteral(L, "mod");
-    lerl_unpack(L);
-    lua_settable(L, -3);
+/* Compresses an encoder's buffer or a string and returns the chunk. */
+static int lerl_deflater_compress(lua_State* L) {
+    lerl_deflater* d = lerl_get_deflater(L, 1);
+#ifdef LERL_HAS_THREADS
+    if (d->threaded)
+        return luaL_error(L, "lerl_deflater.compress: Threaded deflaters take submit instead.");
+#endif
+    size_t len;
+    lerl_encoder* e;
+    const char* in = lerl_deflate_input(L, 2, &len, &e);
 
-    lua_pushliteral(L, "fun");
-    lerl_unpack(L);
-    lua_settable(L, -3);
+    d->out.length = 0;
+    if (!lerl_deflate_chunk(&d->z, in, len, &d->out))
+        return luaL_error(L, "lerl_deflater.compress: Failed to compress.");
+    if (e != NULL)
+        lerl_reset_encoder_buffer(L, e);
 
-    lua_pushliteral(L, "arity");
-    lerl_unpack(L);
-    lua_settable(L, -3);
+    lua_pushlstring(L, d->out.buf, d->out.length);
     return 1;
 }
 
-static int lerl_unpack(lua_State* L) {
-    lerl_decoder* the_decoder = lerl_get_decoder(L, 1);
-
-    if (the_decoder->invalid)
-        return luaL_error(L, "Unpacking an invalidated buffer");
+#ifdef LERL_HAS_THREADS
 
-    if (the_decoder->offset > the_decoder->size)
-        return luaL_error(L, "Unpacking beyond the end of the buffer");
+static void* lerl_deflate_worker(void* arg) {
+    lerl_deflater* d = arg;
+    pthread_mutex_lock(&d->lock);
+    for (;;) {
+        while (d->queue == NULL && !d->stop)
+            pthread_cond_wait(&d->wake, &d->lock);
+        if (d->queue == NULL)
+            break;
 
-    uint8_t type = lerl_read8_out(L);
+        lerl_deflate_job* job = d->queue;
+        d->queue = job->next;
+        if (d->queue == NULL)
+            d->queue_tail = &d->queue;
+        pthread_mutex_unlock(&d->lock);
+
+        job->next = NULL;
+        if (job->reset)
+            job->failed = deflateReset(&d->z) != Z_OK;
+        else
+            job->failed = !lerl_deflate_chunk(&d->z, job->in.buf, job->in.length, &job->out);
+
+        pthread_mutex_lock(&d->lock);
+        *d->done_tail = job;
+        d->done_tail = &job->next;
+        pthread_mutex_unlock(&d->lock);
+
+        uint64_t one = 1;
+        ssize_t written = write(d->wake_write, &one, d->wake_write == d->wake_read ? sizeof(one) : 1);
+        (void)written; // A full pipe already signals the reader.
+        pthread_mutex_lock(&d->lock);
+    }
+    pthread_mutex_unlock(&d->lock);
+    return NULL;
+}
 
-    switch(type) {
-        case SMALL_INTEGER_EXT:
-            lerl_decodeSmallInteger(L);
-            return 1;
-        case INTEGER_EXT:
-            lerl_decodeInteger(L);
-            return 1;
-        case FLOAT_EXT:
-            lerl_decodeFloat(L);
-            return 1;
-        case NEW_FLOAT_EXT:
-            lerl_decodeNewFloat(L);
-            return 1;
-        case ATOM_EXT:
-            lerl_decodeAtom(L);
-            return 1;
-        case SMALL_ATOM_EXT:
-            lerl_decodeSmallAtom(L);
-            return 1;
-        case SMALL_TUPLE_EXT:
-            lerl_decodeSmallTuple(L);
-            return 1;
-        case LARGE_TUPLE_EXT:
-            lerl_decodeLargeTuple(L);
-            return 1;
-        case NIL_EXT:
-            lerl_decodeNil(L);
-            return 1;
-        case STRING_EXT:
-            lerl_decodeStringAsList(L);
-            return 1;
-        case LIST_EXT:
-            lerl_decodeList(L);
-            return 1;
-        case MAP_EXT:
-            lerl_decodeMap(L);
-            return 1;
-        case BINARY_EXT:
-            lerl_decodeBinary(L);
-            return 1;
-        case SMALL_BIG_EXT:
-            lerl_decodeSmallBig(L);
-            return 1;
-        case LARGE_BIG_EXT:
-            lerl_decodeLargeBig(L);
-            return 1;
-        case REFERENCE_EXT:
-            lerl_decodeReference(L);
-            return 1;
-        case NEW_REFERENCE_EXT:
-            lerl_decodeNewReference(L);
-            return 1;
-        case PORT_EXT:
-            lerl_decodePort(L);
-            return 1;
-        case PID_EXT:
-            lerl_decodePID(L);
-            return 1;
-        case EXPORT_EXT:
-            lerl_decodeExport(L);
-            return 1;
-        case COMPRESSED:
-            lerl_decodeCompressed(L);
-            return 1;
-        default:
-            return luaL_error(L, "Unsupported erlang term type identifier found");
+static void lerl_free_jobs(lerl_deflate_job* job) {
+    while (job != NULL) {
+        lerl_deflate_job* next = job->next;
+        free(job->in.buf);
+        free(job->out.buf);
+        free(job);
+        job = next;
     }
 }
 
-static int lerl_unpack_fun(lua_State* L) {
-    if (lerl_unpack(L)) {
-        return 1;
-    } else {
-        lerl_decoder* the_decoder = lerl_get_decoder(L, 1);
-        lua_pushnil(L);
-        lua_pushinteger(L, the_decoder->offset);
-        return 2;
+static void lerl_deflater_enqueue(lerl_deflater* d, lerl_deflate_job* job) {
+    pthread_mutex_lock(&d->lock);
+    *d->queue_tail = job;
+    d->queue_tail = &job->next;
+    pthread_cond_signal(&d->wake);
+    pthread_mutex_unlock(&d->lock);
+}
+
+static lerl_deflater* lerl_get_threaded_deflater(lua_State* L, int at, const char* what) {
+    lerl_deflater* d = lerl_get_deflater(L, at);
+    if (!d->threaded)
+        luaL_error(L, "lerl_deflater.%s: Only threaded deflaters can do this.", what);
+    return d;
+}
+
+/* Queues an encoder's buffer or a string for the worker. An encoder's buffer is
+   handed over whole and the encoder gets a spare one back, so nothing is copied. */
+static int lerl_deflater_submit(lua_State* L) {
+    lerl_deflater* d = lerl_get_threaded_deflater(L, 1, "submit");
+    size_t len;
+    lerl_encoder* e;
+    const char* in = lerl_deflate_input(L, 2, &len, &e);
+
+    lerl_deflate_job* job = calloc(1, sizeof(lerl_deflate_job));
+    if (job == NULL)
+        return luaL_error(L, "lerl_deflater.submit: Failed to allocate job.");
+
+    if (e != NULL) {
+        job->in = e->pk;
+        if (d->spare_count > 0)
+            e->pk = d->spares[--d->spare_count];
+        else
+            memset(&e->pk, 0, sizeof(e->pk));
+        lerl_reset_encoder_buffer(L, e);
+    } else if (len > 0 && erlpack_buffer_write(&job->in, in, len) != 0) {
+        free(job);
+        return luaL_error(L, "lerl_deflater.submit: Failed to allocate job.");
     }
+
+    lerl_deflater_enqueue(d, job);
+    return 0;
 }
 
-static int lerl_unpack_all(lua_State* L) {
-    lerl_decoder* the_decoder = lerl_get_decoder(L, 1);
-    int count = 0;
-    while((the_decoder->offset < the_decoder->size) && !the_decoder->invalid){
-        count = count + 1;
-        lerl_unpack(L);
+/* Returns the chunks finished since the last call, oldest first. */
+static int lerl_deflater_collect(lua_State* L) {
+    lerl_deflater* d = lerl_get_threaded_deflater(L, 1, "collect");
+    uint64_t count;
+    while (read(d->wake_read, &count, d->wake_write == d->wake_read ? sizeof(count) : 1) > 0);
+
+    pthread_mutex_lock(&d->lock);
+    lerl_deflate_job* job = d->done;
+    d->done = NULL;
+    d->done_tail = &d->done;
+    pthread_mutex_unlock(&d->lock);
+
+    lua_newtable(L);
+    lua_Integer n = 0;
+    bool failed = false;
+    while (job != NULL) {
+        lerl_deflate_job* next = job->next;
+        failed = failed || job->failed;
+        if (!job->reset && !failed) {
+            lua_pushlstring(L, job->out.buf, job->out.length);
+            lua_rawseti(L, -2, ++n);
+        }
+
+        if (job->in.buf != NULL && d->spare_count < DEFLATER_MAX_SPARES) {
+            job->in.length = 0;
+            d->spares[d->spare_count++] = job->in;
+        } else {
+            free(job->in.buf);
+        }
+        free(job->out.buf);
+        free(job);
+        job = next;
     }
-    lua_remove(L, 1);
-    return count;
+
+    if (failed)
+        return luaL_error(L, "lerl_deflater.collect: Failed to compress.");
+    return 1;
 }
 
-static int lerl_decoder_gc(lua_State* L) {
-    lerl_decoder* the_decoder = lerl_get_decoder(L, 1);
+static int lerl_deflater_fd(lua_State* L) {
+    lerl_deflater* d = lerl_get_threaded_deflater(L, 1, "fd");
+    lua_pushinteger(L, d->wake_read);
+    return 1;
+}
 
-    if (the_decoder->data != NULL)
-        free(the_decoder->data);
+#endif
 
-    the_decoder->size = 0;
-    the_decoder->invalid = true;
-    the_decoder->offset = 0;
-    lua_getfield(L, LUA_REGISTRYINDEX, "lerl_empty");
-    int defaultref = lua_tointeger(L, -1);
-    if (the_decoder->empty_ref != defaultref)
-        luaL_unref(L, LUA_REGISTRYINDEX, defaultref);
+/* Starts a new stream, for a new connection. Threaded deflaters reset once the
+   chunks submitted before have been compressed. */
+static int lerl_deflater_reset(lua_State* L) {
+    lerl_deflater* d = lerl_get_deflater(L, 1);
+#ifdef LERL_HAS_THREADS
+    if (d->threaded) {
+        lerl_deflate_job* job = calloc(1, sizeof(lerl_deflate_job));
+        if (job == NULL)
+            return luaL_error(L, "lerl_deflater.reset: Failed to allocate job.");
+        job->reset = true;
+        lerl_deflater_enqueue(d, job);
+        return 0;
+    }
+#endif
+    if (deflateReset(&d->z) != Z_OK)
+        return luaL_error(L, "lerl_deflater.reset: Failed to reset the stream.");
+    return 0;
+}
 
-    lua_pop(L, 1);
+static int lerl_deflater_close(lua_State* L) {
+    lerl_deflater* d = luaL_checkudata(L, 1, lerl_deflater_type);
+    if (!d->open)
+        return 0;
+    d->open = false;
+
+#ifdef LERL_HAS_THREADS
+    if (d->threaded) {
+        pthread_mutex_lock(&d->lock);
+        d->stop = true;
+        pthread_cond_signal(&d->wake);
+        pthread_mutex_unlock(&d->lock);
+        pthread_join(d->thread, NULL);
+
+        lerl_free_jobs(d->queue);
+        lerl_free_jobs(d->done);
+        for (int i = 0; i < d->spare_count; i++)
+            free(d->spares[i].buf);
+        pthread_mutex_destroy(&d->lock);
+        pthread_cond_destroy(&d->wake);
+        close(d->wake_read);
+        if (d->wake_write != d->wake_read)
+            close(d->wake_write);
+    }
+#endif
+    deflateEnd(&d->z);
+    free(d->out.buf);
+    d->out.buf = NULL;
     return 0;
 }
 
-static int lerl_make_array(lua_State* L) {
-    if (!lua_isnoneornil(L, 1)) {
-        luaL_getmetatable(L, lerl_array_mt);
-        lua_setmetatable(L, -2);
-        return 1;
-    } else {
-        lua_newtable(L);
-        luaL_getmetatable(L, lerl_array_mt);
-        lua_setmetatable(L, -2);
-        return 1;
+#ifdef LERL_HAS_THREADS
+/* Sets up the wakeup descriptor and worker. Returns an error message or NULL. */
+static const char* lerl_deflater_start(lerl_deflater* d) {
+#ifdef __linux__
+    d->wake_read = d->wake_write = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (d->wake_read < 0)
+        return "Unable to create a wakeup descriptor.";
+#else
+    int fds[2];
+    if (pipe(fds) != 0)
+        return "Unable to create a wakeup descriptor.";
+    fcntl(fds[0], F_SETFL, O_NONBLOCK);
+    fcntl(fds[1], F_SETFL, O_NONBLOCK);
+    d->wake_read = fds[0];
+    d->wake_write = fds[1];
+#endif
+
+    d->queue = d->done = NULL;
+    d->queue_tail = &d->queue;
+    d->done_tail = &d->done;
+    d->spare_count = 0;
+    d->stop = false;
+    pthread_mutex_init(&d->lock, NULL);
+    pthread_cond_init(&d->wake, NULL);
+    if (pthread_create(&d->thread, NULL, lerl_deflate_worker, d) != 0) {
+        pthread_mutex_destroy(&d->lock);
+        pthread_cond_destroy(&d->wake);
+        close(d->wake_read);
+        if (d->wake_write != d->wake_read)
+            close(d->wake_write);
+        return "Unable to start the worker thread.";
     }
+    return NULL;
 }
+#endif
 
+/* lerl.new_deflater{level = 0..9, window = 9..15, memlevel = 1..9, raw, threaded}.
+   Defaults are zlib's: level 6, a 32 KiB window (15) and memlevel 8, writing a
+   zlib header unless raw is set. */
+static int lerl_new_deflater(lua_State* L) {
+    lua_settop(L, 1);
+    if (!lua_isnil(L, 1))
+        luaL_checktype(L, 1, LUA_TTABLE);
+    lua_Integer level = lerl_opt_integer(L, 1, "level", Z_DEFAULT_COMPRESSION);
+    lua_Integer window = lerl_opt_integer(L, 1, "window", 15);
+    lua_Integer memlevel = lerl_opt_integer(L, 1, "memlevel", 8);
+    bool raw = lerl_opt_boolean(L, 1, "raw", false);
+    bool threaded = lerl_opt_boolean(L, 1, "threaded", false);
+
+    luaL_argcheck(L, level >= Z_DEFAULT_COMPRESSION && level <= 9, 1, "level must be 0 to 9");
+    luaL_argcheck(L, window >= 9 && window <= 15, 1, "window must be 9 to 15");
+    luaL_argcheck(L, memlevel >= 1 && memlevel <= 9, 1, "memlevel must be 1 to 9");
+#ifndef LERL_HAS_THREADS
+    if (threaded)
+        return luaL_error(L, "lerl.new_deflater: Threaded deflaters are not supported on this platform.");
+#endif
 
-static int lerl_make_map(lua_State* L) {
-    if (!lua_isnoneornil(L, 1)) {
-        luaL_getmetatable(L, lerl_map_mt);
-        lua_setmetatable(L, -2);
-        return 1;
-    } else {
-        lua_newtable(L);
-        luaL_getmetatable(L, lerl_map_mt);
-        lua_setmetatable(L, -2);
-        return 1;
+    lerl_deflater* d = lua_newuserdatauv(L, sizeof(lerl_deflater), 0);
+    memset(d, 0, sizeof(lerl_deflater));
+    if (deflateInit2(&d->z, (int)level, Z_DEFLATED, raw ? -(int)window : (int)window, (int)memlevel, Z_DEFAULT_STRATEGY) != Z_OK)
+        return luaL_error(L, "lerl.new_deflater: Failed to initialize zlib.");
+
+#ifdef LERL_HAS_THREADS
+    if (threaded) {
+        const char* error = lerl_deflater_start(d);
+        if (error != NULL) {
+            deflateEnd(&d->z);
+            return luaL_error(L, "lerl.new_deflater: %s", error);
+        }
+        d->threaded = true;
     }
+#endif
+    d->open = true;
+    luaL_getmetatable(L, lerl_deflater_type);
+    lua_setmetatable(L, -2);
+    return 1;
 }
 
-const luaL_Reg decoder_metamethods[] = {
-    {"__gc", lerl_decoder_gc},
+static luaL_Reg deflater_metamethods[] = {
+    {"__gc", lerl_deflater_close},
+    {"__close", lerl_deflater_close},
     {NULL, NULL}
 };
 
-const luaL_Reg decoder_methods[] = {
-    {"unpack", lerl_unpack_fun},
-    {"unpack_all", lerl_unpack_all},
-    {"reset", lerl_reset_decoder},
-    {"read8", lerl_read8},
-    {"read16", lerl_read16},
-    {"read32", lerl_read32},
-    {"read64", lerl_read64},
+static luaL_Reg deflater_methods[] = {
+    {"compress", lerl_deflater_compress},
+#ifdef LERL_HAS_THREADS
+    {"submit", lerl_deflater_submit},
+    {"collect", lerl_deflater_collect},
+    {"fd", lerl_deflater_fd},
+#endif
+    {"reset", lerl_deflater_reset},
+    {"close", lerl_deflater_close},
     {NULL, NULL}
 };
 
+static int lerl_deflater_init(lua_State* L) {
+    luaL_newmetatable(L, lerl_deflater_type);
+    luaL_setfuncs(L, deflater_metamethods, 0);
+    lua_pushliteral(L, "__index");
+    lua_createtable(L, 0, 6);
+    luaL_setfuncs(L, deflater_methods, 0);
+    lua_settable(L, -3);
+    lua_pop(L, 1);
+    return 0;
+}
+
 static int lerl_pack_encapsulated(lua_State* L) {
     lua_getfield(L, LUA_REGISTRYINDEX, "lerl_global_encoder");
     lua_insert(L, 1);
@@ -972,6 +5789,16 @@ static int lerl_pack_encapsulated(lua_State* L) {
     return lerl_release(L);
 }
 
+static int lerl_pack_framed(lua_State* L) {
+    luaL_checkinteger(L, 1);
+    int header = lerl_check_frame_header(L, 1);
+    lua_remove(L, 1);
+    lua_getfield(L, LUA_REGISTRYINDEX, "lerl_global_encoder");
+    lua_insert(L, 1);
+    lerl_pack_all(L);
+    return lerl_release_framed2(L, lerl_get_encoder(L, 1), header);
+}
+
 static int lerl_unpack_encapsulated(lua_State* L) {
     lua_getfield(L, LUA_REGISTRYINDEX, "lerl_global_decoder");
     lua_insert(L, 1);
@@ -980,13 +5807,105 @@ static int lerl_unpack_encapsulated(lua_State* L) {
     return lerl_unpack_all(L);
 }
 
+/* The C API from lerl.h. The caller's buffer is packed into by a stack-local
+   encoder, so nothing is copied and a failed pack leaves it owned by the caller. */
+
+_Static_assert(sizeof(lerl_buffer) == sizeof(erlpack_buffer)
+    && offsetof(lerl_buffer, length) == offsetof(erlpack_buffer, length)
+    && offsetof(lerl_buffer, allocated_size) == offsetof(erlpack_buffer, allocated_size),
+    "lerl_buffer must match erlpack_buffer");
+
+LERL_API void lerl_encode(lua_State* L, int first, int last, lerl_buffer* out) {
+    first = lua_absindex(L, first);
+    last = lua_absindex(L, last);
+
+    lerl_encoder e;
+    memset(&e, 0, sizeof(e));
+    e.out = (erlpack_buffer*)out;
+    e.sink_ref = LUA_NOREF;
+    e.shapes_ref = LUA_NOREF;
+
+    if (erlpack_append_version(e.out) != 0)
+        luaL_error(L, "lerl_encode: Failed to allocate buffer!");
+
+    int top = lua_gettop(L);
+    for (int i = first; i <= last; i++) {
+        lerl_pack_at(L, &e, i, DEFAULT_RECURSE_LIMIT);
+        lua_settop(L, top);
+    }
+}
+
+LERL_API int lerl_decode(lua_State* L, const char* data, size_t len, int options) {
+    if (len > INT_MAX)
+        return luaL_error(L, "lerl_decode: Buffer must be under 2GB.");
+
+    if (options != 0)
+        options = lua_absindex(L, options);
+
+    lua_getfield(L, LUA_REGISTRYINDEX, "lerl_empty");
+    int empty_ref = lua_tointeger(L, -1);
+    lua_pop(L, 1);
+
+    lerl_push_empty_decoder(L, empty_ref);
+    int base = lua_gettop(L);
+    lerl_decoder* the_decoder = lerl_get_decoder(L, base);
+    if (options != 0)
+        lerl_configure_decoder(L, the_decoder, options);
+
+    the_decoder->data = (char*)data;
+    the_decoder->size = len;
+    the_decoder->data_kind = LERL_DATA_BORROWED;
+    the_decoder->invalid = false;
+
+    if (lerl_read8_out(L, the_decoder) != FORMAT_VERSION)
+        return luaL_error(L, "lerl_decode: Version mismatch!");
+
+    lerl_check_buffer(L, the_decoder, "lerl_decode");
+
+    while (the_decoder->offset < the_decoder->size) {
+        luaL_checkstack(L, 1, "lerl_decode: Too many terms.");
+        lerl_unpack(L, the_decoder);
+    }
+
+    // Drop the borrowed pointer before the decoder is left to the collector.
+    the_decoder->data = NULL;
+    the_decoder->size = 0;
+    the_decoder->offset = 0;
+    the_decoder->invalid = true;
+
+    lua_remove(L, base);
+    return lua_gettop(L) - base + 1;
+}
+
+static const lerl_c_api lerl_c_api_table = {
+    LERL_C_API_VERSION,
+    lerl_decode,
+    lerl_encode,
+};
+
 const luaL_Reg lerl_functions[] = {
     {"new_encoder", lerl_new_encoder},
+    {"new_stream_encoder", lerl_new_stream_encoder},
     {"new_decoder", lerl_new_decoder},
     {"lerl_map", lerl_make_map},
     {"lerl_array", lerl_make_array},
+    {"lerl_tuple", lerl_make_tuple},
     {"empty_decoder", lerl_empty_decoder},
+    {"open_snapshot", lerl_open_snapshot},
+    {"new_snapshot_writer", lerl_new_snapshot_writer},
     {"pack", lerl_pack_encapsulated},
+    {"pack_framed", lerl_pack_framed},
+    {"to_json", lerl_to_json},
+    {"from_json", lerl_from_json},
+    {"validate", lerl_validate},
+    {"fingerprint", lerl_fingerprint},
+    {"classify", lerl_classify},
+    {"new_deflater", lerl_new_deflater},
+    {"new_cache", lerl_new_cache},
+#ifdef LERL_HAS_RING
+    {"new_ring", lerl_new_ring},
+    {"open_ring", lerl_open_ring},
+#endif
     {"unpack", lerl_unpack_encapsulated},
     {NULL, NULL}
 };
@@ -1041,20 +5960,47 @@ LUALIB_API int luaopen_lerl(lua_State* L) {
     lua_settable(L, -3);
     lua_pop(L, 1);
 
-    lerl_encoder_init(L);
-    lerl_decoder_init(L);
+    luaL_newmetatable(L, lerl_tuple_mt);
+    lua_pushliteral(L, "__lerl_type");
+    lua_pushliteral(L, "tuple");
+    lua_settable(L, -3);
+    lua_pop(L, 1);
 
-    lerl_new_encoder2(L, false);
-    lua_setfield(L, LUA_REGISTRYINDEX, "lerl_global_encoder");
+    luaL_newmetatable(L, lerl_binary_mt);
+    lua_pushliteral(L, "__lerl_type");
+    lua_pushliteral(L, "binary");
+    lua_settable(L, -3);
+    lua_pop(L, 1);
 
-    lerl_empty_decoder(L);
-    lua_setfield(L, LUA_REGISTRYINDEX, "lerl_global_decoder");
+    lerl_text_init();
+
+    lerl_encoder_init(L);
+    lerl_decoder_init(L);
+    lerl_cache_init(L);
+    lerl_vector_init(L);
+    lerl_ident_init(L);
+    lerl_deflater_init(L);
+#ifdef LERL_HAS_RING
+    lerl_ring_init(L);
+#endif
 
     lua_pushlightuserdata(L, (void*)lerl_empty);
     int default_empty = luaL_ref(L, LUA_REGISTRYINDEX);
     lua_pushinteger(L, default_empty);
     lua_setfield(L, LUA_REGISTRYINDEX, "lerl_empty");
 
+    lerl_new_encoder2(L, false, INITIAL_BUFFER_SIZE);
+    lua_setfield(L, LUA_REGISTRYINDEX, "lerl_global_encoder");
+
+    lerl_push_empty_decoder(L, default_empty);
+    lua_setfield(L, LUA_REGISTRYINDEX, "lerl_global_decoder");
+
+    lerl_new_encoder2(L, true, DEFAULT_CHUNK_SIZE);
+    lua_setfield(L, LUA_REGISTRYINDEX, "lerl_json_encoder");
+
+    lua_pushlightuserdata(L, (void*)&lerl_c_api_table);
+    lua_setfield(L, LUA_REGISTRYINDEX, LERL_C_API_KEY);
+
     luaL_newlibtable(L, lerl_functions);
     luaL_setfuncs(L, lerl_functions, 0);
 